@@ -6,9 +6,16 @@
 #include <infos/mm/page-allocator.h>
 #include <infos/mm/mm.h>
 #include <infos/kernel/kernel.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/kernel/log.h>
+#include <infos/kernel/process.h>
+#include <infos/kernel/thread.h>
 #include <infos/util/math.h>
-#include <infos/util/printf.h>
+#include <infos/util/lock.h>
+#include <infos/util/string.h>
+#include <infos/util/wakequeue.h>
+
+#include "slab.h"
 
 using namespace infos::kernel;
 using namespace infos::mm;
@@ -16,390 +23,3052 @@ using namespace infos::util;
 
 #define MAX_ORDER	18
 
-/**
- * A buddy page allocation algorithm.
- */
-class BuddyPageAllocator : public PageAllocatorAlgorithm
-{
-private:
+/* The number of CPUs that get their own page cache. */
+#define MAX_CPUS	8
+
+/* Orders up to and including this one are served from the per-CPU page caches. */
+#define PCP_MAX_ORDER	1
+
+/* Default watermarks and batch size of the per-CPU page caches, in blocks. */
+#define PCP_DEFAULT_LOW		16
+#define PCP_DEFAULT_HIGH	96
+#define PCP_DEFAULT_BATCH	32
+
+/* The number of buckets in the allocator's log2 latency histograms. */
+#define LATENCY_BUCKETS	32
+
+/* Pages are grouped by mobility in pageblocks of this order (2MiB). */
+#define PAGEBLOCK_ORDER	9
+
+/* The size of a page, in bytes. */
+#define BUDDY_PAGE_SIZE	0x1000
+
+/* Default watermarks of the pre-zeroed page pool, in pages.  The zeroing thread is woken when
+ * the pool falls below the low watermark, and fills it up to the high one. */
+#define ZERO_POOL_DEFAULT_LOW	64
+#define ZERO_POOL_DEFAULT_HIGH	256
+
+/* The order of a huge page (2MiB), and the number of free pages the huge page pool leaves
+ * for everything else when it refills. */
+#define HUGE_PAGE_ORDER			9
+#define HUGE_POOL_FREE_MARGIN	4096
+
+/* The number of records in each CPU's trace ring buffer.  This must be a power of two. */
+#define TRACE_RING_SIZE	4096
+
+/* The number of ranges that can be inserted before one arrives with room for the free bitmaps. */
+#define MAX_EARLY_RANGES	32
+
+/* The default number of pages kept back in each arena from allocations that fell back to it. */
+#define ARENA_DEFAULT_DMA_RESERVE	1024
+#define ARENA_DEFAULT_DMA32_RESERVE	0
+
+/* The number of shrinkers that can be asked to give memory back when an allocation fails. */
+#define MAX_SHRINKERS	4
+
+/* The number of free objects each CPU keeps to hand in a slab cache magazine. */
+#define SLAB_MAGAZINE_SIZE	32
+
+/* Slab objects are aligned to this many bytes, and slabs are made large enough to hold at
+ * least SLAB_MIN_OBJECTS of them, up to SLAB_MAX_ORDER. */
+#define SLAB_ALIGN			16
+#define SLAB_MIN_OBJECTS	8
+#define SLAB_MAX_ORDER		3
+
+/* The general purpose slab caches, for power-of-two sizes from 16 bytes to 2KiB. */
+#define SLAB_SIZE_CLASSES	8
+#define SLAB_MIN_SIZE		16
+
+/**
+ * A hierarchical bitmap with one bit per block.  Level 0 holds the block bits, and every
+ * level above holds one summary bit per word of the level below, set while that word is
+ * non-zero.  The top level is a single word, so finding the first set bit is one
+ * find-first-set per level, and setting or clearing a bit only climbs while a word
+ * changes between empty and non-empty.
+ */
+class FreeBitmap
+{
+public:
+	static constexpr int MAX_LEVELS = 6;
+
+	/**
+	 * Returns the number of words a bitmap of the given size needs, across all levels.
+	 * @param nr_bits The number of bits in level 0.
+	 * @return The number of 64-bit words of storage.
+	 */
+	static constexpr uint64_t words_for(uint64_t nr_bits)
+	{
+		uint64_t words = 0;
+		do {
+			nr_bits = (nr_bits + 63) / 64;
+			words += nr_bits;
+		} while (nr_bits > 1);
+
+		return words;
+	}
+
+	/**
+	 * Lays the bitmap out over the given storage, and clears every bit.
+	 * @param storage The storage to use, of at least words_for(nr_bits) words.
+	 * @param nr_bits The number of bits in level 0.
+	 * @return The number of words of storage used.
+	 */
+	uint64_t init(uint64_t *storage, uint64_t nr_bits)
+	{
+		uint64_t used = 0;
+		_nr_levels = 0;
+
+		do {
+			assert(_nr_levels < MAX_LEVELS);
+
+			nr_bits = (nr_bits + 63) / 64;
+			_levels[_nr_levels] = storage + used;
+			_nr_words[_nr_levels] = nr_bits;
+			_nr_levels++;
+
+			for (uint64_t i = 0; i < nr_bits; i++) {
+				storage[used + i] = 0;
+			}
+			used += nr_bits;
+		} while (nr_bits > 1);
+
+		return used;
+	}
+
+	/**
+	 * Tests a bit.
+	 * @param idx The bit to test.
+	 * @return Returns TRUE if the bit is set.
+	 */
+	bool test(uint64_t idx) const
+	{
+		return (__atomic_load_n(&_levels[0][idx >> 6], __ATOMIC_SEQ_CST) >> (idx & 63)) & 1;
+	}
+
+	/**
+	 * Sets a bit, and marks its word as non-empty in the levels above.
+	 * @param idx The bit to set.
+	 */
+	void set(uint64_t idx)
+	{
+		set_from(0, idx);
+	}
+
+	/**
+	 * Clears a bit, if it is set.  Several CPUs can race to clear the same bit, and exactly
+	 * one of them wins.
+	 * @param idx The bit to clear.
+	 * @return Returns TRUE if this call cleared the bit, or FALSE if it was already clear.
+	 */
+	bool claim(uint64_t idx)
+	{
+		uint64_t bit = 1ULL << (idx & 63);
+		uint64_t old = __atomic_fetch_and(&_levels[0][idx >> 6], ~bit, __ATOMIC_SEQ_CST);
+
+		if (!(old & bit)) { return false; }
+		if (old == bit) { clear_summary(1, idx >> 6); }
+		return true;
+	}
+
+	/**
+	 * Clears the first set bit at or after the given index.
+	 * @param from The index to start searching from.
+	 * @return Returns the index of the bit that was cleared, or -1 if there wasn't one.
+	 */
+	int64_t claim_next(uint64_t from)
+	{
+		while (true) {
+			int64_t idx = find_next(from);
+			if (idx < 0 || claim(idx)) { return idx; }
+		}
+	}
+
+	/**
+	 * @return Returns TRUE if no bits are set.
+	 */
+	bool empty() const
+	{
+		return __atomic_load_n(&_levels[_nr_levels - 1][0], __ATOMIC_SEQ_CST) == 0;
+	}
+
+	/**
+	 * Finds the first set bit at or after the given index.  Summary bits can briefly be out of
+	 * date while another CPU sets or clears a bit, and a stale one is repaired on the way down.
+	 * @param from The index to start searching from.
+	 * @return Returns the index of the set bit, or -1 if there isn't one.
+	 */
+	int64_t find_next(uint64_t from)
+	{
+		while (true) {
+			uint64_t idx = from;
+			int level = 0;
+
+			// climb until a word with a set bit at or after idx is found
+			while (true) {
+				if (level == _nr_levels) { return -1; }
+
+				uint64_t word = idx >> 6;
+				if (word >= _nr_words[level]) { return -1; }
+
+				uint64_t bits = __atomic_load_n(&_levels[level][word], __ATOMIC_SEQ_CST) & (~0ULL << (idx & 63));
+				if (bits) {
+					idx = (word << 6) | __builtin_ctzll(bits);
+					break;
+				}
+
+				idx = word + 1;
+				level++;
+			}
+
+			// descend, taking the first set bit of each word on the way down
+			bool stale = false;
+			while (level > 0) {
+				level--;
+
+				uint64_t bits = __atomic_load_n(&_levels[level][idx], __ATOMIC_SEQ_CST);
+				if (!bits) {
+					// the summary bit pointed at a word that has since emptied, so repair it and start again
+					clear_summary(level + 1, idx);
+					stale = true;
+					break;
+				}
+
+				idx = (idx << 6) | __builtin_ctzll(bits);
+			}
+
+			if (!stale) { return idx; }
+		}
+	}
+
+	/**
+	 * Finds the first set bit.
+	 * @return Returns the index of the set bit, or -1 if there isn't one.
+	 */
+	int64_t find_first() { return find_next(0); }
+
+	/**
+	 * Clears the first set bit.
+	 * @return Returns the index of the bit that was cleared, or -1 if there wasn't one.
+	 */
+	int64_t claim_first() { return claim_next(0); }
+
+private:
+	/**
+	 * Sets a bit at the given level, and climbs for as long as a word goes from empty to non-empty.
+	 * @param level The level to start at.
+	 * @param idx The bit to set, at that level.
+	 */
+	void set_from(int level, uint64_t idx)
+	{
+		for (; level < _nr_levels; level++) {
+			uint64_t old = __atomic_fetch_or(&_levels[level][idx >> 6], 1ULL << (idx & 63), __ATOMIC_SEQ_CST);
+			if (old) { break; }
+
+			idx >>= 6;
+		}
+	}
+
+	/**
+	 * Clears the summary bit of a word that has emptied, and climbs for as long as that
+	 * empties the summary word too.  A bit set in the word in the meantime puts the summary
+	 * bit straight back.
+	 * @param level The level of the summary bit.
+	 * @param idx The index of the word that emptied, in the level below.
+	 */
+	void clear_summary(int level, uint64_t idx)
+	{
+		for (; level < _nr_levels; level++) {
+			uint64_t bit = 1ULL << (idx & 63);
+			uint64_t old = __atomic_fetch_and(&_levels[level][idx >> 6], ~bit, __ATOMIC_SEQ_CST);
+
+			if (__atomic_load_n(&_levels[level - 1][idx], __ATOMIC_SEQ_CST)) {
+				set_from(level, idx);
+				return;
+			}
+			if (old != bit) { return; }
+
+			idx >>= 6;
+		}
+	}
+
+private:
+	uint64_t *_levels[MAX_LEVELS];
+	uint64_t _nr_words[MAX_LEVELS];
+	int _nr_levels;
+};
+
+/**
+ * How easily the pages of an allocation can be moved or reclaimed.  Free blocks are kept
+ * apart by the mobility of the pageblock they are in, so that long-lived kernel allocations
+ * do not end up scattered through memory that could otherwise be freed up in large blocks.
+ */
+enum MobilityType
+{
+	MOBILITY_UNMOVABLE = 0,
+	MOBILITY_RECLAIMABLE,
+	MOBILITY_MOVABLE,
+	MOBILITY_TYPES
+};
+
+/**
+ * The independent arenas physical memory is split into, from the lowest addresses up.  An
+ * allocation that prefers one arena can fall back to the arenas below it, but never above,
+ * so devices that can only address low memory are not crowded out of it.
+ */
+enum ArenaType
+{
+	ARENA_DMA = 0,		// below 16MiB
+	ARENA_DMA32,		// below 4GiB
+	ARENA_NORMAL,		// everything else
+	NR_ARENAS
+};
+
+/* The page frame each arena ends before. */
+static const pfn_t arena_end_pfns[NR_ARENAS] = { 0x1000, 0x100000, ~0ULL };
+
+/**
+ * Returns the number of words of bitmap storage needed for every order.
+ * @param nr_pages The number of pages covered.
+ * @param max_order The highest order.
+ */
+static constexpr uint64_t free_area_bitmap_words(uint64_t nr_pages, int max_order)
+{
+	uint64_t words = 0;
+	for (int order = 0; order <= max_order; order++) {
+		words += FreeBitmap::words_for((nr_pages + (1ULL << order) - 1) >> order);
+	}
+
+	return words;
+}
+
+/**
+ * Returns the number of words of bitmap storage needed for every arena, mobility type and
+ * order.  Splitting pages between arenas costs at most one extra partial word per level.
+ * @param nr_pages The number of page descriptors covered.
+ * @param max_order The highest order.
+ */
+static constexpr uint64_t arena_bitmap_words(uint64_t nr_pages, int max_order)
+{
+	return MOBILITY_TYPES * (free_area_bitmap_words(nr_pages, max_order) + NR_ARENAS * (max_order + 1) * FreeBitmap::MAX_LEVELS);
+}
+
+/**
+ * A test-and-set spin lock, guarding the free areas of one arena.  Interrupts must already be
+ * disabled when it is taken, so it is never taken again by an interrupt handler on the same CPU.
+ */
+class ArenaLock
+{
+public:
+	void lock()
+	{
+		while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+			while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) { __builtin_ia32_pause(); }
+		}
+	}
+
+	void unlock() { __atomic_clear(&_locked, __ATOMIC_RELEASE); }
+
+private:
+	bool _locked = false;
+};
+
+/**
+ * Holds an arena lock for as long as it is in scope.
+ */
+class UniqueArenaLock
+{
+public:
+	UniqueArenaLock(ArenaLock& lock) : _lock(lock) { _lock.lock(); }
+	~UniqueArenaLock() { _lock.unlock(); }
+
+private:
+	ArenaLock& _lock;
+};
+
+/**
+ * Returns the index of the CPU we are running on.  InfOS only brings up the boot processor,
+ * so for now this is always zero.
+ */
+static inline unsigned int current_cpu()
+{
+	return 0;
+}
+
+/**
+ * A per-CPU cache of low-order blocks, kept in front of the buddy free areas.  Blocks in a
+ * cache are allocated as far as the free areas are concerned, and are chained through their
+ * next_free pointers, in one chain per mobility type and order.  The owning CPU uses its cache
+ * with interrupts disabled, and takes the lock so that other CPUs can drain it.  The lock is
+ * almost never contended, and is taken before any arena's lock.
+ */
+struct PerCpuPageCache
+{
+	PageDescriptor* blocks[MOBILITY_TYPES][PCP_MAX_ORDER+1];
+	unsigned int count[MOBILITY_TYPES][PCP_MAX_ORDER+1];
+	ArenaLock lock;
+};
+
+/**
+ * Reads the CPU's cycle counter, for cheap latency measurements.
+ */
+static inline uint64_t read_cycle_counter()
+{
+	return __builtin_ia32_rdtsc();
+}
+
+/**
+ * The events the allocator can trace.
+ */
+enum BuddyTraceEvent
+{
+	TRACE_ALLOC = 0,		// a block was allocated, of the recorded order
+	TRACE_ALLOC_FAILED,		// an allocation of the recorded order failed
+	TRACE_FREE,				// a block was freed, of the recorded order
+	TRACE_ALLOC_RANGE,		// a contiguous range was allocated, of the recorded number of pages
+	TRACE_FREE_RANGE,		// a contiguous range was freed, of the recorded number of pages
+	TRACE_INSERT_RANGE,		// a range of the recorded number of pages was made available
+	TRACE_REMOVE_RANGE,		// a range of the recorded number of pages was made unavailable
+};
+
+/**
+ * A single trace record, in the binary format the trace is exported in.
+ */
+struct BuddyTraceRecord
+{
+	uint64_t timestamp;		// the CPU's cycle counter
+	uint32_t pfn;			// the first page frame, or ~0 if there is none
+	uint32_t arg : 24;		// the order, or the number of pages, depending on the event
+	uint32_t event : 4;
+	uint32_t cpu : 4;
+};
+
+/**
+ * A per-CPU ring buffer of trace records.  When it fills up, the oldest records are overwritten
+ * and counted as lost.  Only the owning CPU writes to a ring, with interrupts disabled.
+ */
+struct BuddyTraceRing
+{
+	BuddyTraceRecord records[TRACE_RING_SIZE];
+	uint64_t head, tail, lost;
+};
+
+/**
+ * Counters kept by each buddy allocator arena as it runs.  Latency histograms are log2 buckets of
+ * CPU cycles, so bucket i counts operations that took less than 2^(i+1) cycles.  Allocations
+ * are counted against the arena that served them.
+ */
+template<int MaxOrder>
+struct BuddyStats
+{
+	uint64_t free_blocks[MaxOrder+1];
+	uint64_t splits;
+	uint64_t merges;
+	uint64_t pageblock_steals;
+	uint64_t alloc_latency[LATENCY_BUCKETS];
+	uint64_t free_latency[LATENCY_BUCKETS];
+};
+
+/**
+ * Counters for allocations that failed, which no arena served, kept for the allocator as a whole.
+ */
+template<int MaxOrder>
+struct BuddyFailureStats
+{
+	uint64_t alloc_failures[MaxOrder+1];
+	uint64_t range_alloc_failures;
+	uint64_t latency[LATENCY_BUCKETS];
+};
+
+/**
+ * Adds to one of the counters, which several CPUs may be updating at once.
+ * @param counter The counter.
+ * @param delta The amount to add, which wraps around to subtract.
+ */
+static inline void stat_add(uint64_t& counter, uint64_t delta)
+{
+	__atomic_fetch_add(&counter, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * An independent arena of physical memory, with its own free areas, lock and counters.  Blocks
+ * never straddle two arenas, so each can be allocated from and freed to without touching the
+ * others.  Blocks are claimed from and given back to the free bitmaps atomically, so allocating
+ * a block of an order that is already free, or freeing one whose buddy is in use, never takes
+ * the lock.  Only splitting and merging blocks do, and only for as long as that takes.
+ * @tparam MaxOrder The highest order of block.
+ */
+template<int MaxOrder>
+class BuddyArena
+{
+	static_assert(MaxOrder >= PAGEBLOCK_ORDER && MaxOrder < 32, "MaxOrder must cover a pageblock, and fit a 32-bit page count");
+
+private:
+
+	/** Given an order, returns the number of pages in a block of that order.
+	 * @param order The order.
+	 * @return The number of pages.
+	*/
+	static constexpr pfn_t pages_per_block(int order)
+	{
+		return (pfn_t)1 << order;
+	}
+
+	/**
+	 * Given a block size, returns the lowest order whose blocks it fits inside.
+	 * @param block_size The block size.
+	 * @return The order.
+	 */
+	static constexpr int get_max_order(uint64_t block_size)
+	{
+		return block_size <= 1 ? 0 : 64 - __builtin_clzll(block_size - 1);
+	}
+
+	/**
+	 * Returns the page frame number of a page descriptor.
+	 * @param pgd The page descriptor.
+	 */
+	pfn_t pfn_of(const PageDescriptor* pgd) const
+	{
+		return pgd - _pgd_base;
+	}
+
+	/**
+	 * Returns the page descriptor of a page frame number.
+	 * @param pfn The page frame number.
+	 */
+	PageDescriptor* pgd_of(pfn_t pfn) const
+	{
+		return _pgd_base + pfn;
+	}
+
+	/** Given a page descriptor and an order, returns the offset between the start of the nearest
+	 * block of that order and the pfn of the page.
+	 * @param pgd The page descriptor to find the offset for.
+	 * @param order The order of block from which to check the offset.
+	 * @return The offset between the page and the start of the block.
+	 */
+	pfn_t page_offset_from_block(PageDescriptor* pgd, int order)
+	{
+		return pfn_of(pgd) & (pages_per_block(order) - 1);
+	}
+
+	/**
+	 * Given the first page of a block, returns the index of its bit in the free bitmap for its order.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param order The order of the block.
+	 * @return The bit index of the block.
+	 */
+	uint64_t block_index(PageDescriptor* block, int order)
+	{
+		return (pfn_of(block) >> order) - (_start_pfn >> order);
+	}
+
+	/**
+	 * Given a bit index in the free bitmap for an order, returns the first page of that block.
+	 * @param index The bit index of the block.
+	 * @param order The order of the block.
+	 * @return The page descriptor of the first page in the block.
+	 */
+	PageDescriptor* block_at(uint64_t index, int order)
+	{
+		return pgd_of((index + (_start_pfn >> order)) << order);
+	}
+
+	/**
+	 * Returns the free area a block belongs in, which depends on the mobility of its pageblock.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param order The order of the block.
+	 */
+	FreeBitmap& free_area_of(PageDescriptor* block, int order)
+	{
+		return _free_areas[block_mobility(block)][order];
+	}
+
+	/**
+	 * Helper function that inserts a block into the _free_areas array at the level specified in order.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param order The order level into which to insert the block.
+	 */
+	void insert_block_into_free_areas(PageDescriptor* block, int order)
+	{
+		assert(page_offset_from_block(block, order) == 0);
+		stat_add(_stats.free_blocks[order], 1);
+		free_area_of(block, order).set(block_index(block, order));
+	}
+
+	/**
+	 * Helper function that removes a block from a given order level in _free_areas, unless
+	 * another CPU gets to it first.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param order The order level from which to remove the block.
+	 * @return Returns TRUE if the block was removed, or FALSE if it was not free.
+	 */
+	bool claim_block(PageDescriptor* block, int order)
+	{
+		assert(block);
+		if (!free_area_of(block, order).claim(block_index(block, order))) { return false; }
+
+		stat_add(_stats.free_blocks[order], -1);
+		return true;
+	}
+
+	/**
+	 * Checks whether a block is free, at exactly the given order.  Blocks that are not
+	 * entirely inside the arena never are.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param order The order level to check.
+	 * @return Returns TRUE if the block is in the free area for that order.
+	 */
+	bool block_is_free(PageDescriptor* block, int order)
+	{
+		pfn_t pfn = pfn_of(block);
+		if (pfn < _start_pfn || pfn >= _end_pfn || _end_pfn - pfn < pages_per_block(order)) { return false; }
+
+		return free_area_of(block, order).test(block_index(block, order));
+	}
+
+	/**
+	 * Changes the mobility type of a pageblock, moving the free blocks that start in it over
+	 * to the free areas for the new type.  Callers must hold the arena's lock.  A block freed
+	 * without the lock while this runs can still land in the old type's free area, where it
+	 * stays allocatable but does not merge until it is next freed.
+	 * @param pageblock The index of the pageblock.
+	 * @param mobility The new mobility type.
+	 */
+	void set_pageblock_mobility(uint64_t pageblock, MobilityType mobility)
+	{
+		MobilityType old_mobility = (MobilityType)_pageblock_mobility[pageblock];
+		if (old_mobility == mobility) { return; }
+
+		pfn_t start = pageblock << PAGEBLOCK_ORDER;
+		for (int i = 0; i <= MaxOrder; i++)
+		{
+			// blocks of a pageblock or more can only start on the pageblock's first page
+			if (i > PAGEBLOCK_ORDER && (start & (pages_per_block(i) - 1))) { break; }
+
+			uint64_t first = (start >> i) - (_start_pfn >> i);
+			uint64_t last = i < PAGEBLOCK_ORDER ? first + pages_per_block(PAGEBLOCK_ORDER - i) : first + 1;
+
+			int64_t index = _free_areas[old_mobility][i].find_next(first);
+			while (index >= 0 && (uint64_t)index < last)
+			{
+				if (_free_areas[old_mobility][i].claim(index)) { _free_areas[mobility][i].set(index); }
+				index = _free_areas[old_mobility][i].find_next(index + 1);
+			}
+		}
+
+		__atomic_store_n(&_pageblock_mobility[pageblock], mobility, __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Takes a free block of at least the given order out of the free areas for a mobility type.
+	 * If there is none, a block is taken from another type instead, and the pageblock it comes
+	 * from is claimed for the requested type when the allocation is large, or is not movable.
+	 * Callers must hold the arena's lock.
+	 * @param order The smallest order that will do.
+	 * @param mobility The mobility type of the allocation.
+	 * @param found_order Returns the order of the block that was taken.
+	 * @return Returns the first page descriptor of the block, or NULL if there is no free block
+	 * large enough.
+	 */
+	PageDescriptor* take_block(int order, MobilityType mobility, int* found_order)
+	{
+		static const MobilityType fallbacks[MOBILITY_TYPES][MOBILITY_TYPES - 1] = {
+			{ MOBILITY_RECLAIMABLE, MOBILITY_MOVABLE },		// MOBILITY_UNMOVABLE
+			{ MOBILITY_UNMOVABLE, MOBILITY_MOVABLE },		// MOBILITY_RECLAIMABLE
+			{ MOBILITY_RECLAIMABLE, MOBILITY_UNMOVABLE },	// MOBILITY_MOVABLE
+		};
+
+		// the smallest block of the right type
+		for (int i = order; i <= MaxOrder; i++)
+		{
+			int64_t index = _free_areas[mobility][i].claim_first();
+			if (index < 0) { continue; }
+
+			stat_add(_stats.free_blocks[i], -1);
+			*found_order = i;
+			return block_at(index, i);
+		}
+
+		// otherwise the largest block of a fallback type, to steal as much as possible at once
+		for (MobilityType fallback : fallbacks[mobility])
+		{
+			for (int i = MaxOrder; i >= order; i--)
+			{
+				int64_t index = _free_areas[fallback][i].claim_first();
+				if (index < 0) { continue; }
+
+				stat_add(_stats.free_blocks[i], -1);
+				PageDescriptor* block = block_at(index, i);
+
+				// only hand over the pageblocks that the allocation actually needs
+				while (i > PAGEBLOCK_ORDER && i > order)
+				{
+					block = split_block(block, i);
+					i--;
+				}
+
+				if (i >= PAGEBLOCK_ORDER / 2 || mobility != MOBILITY_MOVABLE)
+				{
+					uint64_t pageblock = pfn_of(block) >> PAGEBLOCK_ORDER;
+					uint64_t nr_pageblocks = i > PAGEBLOCK_ORDER ? pages_per_block(i - PAGEBLOCK_ORDER) : 1;
+
+					for (uint64_t j = 0; j < nr_pageblocks; j++)
+					{
+						set_pageblock_mobility(pageblock + j, mobility);
+					}
+					stat_add(_stats.pageblock_steals, 1);
+				}
+
+				*found_order = i;
+				return block;
+			}
+		}
+
+		return NULL;
+	}
+
+	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
+	 * to the left or the right of PGD, in the given order.
+	 * @param pgd The page descriptor to find the buddy for.
+	 * @param order The order in which the page descriptor lives.
+	 * @return Returns the buddy of the given page descriptor, in the given order.
+	 */
+	PageDescriptor* buddy_of(PageDescriptor* pgd, int order)
+	{
+		assert(order <= MaxOrder);
+		return pgd_of(pfn_of(pgd) ^ pages_per_block(order));
+	}
+
+	/**
+	 * Given a block that has been taken out of the free areas at "source_order", this function
+	 * will split the block in half, and insert the right-hand half into the order below.
+	 * @param block The page descriptor of the first page in the block.
+	 * @param source_order The order of the block being split.  Naturally, the right-hand half
+	 * will be inserted into the order below.
+	 * @return Returns the left-hand-side of the split block, which is not in any free area.
+	 */
+	PageDescriptor* split_block(PageDescriptor* block, int source_order)
+	{
+		// assertions
+		assert(source_order <= MaxOrder);
+		assert(source_order > 0);
+
+		int new_order = source_order - 1;
+		insert_block_into_free_areas(block + pages_per_block(new_order), new_order);
+		stat_add(_stats.splits, 1);
+
+		return block;
+	}
+
+	/**
+	 * Takes a free block in the given source order, and merges it (and its free buddy) into the next order.
+	 * Either block can be allocated without the lock in the meantime, in which case nothing is merged.
+	 * Callers must hold the arena's lock.
+	 * @param block A block in the pair to merge.
+	 * @param source_order The order in which the pair of blocks live.
+	 * @return Returns the merged block, or NULL if the pair were not both free.
+	 */
+	PageDescriptor* merge_block(PageDescriptor* block, int source_order)
+	{
+		// assertions
+		assert(source_order >= 0 && source_order < MaxOrder);
+
+		// setup variables
+		PageDescriptor* buddy = buddy_of(block, source_order);
+		PageDescriptor* left_block = block < buddy ? block : buddy;
+
+		// remove block and buddy from the source order, and add the merged block to the next one
+		if (!claim_block(block, source_order)) { return NULL; }
+		if (!claim_block(buddy, source_order))
+		{
+			insert_block_into_free_areas(block, source_order);
+			return NULL;
+		}
+		insert_block_into_free_areas(left_block, source_order + 1);
+		stat_add(_stats.merges, 1);
+
+		return left_block;
+	}
+
+	/**
+	 * Keeps merging a free block with its buddy, for as long as the buddy is free too.  Callers
+	 * must hold the arena's lock.
+	 * @param block The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void merge_up(PageDescriptor* block, int order)
+	{
+		while (order < MaxOrder && block_is_free(buddy_of(block, order), order))
+		{
+			block = merge_block(block, order);
+			if (!block) { break; }
+			order++;
+		}
+	}
+
+	/**
+	 * Given a range of page frames, returns the order of the largest aligned block that starts
+	 * the range.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 * @return The order of the block.
+	 */
+	int largest_block_order(pfn_t from, pfn_t to)
+	{
+		int order = from ? __builtin_ctzll(from) : MaxOrder;
+		if (order > MaxOrder) { order = MaxOrder; }
+
+		while (pages_per_block(order) > to - from) { order--; }
+		return order;
+	}
+
+	/**
+	 * Gives a range of page frames to the free areas as the largest aligned blocks that fit,
+	 * without merging them with anything.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 */
+	void insert_range(pfn_t from, pfn_t to)
+	{
+		while (from < to)
+		{
+			int order = largest_block_order(from, to);
+			insert_block_into_free_areas(pgd_of(from), order);
+			from += pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Gives a range of page frames to the free areas as the largest aligned blocks that fit,
+	 * merging each with its buddy for as long as possible.  Callers must hold the arena's lock.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 */
+	void release_range(pfn_t from, pfn_t to)
+	{
+		while (from < to)
+		{
+			int order = largest_block_order(from, to);
+			PageDescriptor* block = pgd_of(from);
+
+			insert_block_into_free_areas(block, order);
+			merge_up(block, order);
+			from += pages_per_block(order);
+		}
+	}
+
+	/**
+	 * Claims the free block a page is in, and gives back whatever part of it sticks out of a
+	 * range.  Only the block itself is split, so this takes O(log n) steps however large it is.
+	 * Callers must hold the arena's lock.
+	 * @param pfn The page.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 * @return Returns the page frame after the part of the block inside the range, or 0 if the
+	 * page is not free.
+	 */
+	pfn_t claim_block_containing(pfn_t pfn, pfn_t from, pfn_t to)
+	{
+		// find the free block the page is in, if there is one
+		int order;
+		pfn_t start = pfn;
+		for (order = 0; order <= MaxOrder; order++)
+		{
+			start = pfn & ~(pages_per_block(order) - 1);
+			if (block_is_free(pgd_of(start), order)) { break; }
+		}
+
+		if (order > MaxOrder || !claim_block(pgd_of(start), order)) { return 0; }
+
+		pfn_t end = start + pages_per_block(order);
+		if (start < from) { insert_range(start, from); }
+		if (end > to) { insert_range(to, end); end = to; }
+
+		return end;
+	}
+
+	/**
+	 * Takes every page in a range of page frames out of the free areas.  Callers must hold
+	 * the arena's lock.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 * @return Returns TRUE if the range was taken, or FALSE if any page in it was not free, in
+	 * which case the free areas are left as they were.
+	 */
+	bool claim_range(pfn_t from, pfn_t to)
+	{
+		pfn_t pfn = from;
+		while (pfn < to)
+		{
+			pfn_t end = claim_block_containing(pfn, from, to);
+			if (!end)
+			{
+				release_range(from, pfn);
+				return false;
+			}
+
+			pfn = end;
+		}
+
+		return true;
+	}
+
+public:
+	/**
+	 * Takes a block of the given order out of the free areas, splitting a larger block if needed.
+	 * @param order The order of the block to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns the first page descriptor of the block, or NULL if there is no free block
+	 * large enough.
+	 */
+	PageDescriptor* allocate_block(int order, MobilityType mobility)
+	{
+		// a free block of exactly the right size and type can be claimed without the lock
+		int64_t index = _free_areas[mobility][order].claim_first();
+		if (index >= 0)
+		{
+			stat_add(_stats.free_blocks[order], -1);
+			return block_at(index, order);
+		}
+
+		UniqueArenaLock l(_lock);
+
+		int source_order;
+		PageDescriptor* block = take_block(order, mobility, &source_order);
+		if (!block) { return NULL; }
+
+		// split it down to size, giving the right-hand halves back to the free areas
+		while (source_order > order)
+		{
+			block = split_block(block, source_order);
+			source_order--;
+		}
+
+		return block;
+	}
+
+	/**
+	 * Gives a block back to the free areas, merging it with its buddy for as long as possible.
+	 * @param block The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void free_block(PageDescriptor* block, int order)
+	{
+		assert(!block_is_free(block, order));
+
+		// the buddy is checked after the block goes back, so that when two buddies are freed at
+		// once, at least one of the CPUs sees the other's block and merges the pair
+		insert_block_into_free_areas(block, order);
+		if (order == MaxOrder || !block_is_free(buddy_of(block, order), order)) { return; }
+
+		UniqueArenaLock l(_lock);
+		merge_up(block, order);
+	}
+
+	/**
+	 * Takes a number of blocks of the given order out of the free areas.  Each free block that
+	 * is taken is carved up directly into as many blocks as are still needed, and whatever is
+	 * left over goes back to the free areas as the largest aligned blocks that fit.
+	 * @param order The order of the blocks to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @param blocks The array to store the first page descriptor of each block in.
+	 * @param count The number of blocks to allocate.
+	 * @return Returns the number of blocks allocated, which is less than count if the free
+	 * areas ran out.
+	 */
+	unsigned int allocate_blocks_bulk(int order, MobilityType mobility, PageDescriptor** blocks, unsigned int count)
+	{
+		UniqueArenaLock l(_lock);
+		unsigned int allocated = 0;
+
+		while (allocated < count)
+		{
+			int source_order;
+			PageDescriptor* block = take_block(order, mobility, &source_order);
+			if (!block) { break; }
+
+			uint64_t pieces = pages_per_block(source_order - order);
+			stat_add(_stats.splits, source_order - order);
+			uint64_t taken = pieces < count - allocated ? pieces : count - allocated;
+
+			for (uint64_t i = 0; i < taken; i++)
+			{
+				blocks[allocated++] = block + i * pages_per_block(order);
+			}
+
+			// the tail of the block goes back as aligned blocks, whose buddies are all taken
+			for (uint64_t piece = taken; piece < pieces; piece += piece & -piece)
+			{
+				int tail_order = order + __builtin_ctzll(piece);
+				insert_block_into_free_areas(block + piece * pages_per_block(order), tail_order);
+			}
+		}
+
+		return allocated;
+	}
+
+	/**
+	 * Gives a number of blocks of the given order back to the free areas, and only then merges
+	 * them with their buddies.  Blocks from other arenas are skipped.
+	 * @param blocks The first page descriptor of each block.
+	 * @param count The number of blocks.
+	 * @param order The order of the blocks.
+	 */
+	void free_blocks_bulk(PageDescriptor* const* blocks, unsigned int count, int order)
+	{
+		for (unsigned int i = 0; i < count; i++)
+		{
+			if (!contains(blocks[i])) { continue; }
+
+			assert(!block_is_free(blocks[i], order));
+			insert_block_into_free_areas(blocks[i], order);
+		}
+
+		UniqueArenaLock l(_lock);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			PageDescriptor* block = blocks[i];
+			int block_order = order;
+
+			if (!contains(block)) { continue; }
+
+			// skip blocks that an earlier block in the batch has already merged with
+			if (!block_is_free(block, block_order)) { continue; }
+
+			merge_up(block, block_order);
+		}
+	}
+
+	/**
+	 * Takes a physically contiguous range of pages out of the free areas, of any size.  Ranges
+	 * of up to a top-order block are cut from a single block.  Larger ones are made of a run of
+	 * adjacent free top-order blocks, with the rest of the pages taken from the free blocks
+	 * just after the run, or just before it.
+	 * @param nr_pages The number of pages in the range.
+	 * @param mobility The mobility type of the allocation, for ranges of up to a top-order block.
+	 * @return Returns the first page descriptor of the range, or NULL if there is no free range
+	 * that large.
+	 */
+	PageDescriptor* allocate_range(uint64_t nr_pages, MobilityType mobility)
+	{
+		if (nr_pages <= pages_per_block(MaxOrder))
+		{
+			int order = get_max_order(nr_pages);
+			PageDescriptor* block = allocate_block(order, mobility);
+			if (!block) { return NULL; }
+
+			// the end of the block is not needed, and its buddies are all in the range
+			pfn_t start = pfn_of(block);
+			insert_range(start + nr_pages, start + pages_per_block(order));
+			return block;
+		}
+
+		uint64_t nr_top_blocks = nr_pages >> MaxOrder;
+		pfn_t rest = nr_pages & (pages_per_block(MaxOrder) - 1);
+
+		UniqueArenaLock l(_lock);
+
+		// slide along the top order, trying each run of free blocks that is long enough
+		uint64_t run = 0;
+		for (uint64_t i = 0; i < _nr_blocks[MaxOrder]; i++)
+		{
+			if (!block_is_free(block_at(i, MaxOrder), MaxOrder)) { run = 0; continue; }
+			if (++run < nr_top_blocks) { continue; }
+
+			pfn_t run_start = pfn_of(block_at(i + 1 - nr_top_blocks, MaxOrder));
+			pfn_t run_end = run_start + (nr_top_blocks << MaxOrder);
+
+			if (claim_range(run_start, run_end + rest)) { return pgd_of(run_start); }
+			if (rest && run_start >= _start_pfn + rest && claim_range(run_start - rest, run_end))
+			{
+				return pgd_of(run_start - rest);
+			}
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Gives a physically contiguous range of pages back to the free areas, as the largest
+	 * aligned blocks that fit, merging each with its buddy for as long as possible.
+	 * @param start The first page descriptor of the range.
+	 * @param nr_pages The number of pages in the range.
+	 */
+	void free_range(PageDescriptor* start, uint64_t nr_pages)
+	{
+		pfn_t start_pfn = pfn_of(start);
+		assert(start_pfn >= _start_pfn && start_pfn + nr_pages <= _end_pfn);
+
+		UniqueArenaLock l(_lock);
+		release_range(start_pfn, start_pfn + nr_pages);
+	}
+
+	/**
+	 * Takes whatever pages of a range are free out of the free areas for good, splitting only
+	 * the free blocks that straddle the ends of the range.  Pages that are not free are marked
+	 * in a bitmap instead, so that they are dropped rather than given back when they are freed.
+	 * @param start The first page descriptor of the range.
+	 * @param nr_pages The number of pages in the range.
+	 * @param removed_in_use The bitmap to mark pages that are not free in, indexed by page frame.
+	 * @return Returns the number of pages newly marked in the bitmap.
+	 */
+	uint64_t remove_range(PageDescriptor* start, uint64_t nr_pages, uint64_t* removed_in_use)
+	{
+		pfn_t from = pfn_of(start), to = from + nr_pages;
+		assert(from >= _start_pfn && to <= _end_pfn);
+
+		UniqueArenaLock l(_lock);
+
+		uint64_t marked = 0;
+		pfn_t pfn = from;
+		while (pfn < to)
+		{
+			pfn_t end = claim_block_containing(pfn, from, to);
+			if (end)
+			{
+				pfn = end;
+				continue;
+			}
+
+			uint64_t bit = 1ULL << (pfn & 63);
+			if (!(__atomic_fetch_or(&removed_in_use[pfn >> 6], bit, __ATOMIC_RELAXED) & bit)) { marked++; }
+			pfn++;
+		}
+
+		return marked;
+	}
+
+
+	/**
+	 * Sets the arena up to cover a range of page frames, with all of its free areas empty.
+	 * @param start_pfn The first page frame in the arena.
+	 * @param end_pfn The page frame after the last one in the arena.
+	 * @param storage The storage to lay the free bitmaps out over.
+	 * @param pageblock_mobility The mobility type of every pageblock in memory, indexed by PFN.
+	 * @param page_descriptors The page descriptor of page frame zero.
+	 * @return Returns the number of words of storage used.
+	 */
+	uint64_t init(pfn_t start_pfn, pfn_t end_pfn, uint64_t* storage, uint8_t* pageblock_mobility, PageDescriptor* page_descriptors)
+	{
+		_pgd_base = page_descriptors;
+		_start_pfn = start_pfn;
+		_end_pfn = end_pfn;
+		_pageblock_mobility = pageblock_mobility;
+
+		if (empty()) { return 0; }
+
+		// lay out a free bitmap for every mobility type and order, covering every page frame in the arena
+		uint64_t used = 0;
+		for (int i = 0; i <= MaxOrder; i++)
+		{
+			_nr_blocks[i] = ((end_pfn - 1) >> i) - (start_pfn >> i) + 1;
+
+			for (int j = 0; j < MOBILITY_TYPES; j++)
+			{
+				used += _free_areas[j][i].init(storage + used, _nr_blocks[i]);
+			}
+		}
+
+		return used;
+	}
+
+	/**
+	 * @return Returns TRUE if the arena covers no page frames at all.
+	 */
+	bool empty() const { return _start_pfn >= _end_pfn; }
+
+	/**
+	 * @return Returns TRUE if the given page is in the arena.
+	 */
+	bool contains(PageDescriptor* pgd)
+	{
+		pfn_t pfn = pfn_of(pgd);
+		return pfn >= _start_pfn && pfn < _end_pfn;
+	}
+
+	/**
+	 * @return Returns the first page frame in the arena.
+	 */
+	pfn_t start_pfn() const { return _start_pfn; }
+
+	/**
+	 * @return Returns the page frame after the last one in the arena.
+	 */
+	pfn_t end_pfn() const { return _end_pfn; }
+
+	/**
+	 * Returns the mobility type of the pageblock a block starts in.
+	 * @param block The page descriptor of the first page in the block.
+	 */
+	MobilityType block_mobility(PageDescriptor* block)
+	{
+		return (MobilityType)__atomic_load_n(&_pageblock_mobility[pfn_of(block) >> PAGEBLOCK_ORDER], __ATOMIC_RELAXED);
+	}
+
+	/**
+	 * Returns the arena's counters.  These are kept up to date as the arena is used, so
+	 * reading them never walks the free areas.
+	 */
+	const BuddyStats<MaxOrder>& stats() const { return _stats; }
+	BuddyStats<MaxOrder>& stats() { return _stats; }
+
+	/**
+	 * Returns the number of pages in the free areas, not counting the per-CPU page caches.
+	 */
+	uint64_t nr_free_pages() const
+	{
+		uint64_t pages = 0;
+		for (int i = 0; i <= MaxOrder; i++)
+		{
+			pages += _stats.free_blocks[i] << i;
+		}
+		return pages;
+	}
+
+	/**
+	 * Returns how fragmented free memory is for allocations of the given order, as the share
+	 * of free pages that sit in blocks too small to satisfy them.
+	 * @param order The order of the allocation.
+	 * @return Returns the fragmentation index in thousandths, from 0 (none of the free pages
+	 * are unusable) to 1000 (all of them are).
+	 */
+	unsigned int fragmentation_index(int order) const
+	{
+		uint64_t free_pages = 0, usable_pages = 0;
+		for (int i = 0; i <= MaxOrder; i++)
+		{
+			free_pages += _stats.free_blocks[i] << i;
+			if (i >= order) { usable_pages += _stats.free_blocks[i] << i; }
+		}
+
+		if (!free_pages) { return 0; }
+		return ((free_pages - usable_pages) * 1000) / free_pages;
+	}
+
+	/**
+	 * Dumps out the arena's counters.
+	 * @param name The name of the arena, for the log.
+	 */
+	void dump_state(const char* name) const
+	{
+		// Print out a header, so we can find the output in the logs.
+		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE (%s, pfn %lx-%lx): %lu free pages, %lu splits, %lu merges, %lu pageblock steals",
+			name, _start_pfn, _end_pfn, nr_free_pages(), _stats.splits, _stats.merges, _stats.pageblock_steals);
+
+		// One line per order, from the counters rather than the free areas themselves.
+		for (int i = 0; i <= MaxOrder; i++) {
+			mm_log.messagef(LogLevel::DEBUG, "[%d] free=%lu frag=%u",
+				i, _stats.free_blocks[i], fragmentation_index(i));
+		}
+
+		// Latency histograms, skipping empty buckets.
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			if (!_stats.alloc_latency[i] && !_stats.free_latency[i]) { continue; }
+
+			mm_log.messagef(LogLevel::DEBUG, "<2^%u cycles: alloc=%lu free=%lu",
+				i + 1, _stats.alloc_latency[i], _stats.free_latency[i]);
+		}
+	}
+
+private:
+	FreeBitmap _free_areas[MOBILITY_TYPES][MaxOrder+1];
+	uint64_t _nr_blocks[MaxOrder+1];
+	uint8_t* _pageblock_mobility;
+	PageDescriptor* _pgd_base;
+	pfn_t _start_pfn, _end_pfn;
+
+	ArenaLock _lock;
+	BuddyStats<MaxOrder> _stats;
+};
+
+/* The number of huge pages to reserve at boot, from the "pgalloc.hugepages" argument. */
+static uint64_t boot_huge_pool_size;
+
+RegisterCmdLineArgument(BuddyHugePages, "pgalloc.hugepages")
+{
+	uint64_t pages = 0;
+	for (const char* c = value; *c >= '0' && *c <= '9'; c++)
+	{
+		pages = pages * 10 + (*c - '0');
+	}
+
+	boot_huge_pool_size = pages;
+}
+
+/**
+ * A buddy page allocation algorithm.  Page frame numbers are worked out from a cached pointer
+ * to the page descriptor array, and the highest order is fixed at compile time, so buddy and
+ * order calculations come down to a few integer instructions.
+ * @tparam MaxOrder The highest order of block.
+ */
+template<int MaxOrder>
+class BasicBuddyPageAllocator : public PageAllocatorAlgorithm
+{
+private:
+	typedef BuddyArena<MaxOrder> Arena;
+
+	/** Given an order, returns the number of pages in a block of that order.
+	 * @param order The order.
+	 * @return The number of pages.
+	*/
+	static constexpr pfn_t pages_per_block(int order)
+	{
+		return (pfn_t)1 << order;
+	}
+
+	/**
+	 * Pushes a block onto a per-CPU page cache.
+	 * @param pcp The per-CPU page cache.
+	 * @param block The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void pcp_push(PerCpuPageCache& pcp, PageDescriptor* block, int order)
+	{
+		MobilityType mobility = (MobilityType)__atomic_load_n(&_pageblock_mobility[(block - _pgd_base) >> PAGEBLOCK_ORDER], __ATOMIC_RELAXED);
+
+		block->next_free = pcp.blocks[mobility][order];
+		pcp.blocks[mobility][order] = block;
+		pcp.count[mobility][order]++;
+	}
+
+	/**
+	 * Pops a block off a per-CPU page cache.
+	 * @param pcp The per-CPU page cache.
+	 * @param order The order of the block.
+	 * @param mobility The mobility type of the block.
+	 * @return Returns the first page descriptor of the block, or NULL if the cache is empty.
+	 */
+	PageDescriptor* pcp_pop(PerCpuPageCache& pcp, int order, MobilityType mobility)
+	{
+		PageDescriptor* block = pcp.blocks[mobility][order];
+		if (!block) { return NULL; }
+
+		pcp.blocks[mobility][order] = block->next_free;
+		pcp.count[mobility][order]--;
+		return block;
+	}
+
+	/**
+	 * Refills a per-CPU page cache with a batch of blocks from its arena's free areas.
+	 * @param arena The arena the cache belongs to.
+	 * @param pcp The per-CPU page cache.
+	 * @param order The order of blocks to refill.
+	 * @param mobility The mobility type of blocks to refill.
+	 */
+	void refill_pcp(Arena& arena, PerCpuPageCache& pcp, int order, MobilityType mobility)
+	{
+		// blocks taken from a fallback type still go in the chain they were allocated for
+		for (unsigned int i = 0; i < _pcp_batch; i++)
+		{
+			PageDescriptor* block = arena.allocate_block(order, mobility);
+			if (!block) { break; }
+
+			block->next_free = pcp.blocks[mobility][order];
+			pcp.blocks[mobility][order] = block;
+			pcp.count[mobility][order]++;
+		}
+	}
+
+	/**
+	 * Gives blocks from a per-CPU page cache back to its arena's free areas.
+	 * @param arena The arena the cache belongs to.
+	 * @param pcp The per-CPU page cache.
+	 * @param order The order of blocks to drain.
+	 * @param mobility The mobility type of blocks to drain.
+	 * @param target The number of blocks to leave in the cache.
+	 */
+	void drain_pcp(Arena& arena, PerCpuPageCache& pcp, int order, MobilityType mobility, unsigned int target)
+	{
+		while (pcp.count[mobility][order] > target)
+		{
+			arena.free_block(pcp_pop(pcp, order, mobility), order);
+		}
+	}
+
+	/**
+	 * Returns this CPU's page cache for an arena.  Callers must have interrupts disabled, and
+	 * hold the cache's lock, while using it.
+	 * @param arena The index of the arena.
+	 */
+	PerCpuPageCache& this_cpu_pcp(int arena) { return _pcp[arena][current_cpu()]; }
+
+	/**
+	 * Returns the arena a page is in.
+	 * @param pgd The page descriptor.
+	 * @return Returns the index of the arena.
+	 */
+	int arena_of(PageDescriptor* pgd)
+	{
+		pfn_t pfn = pgd - _pgd_base;
+
+		int arena = 0;
+		while (pfn >= arena_end_pfns[arena]) { arena++; }
+		return arena;
+	}
+
+	/**
+	 * Allocates a block from one arena, from this CPU's cache for low orders or from the
+	 * arena's free areas otherwise.  Callers must have interrupts disabled.
+	 * @param arena_index The index of the arena.
+	 * @param order The order of the block to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @return Returns the first page descriptor of the block, or NULL if allocation failed.
+	 */
+	PageDescriptor* allocate_from_arena(int arena_index, int order, MobilityType mobility)
+	{
+		Arena& arena = _arenas[arena_index];
+		PageDescriptor* block;
+
+		// low orders come from this CPU's cache, which is refilled a batch at a time
+		if (order <= PCP_MAX_ORDER)
+		{
+			PerCpuPageCache& pcp = this_cpu_pcp(arena_index);
+			UniqueArenaLock l(pcp.lock);
+
+			if (!pcp.count[mobility][order]) { refill_pcp(arena, pcp, order, mobility); }
+			block = pcp_pop(pcp, order, mobility);
+		}
+		else
+		{
+			block = arena.allocate_block(order, mobility);
+		}
+
+		if (block) { return block; }
+
+		// blocks held in the CPUs' caches might be what stops the allocation from being satisfied
+		drain_all_pcp(arena_index);
+		return arena.allocate_block(order, mobility);
+	}
+
+	/**
+	 * Gives every block in every CPU's cache for an arena back to the arena's free areas.
+	 * Callers must have interrupts disabled.
+	 * @param arena_index The index of the arena.
+	 */
+	void drain_all_pcp(int arena_index)
+	{
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++)
+		{
+			PerCpuPageCache& pcp = _pcp[arena_index][cpu];
+			UniqueArenaLock l(pcp.lock);
+
+			for (int i = 0; i < MOBILITY_TYPES; i++)
+			{
+				for (int j = 0; j <= PCP_MAX_ORDER; j++)
+				{
+					drain_pcp(_arenas[arena_index], pcp, j, (MobilityType)i, 0);
+				}
+			}
+		}
+	}
+
+	/**
+	 * Allocates a contiguous range of pages from the preferred arena, or failing that from the
+	 * arenas below it.  Callers must have interrupts disabled.
+	 * @param nr_pages The number of pages in the range.
+	 * @param mobility The mobility type of the allocation.
+	 * @param preferred_arena The arena to try first.
+	 * @return Returns the first page descriptor of the range, or NULL if allocation failed.
+	 */
+	PageDescriptor* do_allocate_contiguous_pages(uint64_t nr_pages, MobilityType mobility, int preferred_arena)
+	{
+		for (int i = preferred_arena; i >= 0; i--)
+		{
+			if (_arenas[i].empty()) { continue; }
+			if (i != preferred_arena && _arena_reserves[i] && _arenas[i].nr_free_pages() < _arena_reserves[i] + nr_pages) { continue; }
+
+			PageDescriptor* block = _arenas[i].allocate_range(nr_pages, mobility);
+			if (block) { return block; }
+
+			// a single cached page can break up a run of top-order blocks
+			drain_all_pcp(i);
+			block = _arenas[i].allocate_range(nr_pages, mobility);
+			if (block) { return block; }
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Checks whether an allocation may fall back to an arena below the one it asked for, which
+	 * it may only do while that leaves the arena's reserve untouched.
+	 * @param arena_index The index of the arena.
+	 * @param order The order of the allocation.
+	 */
+	bool can_fall_back_to(int arena_index, int order)
+	{
+		// with no reserve, everything may go, including what is sitting in the per-CPU caches
+		if (!_arena_reserves[arena_index]) { return true; }
+
+		return _arenas[arena_index].nr_free_pages() >= _arena_reserves[arena_index] + pages_per_block(order);
+	}
+
+	/**
+	 * Allocates a block from the preferred arena, or failing that from the arenas below it.
+	 * Callers must have interrupts disabled.
+	 * @param order The order of the block to allocate.
+	 * @param mobility The mobility type of the allocation.
+	 * @param preferred_arena The arena to try first.
+	 * @return Returns the first page descriptor of the block, or NULL if allocation failed.
+	 */
+	PageDescriptor* do_allocate_pages(int order, MobilityType mobility, int preferred_arena)
+	{
+		for (int i = preferred_arena; i >= 0; i--)
+		{
+			if (_arenas[i].empty()) { continue; }
+			if (i != preferred_arena && !can_fall_back_to(i, order)) { continue; }
+
+			PageDescriptor* block = allocate_from_arena(i, order, mobility);
+			if (block) { return block; }
+		}
+
+		return NULL;
+	}
+
+	/**
+	 * Frees a block, to this CPU's cache for low orders or to the free areas of its arena
+	 * otherwise.  Callers must have interrupts disabled.
+	 * @param block The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void do_free_pages(PageDescriptor* block, int order)
+	{
+		int arena_index = arena_of(block);
+		Arena& arena = _arenas[arena_index];
+
+		// low orders go back to this CPU's cache, which is drained once it passes the high watermark
+		if (order <= PCP_MAX_ORDER)
+		{
+			PerCpuPageCache& pcp = this_cpu_pcp(arena_index);
+			UniqueArenaLock l(pcp.lock);
+
+			MobilityType mobility = arena.block_mobility(block);
+
+			pcp_push(pcp, block, order);
+			if (pcp.count[mobility][order] > _pcp_high) { drain_pcp(arena, pcp, order, mobility, _pcp_low); }
+			return;
+		}
+
+		arena.free_block(block, order);
+	}
+
+	/**
+	 * Zeroes the pages of a block.
+	 * @param block The first page descriptor of the block.
+	 * @param order The order of the block.
+	 */
+	void zero_block(PageDescriptor* block, int order)
+	{
+		memset((void *)sys.mm().pgalloc().pgd_to_kva(block), 0, BUDDY_PAGE_SIZE << order);
+	}
+
+	/**
+	 * Takes a page out of the pre-zeroed page pool.  Callers must have interrupts disabled.
+	 * @return Returns the page, or NULL if the pool is empty.
+	 */
+	PageDescriptor* zero_pool_pop()
+	{
+		UniqueArenaLock l(_zero_pool_lock);
+
+		PageDescriptor* page = _zero_pool;
+		if (page)
+		{
+			_zero_pool = page->next_free;
+			_zero_pool_count--;
+		}
+
+		return page;
+	}
+
+	/**
+	 * Puts a zeroed page into the pre-zeroed page pool.  Callers must have interrupts disabled.
+	 * @param page The page.
+	 */
+	void zero_pool_push(PageDescriptor* page)
+	{
+		UniqueArenaLock l(_zero_pool_lock);
+
+		page->next_free = _zero_pool;
+		_zero_pool = page;
+		_zero_pool_count++;
+	}
+
+	/**
+	 * Gives every page in the pre-zeroed page pool back to the free areas, when memory is too
+	 * short to keep them.  Callers must have interrupts disabled.
+	 * @return Returns TRUE if any pages were given back.
+	 */
+	bool drain_zero_pool()
+	{
+		bool drained = false;
+
+		PageDescriptor* page;
+		while ((page = zero_pool_pop()) != NULL)
+		{
+			_arenas[arena_of(page)].free_block(page, 0);
+			drained = true;
+		}
+
+		return drained;
+	}
+
+	/**
+	 * Fills the pre-zeroed page pool up to its high watermark.  Pages are zeroed with
+	 * interrupts enabled, so this is done by the zeroing thread rather than on the allocation path.
+	 * @return Returns FALSE if memory ran out before the pool was full.
+	 */
+	bool refill_zero_pool()
+	{
+		while (_zero_pool_count < _zero_pool_high)
+		{
+			PageDescriptor* page;
+			{
+				UniqueIRQLock l;
+				page = do_allocate_pages(0, MOBILITY_MOVABLE, ARENA_NORMAL);
+			}
+			if (!page) { return false; }
+
+			zero_block(page, 0);
+
+			UniqueIRQLock l;
+			zero_pool_push(page);
+		}
+
+		return true;
+	}
+
+	/**
+	 * The body of the zeroing thread, which runs at daemon priority, refills the pre-zeroed
+	 * page pool and then sleeps until an allocation takes the pool below its low watermark
+	 * again.  A refill that runs out of memory sleeps too, rather than retrying straight away.
+	 */
+	static void zero_pool_thread_proc()
+	{
+		BasicBuddyPageAllocator* allocator = _instance;
+
+		while (true)
+		{
+			bool refilled = allocator->refill_zero_pool();
+
+			UniqueIRQLock l;
+			if (!refilled || allocator->_zero_pool_count >= allocator->_zero_pool_low) { allocator->_zero_pool_waitq.sleep(l); }
+		}
+	}
+
+	/**
+	 * Starts the zeroing thread, once.  This happens when a zeroed page is first asked for,
+	 * rather than in init(), which runs before there is a kernel process to own the thread.
+	 */
+	void start_zero_pool_thread()
+	{
+		bool started = false;
+		if (!__atomic_compare_exchange_n(&_zero_pool_thread_started, &started, true, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) { return; }
+
+		Thread& thread = kernel_process->create_thread(ThreadPrivilege::Kernel,
+			(Thread::thread_proc_t)zero_pool_thread_proc, SchedulingEntityPriority::DAEMON);
+		thread.start();
+	}
+
+	/**
+	 * Lays the free bitmaps and pageblock mobility types out over the last pages of a range, if
+	 * it is big enough to hold them.  Those pages never reach the free areas.  Callers must have
+	 * interrupts disabled.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range, which is moved down past the pages used.
+	 * @return Returns TRUE if the bitmaps were laid out.
+	 */
+	bool carve_bitmap_storage(pfn_t from, pfn_t& to)
+	{
+		uint64_t nr_words = arena_bitmap_words(_nr_pages, MaxOrder);
+		uint64_t nr_removed_words = (_nr_pages + 63) / 64;
+		uint64_t nr_pageblocks = (_nr_pages + pages_per_block(PAGEBLOCK_ORDER) - 1) >> PAGEBLOCK_ORDER;
+		uint64_t nr_pages = ((nr_words + nr_removed_words) * sizeof(uint64_t) + nr_pageblocks + BUDDY_PAGE_SIZE - 1) / BUDDY_PAGE_SIZE;
+		if (to - from < nr_pages) { return false; }
+
+		// the top of the range is taken, so a range reaching up out of the low arenas spares them
+		to -= nr_pages;
+		_bitmap_pfn = to;
+		_nr_bitmap_pages = nr_pages;
+		_bitmap_storage = (uint64_t *)sys.mm().pgalloc().pgd_to_kva(_pgd_base + to);
+		_removed_in_use = _bitmap_storage + nr_words;
+		_pageblock_mobility = (uint8_t *)(_removed_in_use + nr_removed_words);
+
+		for (uint64_t i = 0; i < nr_removed_words; i++)
+		{
+			_removed_in_use[i] = 0;
+		}
+
+		// memory starts out movable, and is claimed for other types as they need it
+		for (uint64_t i = 0; i < nr_pageblocks; i++)
+		{
+			_pageblock_mobility[i] = MOBILITY_MOVABLE;
+		}
+
+		// split the page descriptors between the arenas, each with its own share of the bitmap storage
+		uint64_t *storage = _bitmap_storage;
+		pfn_t arena_start = 0;
+		for (int i = 0; i < NR_ARENAS; i++)
+		{
+			pfn_t arena_end = arena_end_pfns[i] < _nr_pages ? arena_end_pfns[i] : _nr_pages;
+			if (arena_start > arena_end) { arena_start = arena_end; }
+
+			storage += _arenas[i].init(arena_start, arena_end, storage, _pageblock_mobility, _pgd_base);
+			arena_start = arena_end;
+		}
+
+		return true;
+	}
+
+	/**
+	 * Gives a range of page frames to the free areas of the arenas it falls in.  Each arena
+	 * carves its share straight into the largest aligned blocks, without touching the page
+	 * descriptors in between.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 */
+	void release_page_range(pfn_t from, pfn_t to)
+	{
+		for (int i = 0; i < NR_ARENAS; i++)
+		{
+			pfn_t lo = from > _arenas[i].start_pfn() ? from : _arenas[i].start_pfn();
+			pfn_t hi = to < _arenas[i].end_pfn() ? to : _arenas[i].end_pfn();
+			if (lo >= hi) { continue; }
+
+			_arenas[i].free_range(_pgd_base + lo, hi - lo);
+		}
+	}
+
+	/**
+	 * Cuts a range of page frames out of the ranges waiting for the free bitmaps.  Callers must
+	 * have interrupts disabled.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 */
+	void remove_early_range(pfn_t from, pfn_t to)
+	{
+		for (unsigned int i = 0; i < _nr_early_ranges; )
+		{
+			pfn_t early_from = _early_ranges[i].from, early_to = _early_ranges[i].to;
+			if (to <= early_from || from >= early_to) { i++; continue; }
+
+			// whatever is left above the hole needs a range of its own
+			if (to < early_to)
+			{
+				if (early_from < from && _nr_early_ranges == MAX_EARLY_RANGES)
+				{
+					mm_log.messagef(LogLevel::WARNING, "Buddy: dropped %lu pages inserted before the free bitmaps", early_to - to);
+				}
+				else if (early_from < from)
+				{
+					_early_ranges[_nr_early_ranges].from = to;
+					_early_ranges[_nr_early_ranges].to = early_to;
+					_nr_early_ranges++;
+				}
+				else
+				{
+					_early_ranges[i].from = to;
+					i++;
+					continue;
+				}
+			}
+
+			if (early_from < from)
+			{
+				_early_ranges[i].to = from;
+				i++;
+				continue;
+			}
+
+			_early_ranges[i] = _early_ranges[--_nr_early_ranges];
+		}
+	}
+
+	/**
+	 * Clears the removed marks of a range of page frames, returning the number that were set.
+	 * @param from The first page frame in the range.
+	 * @param to The page frame after the last one in the range.
+	 */
+	uint64_t clear_removed_in_use(pfn_t from, pfn_t to)
+	{
+		uint64_t cleared = 0;
+		for (pfn_t pfn = from; pfn < to; )
+		{
+			// whole words are cleared at once, and only the ends of the range go a bit at a time
+			uint64_t mask = ~0ULL << (pfn & 63);
+			pfn_t next = (pfn | 63) + 1;
+			if (next > to) { mask &= ~0ULL >> (next - to); next = to; }
+
+			cleared += __builtin_popcountll(__atomic_fetch_and(&_removed_in_use[pfn >> 6], ~mask, __ATOMIC_RELAXED) & mask);
+			pfn = next;
+		}
+
+		return cleared;
+	}
+
+	/**
+	 * Frees a block that may have pages in it that were removed while it was allocated.  The
+	 * removed pages are dropped, and the rest of the block goes back to the free areas as the
+	 * largest aligned blocks that fit.  Callers must have interrupts disabled.
+	 * @param block The first page descriptor of the block.
+	 * @param nr_pages The number of pages in the block.
+	 * @return Returns TRUE if the block had removed pages and has been dealt with, or FALSE if
+	 * it should be freed as usual.
+	 */
+	bool free_removed_pages(PageDescriptor* block, uint64_t nr_pages)
+	{
+		if (!__atomic_load_n(&_nr_removed_in_use, __ATOMIC_RELAXED)) { return false; }
+
+		pfn_t from = block - _pgd_base, to = from + nr_pages;
+		uint64_t dropped = 0;
+		pfn_t run = from;
+		for (pfn_t pfn = from; pfn < to; pfn++)
+		{
+			uint64_t bit = 1ULL << (pfn & 63);
+			if (!(__atomic_load_n(&_removed_in_use[pfn >> 6], __ATOMIC_RELAXED) & bit)) { continue; }
+			if (!(__atomic_fetch_and(&_removed_in_use[pfn >> 6], ~bit, __ATOMIC_RELAXED) & bit)) { continue; }
+
+			if (run < pfn) { release_page_range(run, pfn); }
+			run = pfn + 1;
+			dropped++;
+		}
+
+		if (!dropped) { return false; }
+
+		if (run < to) { release_page_range(run, to); }
+		stat_add(_nr_removed_in_use, -dropped);
+		return true;
+	}
+
+	/**
+	 * Takes huge pages from the free areas into the huge page pool, until the pool reaches its
+	 * target size or free memory runs down to the margin left for everything else.  Callers
+	 * must have interrupts disabled.
+	 */
+	void refill_huge_pool()
+	{
+		while (__atomic_load_n(&_huge_pool_count, __ATOMIC_RELAXED) < _huge_pool_target)
+		{
+			if (nr_free_pages() < HUGE_POOL_FREE_MARGIN + pages_per_block(HUGE_PAGE_ORDER)) { break; }
+
+			PageDescriptor* block = do_allocate_pages(HUGE_PAGE_ORDER, MOBILITY_MOVABLE, ARENA_NORMAL);
+			if (!block) { break; }
+
+			huge_pool_push(block);
+		}
+	}
+
+	/**
+	 * Takes a huge page out of the huge page pool.  Callers must have interrupts disabled.
+	 * @return Returns the huge page, or NULL if the pool is empty.
+	 */
+	PageDescriptor* huge_pool_pop()
+	{
+		UniqueArenaLock l(_huge_pool_lock);
+
+		PageDescriptor* block = _huge_pool;
+		if (block)
+		{
+			_huge_pool = block->next_free;
+			_huge_pool_count--;
+		}
+
+		return block;
+	}
+
+	/**
+	 * Puts a huge page into the huge page pool.  Callers must have interrupts disabled.
+	 * @param block The first page descriptor of the huge page.
+	 */
+	void huge_pool_push(PageDescriptor* block)
+	{
+		UniqueArenaLock l(_huge_pool_lock);
+
+		block->next_free = _huge_pool;
+		_huge_pool = block;
+		_huge_pool_count++;
+	}
+
+	/**
+	 * Records an event in this CPU's trace ring buffer, if tracing is enabled.  Callers must
+	 * have interrupts disabled.
+	 * @param event The event.
+	 * @param pgd The first page descriptor the event is about, or NULL if there is none.
+	 * @param arg The order, or the number of pages, depending on the event.
+	 */
+	void trace(BuddyTraceEvent event, PageDescriptor* pgd, uint64_t arg)
+	{
+		if (__builtin_expect(!_tracing, 1)) { return; }
+
+		unsigned int cpu = current_cpu();
+		BuddyTraceRing& ring = _trace_rings[cpu];
+
+		if (ring.head - ring.tail == TRACE_RING_SIZE)
+		{
+			ring.tail++;
+			ring.lost++;
+		}
+
+		BuddyTraceRecord& record = ring.records[ring.head & (TRACE_RING_SIZE - 1)];
+		record.timestamp = read_cycle_counter();
+		record.pfn = pgd ? pgd - _pgd_base : ~0U;
+		record.arg = arg < (1U << 24) ? arg : (1U << 24) - 1;
+		record.event = event;
+		record.cpu = cpu;
+
+		ring.head++;
+	}
+
+	/**
+	 * Asks every registered shrinker to give back whatever memory it can spare.  Callers must
+	 * have interrupts disabled.
+	 * @return Returns TRUE if any pages were given back.
+	 */
+	bool run_shrinkers()
+	{
+		uint64_t freed = 0;
+		for (unsigned int i = 0; i < _nr_shrinkers; i++)
+		{
+			freed += _shrinkers[i]();
+		}
+
+		return freed > 0;
+	}
+
+	/**
+	 * Adds the time since the given cycle count to a log2 latency histogram.
+	 * @param histogram The histogram to add to.
+	 * @param start The cycle count at the start of the operation.
+	 */
+	static void record_latency(uint64_t* histogram, uint64_t start)
+	{
+		uint64_t cycles = read_cycle_counter() - start;
+		unsigned int bucket = 63 - __builtin_clzll(cycles | 1);
+
+		stat_add(histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1], 1);
+	}
+
+public:
+	/* A function that gives back memory it is holding on to, returning the number of pages freed. */
+	typedef uint64_t (*Shrinker)();
+
+	/**
+	 * Returns the buddy allocator that has been initialised, or NULL if the buddy allocator is
+	 * not the one in use.
+	 */
+	static BasicBuddyPageAllocator* instance() { return _instance; }
+
+	/**
+	 * Registers a function to call for memory when an allocation would otherwise fail.  Shrinkers
+	 * are called with interrupts disabled, and may free pages but must not allocate them.
+	 * @param shrinker The function.
+	 * @return Returns TRUE if the shrinker was registered, or FALSE if there is no room for it.
+	 */
+	static bool register_shrinker(Shrinker shrinker)
+	{
+		UniqueIRQLock l;
+		if (_nr_shrinkers == MAX_SHRINKERS) { return false; }
+
+		_shrinkers[_nr_shrinkers++] = shrinker;
+		return true;
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor* allocate_pages(int order) override
+	{
+		return allocate_pages(order, MOBILITY_UNMOVABLE);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, of the given mobility type.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param mobility How easily the pages can be moved or reclaimed once allocated.
+	 * @param preferred_arena The arena to allocate from, falling back to the arenas below it.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor* allocate_pages(int order, MobilityType mobility, ArenaType preferred_arena = ARENA_NORMAL)
+	{
+		if (order < 0 || order > MaxOrder) { return NULL; }
+		assert(mobility >= 0 && mobility < MOBILITY_TYPES);
+		assert(preferred_arena >= 0 && preferred_arena < NR_ARENAS);
+
+		UniqueIRQLock l;
+		uint64_t start = read_cycle_counter();
+
+		PageDescriptor* block = do_allocate_pages(order, mobility, preferred_arena);
+
+		// pre-zeroed pages and cached objects are only worth keeping while there is memory to spare
+		if (!block && (drain_zero_pool() || run_shrinkers())) { block = do_allocate_pages(order, mobility, preferred_arena); }
+
+		trace(block ? TRACE_ALLOC : TRACE_ALLOC_FAILED, block, order);
+
+		if (block) { record_latency(_arenas[arena_of(block)].stats().alloc_latency, start); }
+		else
+		{
+			stat_add(_failure_stats.alloc_failures[order], 1);
+			record_latency(_failure_stats.latency, start);
+		}
+
+		return block;
+	}
+
+	/**
+	 * Allocates any number of physically contiguous pages, including more than fit in a single
+	 * block of MaxOrder.  The range must be given back with free_contiguous_pages().
+	 * @param nr_pages The number of contiguous pages to allocate.
+	 * @param mobility How easily the pages can be moved or reclaimed once allocated.
+	 * @param preferred_arena The arena to allocate from, falling back to the arenas below it.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor* allocate_contiguous_pages(uint64_t nr_pages, MobilityType mobility = MOBILITY_UNMOVABLE,
+		ArenaType preferred_arena = ARENA_NORMAL)
+	{
+		if (nr_pages == 0) { return NULL; }
+		assert(mobility >= 0 && mobility < MOBILITY_TYPES);
+		assert(preferred_arena >= 0 && preferred_arena < NR_ARENAS);
+
+		UniqueIRQLock l;
+		uint64_t start = read_cycle_counter();
+
+		PageDescriptor* block = do_allocate_contiguous_pages(nr_pages, mobility, preferred_arena);
+		if (!block && (drain_zero_pool() || run_shrinkers())) { block = do_allocate_contiguous_pages(nr_pages, mobility, preferred_arena); }
+
+		trace(block ? TRACE_ALLOC_RANGE : TRACE_ALLOC_FAILED, block, nr_pages);
+
+		if (block) { record_latency(_arenas[arena_of(block)].stats().alloc_latency, start); }
+		else
+		{
+			stat_add(_failure_stats.range_alloc_failures, 1);
+			record_latency(_failure_stats.latency, start);
+		}
+
+		return block;
+	}
+
+	/**
+	 * Frees a range of contiguous pages allocated by allocate_contiguous_pages().
+	 * @param pgd The first page descriptor of the range.
+	 * @param nr_pages The number of pages in the range.
+	 */
+	void free_contiguous_pages(PageDescriptor* pgd, uint64_t nr_pages)
+	{
+		if (nr_pages == 0) { return; }
+
+		UniqueIRQLock l;
+		uint64_t start = read_cycle_counter();
+
+		Arena& arena = _arenas[arena_of(pgd)];
+		if (!free_removed_pages(pgd, nr_pages)) { arena.free_range(pgd, nr_pages); }
+		trace(TRACE_FREE_RANGE, pgd, nr_pages);
+
+		record_latency(arena.stats().free_latency, start);
+	}
+
+	/**
+	 * Allocates 2^order number of contiguous pages, filled with zeroes.  Single movable pages
+	 * come from the pre-zeroed page pool, and anything else, or anything the pool cannot
+	 * supply, is zeroed on the spot.
+	 * @param order The power of two, of the number of contiguous pages to allocate.
+	 * @param mobility How easily the pages can be moved or reclaimed once allocated.
+	 * @param preferred_arena The arena to allocate from, falling back to the arenas below it.
+	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
+	 * allocation failed.
+	 */
+	PageDescriptor* allocate_zeroed_pages(int order, MobilityType mobility = MOBILITY_MOVABLE, ArenaType preferred_arena = ARENA_NORMAL)
+	{
+		if (!__atomic_load_n(&_zero_pool_thread_started, __ATOMIC_ACQUIRE)) { start_zero_pool_thread(); }
+
+		if (order == 0 && mobility == MOBILITY_MOVABLE)
+		{
+			UniqueIRQLock l;
+
+			// the pool is filled from the normal arena down, so check the page suits the caller
+			PageDescriptor* page = zero_pool_pop();
+			if (__atomic_load_n(&_zero_pool_count, __ATOMIC_RELAXED) < _zero_pool_low) { _zero_pool_waitq.wake(); }
+
+			if (page && arena_of(page) <= preferred_arena)
+			{
+				stat_add(_zero_pool_hits, 1);
+				return page;
+			}
+			if (page) { zero_pool_push(page); }
+		}
+
+		PageDescriptor* block = allocate_pages(order, mobility, preferred_arena);
+		if (!block) { return NULL; }
+
+		stat_add(_zero_pool_misses, 1);
+		zero_block(block, order);
+		return block;
+	}
+
+	/**
+	 * Allocates a huge page, a naturally aligned block of 2^HUGE_PAGE_ORDER pages, from the
+	 * huge page pool.  If the pool is empty, the free areas are tried directly, and then the
+	 * pool is topped up from whatever huge blocks have been freed since it was last filled.
+	 * @return Returns the first page descriptor of the huge page, or NULL if allocation failed.
+	 */
+	PageDescriptor* allocate_huge_page()
+	{
+		{
+			UniqueIRQLock l;
+
+			PageDescriptor* block = huge_pool_pop();
+			if (block)
+			{
+				stat_add(_huge_pool_hits, 1);
+				return block;
+			}
+		}
+
+		stat_add(_huge_pool_misses, 1);
+		PageDescriptor* block = allocate_pages(HUGE_PAGE_ORDER, MOBILITY_MOVABLE);
+		if (!block) { return NULL; }
+
+		UniqueIRQLock l;
+		refill_huge_pool();
+		return block;
+	}
+
+	/**
+	 * Frees a huge page, back into the huge page pool if it is below its target size, or to
+	 * the free areas otherwise.
+	 * @param block The first page descriptor of the huge page.
+	 */
+	void free_huge_page(PageDescriptor* block)
+	{
+		{
+			UniqueIRQLock l;
+			if (free_removed_pages(block, pages_per_block(HUGE_PAGE_ORDER))) { return; }
+
+			if (__atomic_load_n(&_huge_pool_count, __ATOMIC_RELAXED) < _huge_pool_target)
+			{
+				huge_pool_push(block);
+				return;
+			}
+		}
+
+		free_pages(block, HUGE_PAGE_ORDER);
+	}
+
+	/**
+	 * Sets the number of huge pages to keep in the huge page pool.  A smaller pool gives its
+	 * extra pages back at once, and a larger one is filled as far as free memory allows.
+	 * @param nr_huge_pages The number of huge pages.
+	 * @return Returns the number of huge pages now in the pool.
+	 */
+	uint64_t set_huge_pool_size(uint64_t nr_huge_pages)
+	{
+		UniqueIRQLock l;
+		_huge_pool_target = nr_huge_pages;
+
+		while (__atomic_load_n(&_huge_pool_count, __ATOMIC_RELAXED) > _huge_pool_target)
+		{
+			PageDescriptor* block = huge_pool_pop();
+			if (!block) { break; }
+
+			do_free_pages(block, HUGE_PAGE_ORDER);
+		}
+
+		refill_huge_pool();
+		return _huge_pool_count;
+	}
+
+	/**
+	 * Turns tracing of allocator events on or off.
+	 * @param enabled TRUE to record events in the per-CPU trace ring buffers.
+	 */
+	void set_tracing(bool enabled)
+	{
+		UniqueIRQLock l;
+		_tracing = enabled;
+	}
+
+	/**
+	 * Exports trace records from a CPU's trace ring buffer, oldest first, removing them from
+	 * the ring.  A CPU's ring can only be read from that CPU, or while tracing is off.
+	 * @param cpu The CPU whose ring to read.
+	 * @param records The array to copy the records into.
+	 * @param max The number of records the array has room for.
+	 * @return Returns the number of records copied.
+	 */
+	unsigned int read_trace(unsigned int cpu, BuddyTraceRecord* records, unsigned int max)
+	{
+		assert(cpu < MAX_CPUS);
+
+		UniqueIRQLock l;
+		BuddyTraceRing& ring = _trace_rings[cpu];
+
+		unsigned int copied = 0;
+		while (copied < max && ring.tail != ring.head)
+		{
+			records[copied++] = ring.records[ring.tail & (TRACE_RING_SIZE - 1)];
+			ring.tail++;
+		}
+
+		return copied;
+	}
+
+	/**
+	 * Sets the watermarks of the pre-zeroed page pool.
+	 * @param low The number of pages below which the zeroing thread is woken.
+	 * @param high The number of pages the zeroing thread fills the pool up to.
+	 * @return Returns TRUE if the watermarks were valid and have been applied.
+	 */
+	bool set_zero_pool_watermarks(unsigned int low, unsigned int high)
+	{
+		if (low > high) { return false; }
+
+		UniqueIRQLock l;
+		_zero_pool_low = low;
+		_zero_pool_high = high;
+		return true;
+	}
+
+    /**
+	 * Frees 2^order contiguous pages.
+	 * @param pgd A pointer to an array of page descriptors to be freed.
+	 * @param order The power of two number of contiguous pages to free.
+	 */
+    void free_pages(PageDescriptor* pgd, int order) override
+    {
+		assert(order >= 0 && order <= MaxOrder);
+
+		UniqueIRQLock l;
+		uint64_t start = read_cycle_counter();
+
+		if (!free_removed_pages(pgd, pages_per_block(order))) { do_free_pages(pgd, order); }
+		trace(TRACE_FREE, pgd, order);
+
+		record_latency(_arenas[arena_of(pgd)].stats().free_latency, start);
+    }
+
+	/**
+	 * Allocates a number of 2^order blocks of contiguous pages in one go.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 * @param pages The array to store the first page descriptor of each block in.
+	 * @param count The number of blocks to allocate.
+	 * @param mobility How easily the pages can be moved or reclaimed once allocated.
+	 * @param preferred_arena The arena to allocate from, falling back to the arenas below it.
+	 * @return Returns the number of blocks allocated, which is less than count if memory ran out.
+	 */
+	unsigned int allocate_pages_bulk(int order, PageDescriptor** pages, unsigned int count,
+		MobilityType mobility = MOBILITY_UNMOVABLE, ArenaType preferred_arena = ARENA_NORMAL)
+	{
+		if (order < 0 || order > MaxOrder) { return 0; }
+
+		UniqueIRQLock l;
+		unsigned int allocated = 0;
+
+		for (int i = preferred_arena; i >= 0 && allocated < count; i--)
+		{
+			if (_arenas[i].empty()) { continue; }
+			if (i != preferred_arena && !can_fall_back_to(i, order)) { continue; }
+
+			// use up whatever this CPU has cached before going to the free areas
+			if (order <= PCP_MAX_ORDER)
+			{
+				PerCpuPageCache& pcp = this_cpu_pcp(i);
+				UniqueArenaLock pl(pcp.lock);
+				while (allocated < count && pcp.count[mobility][order]) { pages[allocated++] = pcp_pop(pcp, order, mobility); }
+			}
+
+			allocated += _arenas[i].allocate_blocks_bulk(order, mobility, pages + allocated, count - allocated);
+		}
+
+		if (allocated < count) { stat_add(_failure_stats.alloc_failures[order], 1); }
+
+		for (unsigned int i = 0; i < allocated; i++) { trace(TRACE_ALLOC, pages[i], order); }
+		if (allocated < count) { trace(TRACE_ALLOC_FAILED, NULL, order); }
+		return allocated;
+	}
+
+	/**
+	 * Frees a number of 2^order blocks of contiguous pages in one go.
+	 * @param pages The first page descriptor of each block.
+	 * @param count The number of blocks to free.
+	 * @param order The power of two, of the number of contiguous pages in each block.
+	 */
+	void free_pages_bulk(PageDescriptor* const* pages, unsigned int count, int order)
+	{
+		assert(order >= 0 && order <= MaxOrder);
+
+		UniqueIRQLock l;
+		for (unsigned int i = 0; i < count; i++) { trace(TRACE_FREE, pages[i], order); }
+
+		// while pages removed in use are outstanding, each block is checked for them on its own
+		if (__atomic_load_n(&_nr_removed_in_use, __ATOMIC_RELAXED))
+		{
+			for (unsigned int i = 0; i < count; i++)
+			{
+				if (!free_removed_pages(pages[i], pages_per_block(order))) { _arenas[arena_of(pages[i])].free_block(pages[i], order); }
+			}
+
+			return;
+		}
+
+		// each arena picks out and merges its own blocks
+		for (int i = 0; i < NR_ARENAS; i++)
+		{
+			if (_arenas[i].empty()) { continue; }
+
+			_arenas[i].free_blocks_bulk(pages, count, order);
+		}
+	}
+
+	/**
+	 * Returns one of the allocator's arenas, for its counters.
+	 * @param arena The arena.
+	 */
+	const Arena& arena(ArenaType arena) const { return _arenas[arena]; }
+
+	/**
+	 * Returns the number of pages in the free areas of every arena, plus the pages in the
+	 * pre-zeroed page pool, not counting the per-CPU page caches.  Pages in the pool are free
+	 * pages that are known to be clean: they are kept on a list rather than in the free areas,
+	 * so that a zeroed allocation finds one without searching, and go back to the free areas
+	 * whenever an allocation would otherwise fail.
+	 */
+	uint64_t nr_free_pages() const
+	{
+		uint64_t pages = __atomic_load_n(&_zero_pool_count, __ATOMIC_RELAXED);
+		for (int i = 0; i < NR_ARENAS; i++)
+		{
+			pages += _arenas[i].nr_free_pages();
+		}
+		return pages;
+	}
+
+	/**
+	 * Returns the page frames the free bitmaps are laid out over, which are never allocated.
+	 * @param pfn Set to the first page frame used.
+	 * @return Returns the number of pages used, or zero if the bitmaps are not laid out yet.
+	 */
+	uint64_t bitmap_pages(pfn_t& pfn) const
+	{
+		pfn = _bitmap_pfn;
+		return _bitmap_storage ? _nr_bitmap_pages : 0;
+	}
+
+	/**
+	 * Sets the number of pages an arena keeps back from allocations that prefer a higher arena.
+	 * @param arena The arena.
+	 * @param pages The number of pages to keep back.
+	 */
+	void set_arena_reserve(ArenaType arena, uint64_t pages)
+	{
+		UniqueIRQLock l;
+		_arena_reserves[arena] = pages;
+	}
+
+	/**
+	 * Sets the watermarks of the per-CPU page caches.  A cache that runs dry is refilled with
+	 * a batch of blocks, and a cache that grows past the high watermark is drained back down
+	 * to the low watermark.
+	 * @param low The number of blocks left in a cache after draining it.
+	 * @param high The number of blocks a cache may hold before it is drained.
+	 * @param batch The number of blocks taken from the free areas when refilling a cache.
+	 * @return Returns TRUE if the watermarks were valid and have been applied.
+	 */
+	bool set_pcp_watermarks(unsigned int low, unsigned int high, unsigned int batch)
+	{
+		if (low >= high || batch == 0 || batch > high) { return false; }
+
+		UniqueIRQLock l;
+		_pcp_low = low;
+		_pcp_high = high;
+		_pcp_batch = batch;
+		return true;
+	}
+
+    /**
+     * Marks a range of pages as available for allocation.
+     * @param start A pointer to the first page descriptors to be made available.
+     * @param count The number of page descriptors to make available.
+     */
+    virtual void insert_page_range(PageDescriptor* start, uint64_t count) override
+    {
+        if(!start) { return; }
+
+		UniqueIRQLock l;
+		pfn_t from = start - _pgd_base, to = from + count;
+		trace(TRACE_INSERT_RANGE, start, count);
+
+		// the free bitmaps live in the first range with room for them, and ranges that arrive
+		// before that one wait for it
+		if (!_bitmap_storage)
+		{
+			if (!carve_bitmap_storage(from, to))
+			{
+				if (_nr_early_ranges == MAX_EARLY_RANGES)
+				{
+					mm_log.messagef(LogLevel::WARNING, "Buddy: dropped %lu pages inserted before the free bitmaps", count);
+					return;
+				}
+
+				_early_ranges[_nr_early_ranges].from = from;
+				_early_ranges[_nr_early_ranges].to = to;
+				_nr_early_ranges++;
+				return;
+			}
+
+			for (unsigned int i = 0; i < _nr_early_ranges; i++)
+			{
+				release_page_range(_early_ranges[i].from, _early_ranges[i].to);
+			}
+
+			_nr_early_ranges = 0;
+		}
+
+		// pages coming back after being removed while in use are no longer to be dropped
+		if (__atomic_load_n(&_nr_removed_in_use, __ATOMIC_RELAXED))
+		{
+			stat_add(_nr_removed_in_use, -clear_removed_in_use(from, to));
+		}
+
+		release_page_range(from, to);
+
+		// the huge page pool is filled as memory arrives, while it is still in large blocks
+		refill_huge_pool();
+    }
+
+    /**
+     * Marks a range of pages as unavailable for allocation.
+     * @param start A pointer to the first page descriptors to be made unavailable.
+     * @param count The number of page descriptors to make unavailable.
+     */
+    virtual void remove_page_range(PageDescriptor* start, uint64_t count) override
+    {
+        if(!start) { return; }
+
+		UniqueIRQLock l;
+		pfn_t from = start - _pgd_base, to = from + count;
+		uint64_t in_use = 0;
+		trace(TRACE_REMOVE_RANGE, start, count);
+
+		// ranges still waiting for the free bitmaps are cut down instead
+		if (!_bitmap_storage)
+		{
+			remove_early_range(from, to);
+			return;
+		}
+
+		// cached and reserved pages are not in the free areas, so they go back there first
+		drain_zero_pool();
+
+		{
+			UniqueArenaLock hl(_huge_pool_lock);
+
+			PageDescriptor* prev = NULL;
+			PageDescriptor* block = _huge_pool;
+			while (block)
+			{
+				PageDescriptor* next = block->next_free;
+				pfn_t pfn = block - _pgd_base;
+
+				if (pfn + pages_per_block(HUGE_PAGE_ORDER) <= from || pfn >= to) { prev = block; }
+				else
+				{
+					if (prev) { prev->next_free = next; }
+					else { _huge_pool = next; }
+
+					_huge_pool_count--;
+					do_free_pages(block, HUGE_PAGE_ORDER);
+				}
+
+				block = next;
+			}
+		}
+
+		for (int i = 0; i < NR_ARENAS; i++)
+		{
+			pfn_t lo = from > _arenas[i].start_pfn() ? from : _arenas[i].start_pfn();
+			pfn_t hi = to < _arenas[i].end_pfn() ? to : _arenas[i].end_pfn();
+			if (lo >= hi) { continue; }
+
+			drain_all_pcp(i);
+			in_use += _arenas[i].remove_range(_pgd_base + lo, hi - lo, _removed_in_use);
+		}
+
+		if (in_use)
+		{
+			stat_add(_nr_removed_in_use, in_use);
+			mm_log.messagef(LogLevel::WARNING, "Buddy: %lu of %lu pages removed were not free, and will be dropped when freed", in_use, count);
+		}
 
-	/** Given an order, returns the number of pages in a block of that order.
-	 * @param order The order.
-	 * @return The number of pages.
-	*/
-	constexpr pfn_t pages_per_block(int order)
-	{
-		return 1 << order;
-	}
+		refill_huge_pool();
+    }
 
 	/**
-	 * Given a block size, returns the highest order that will fit inside it.
-	 * @param block_size The block size.
-	 * @return The highest order.
+	 * Initialises the allocation algorithm.
+	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
 	 */
-	int get_max_order(int block_size)
+	bool init(PageDescriptor* page_descriptors, uint64_t nr_page_descriptors) override
 	{
-		int order = 0;
-		while ((1 << order) < block_size) 
+		_pgd_base = page_descriptors;
+		_nr_pages = nr_page_descriptors;
+
+		// the arenas stay empty until a range arrives with room for their free bitmaps
+		_bitmap_storage = NULL;
+		_nr_bitmap_pages = 0;
+		_nr_early_ranges = 0;
+		_nr_removed_in_use = 0;
+		for (int i = 0; i < NR_ARENAS; i++)
 		{
-			order++;
+			_arenas[i].init(0, 0, NULL, NULL, page_descriptors);
 		}
-		return order;
+
+		_arena_reserves[ARENA_DMA] = ARENA_DEFAULT_DMA_RESERVE;
+		_arena_reserves[ARENA_DMA32] = ARENA_DEFAULT_DMA32_RESERVE;
+		_arena_reserves[ARENA_NORMAL] = 0;
+
+		_huge_pool_target = boot_huge_pool_size;
+
+		_instance = this;
+
+		mm_log.messagef(LogLevel::DEBUG, "Buddy Page Allocator online");
+        return true;
 	}
 
-	/** Given a page descriptor and an order, returns the offset between the start of the nearest
-	 * block of that order and the pfn of the page. 
-	 * @param pgd The page descriptor to find the offset for.
-	 * @param order The order of block from which to check the offset.
-	 * @return The offset between the page and the start of the block.
+	/**
+	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
 	 */
-	constexpr pfn_t page_offset_from_block(PageDescriptor* pgd, int order)
-	{
-		return sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order);
-	}
+	const char* name() const override { return "buddy"; }
 
 	/**
-	 * Helper function that inserts a block into the _free_areas array at the level specified in order.
-	 * @param block The page descriptor of the first page in the block.
-	 * @param order The order level into which to insert the block.
+	 * Dumps out the current state of the buddy system
 	 */
-	void insert_block_into_free_areas(PageDescriptor* block, int order)
+	void dump_state() const override
 	{
-		PageDescriptor** block_list = &_free_areas[order];
-
-		PageDescriptor* insert_after = *block_list;
+		static const char* arena_names[NR_ARENAS] = { "dma", "dma32", "normal" };
 
-		if (!insert_after) 
-		{ 
-			*block_list = block; 
-			block->next_free = nullptr;
-			block->prev_free = nullptr;
-			return;
+		if (!_bitmap_storage)
+		{
+			mm_log.messagef(LogLevel::DEBUG, "BITMAPS: not laid out, %u ranges waiting", _nr_early_ranges);
 		}
-		else if (block < insert_after)
+		else
 		{
-			*block_list = block;
-			block->next_free = insert_after;
-			block->prev_free = nullptr;
-			return;
+			mm_log.messagef(LogLevel::DEBUG, "BITMAPS: %lu pages at pfn %lx, %lu removed pages still in use",
+				_nr_bitmap_pages, _bitmap_pfn, _nr_removed_in_use);
 		}
 
-		while (insert_after && block > insert_after) { insert_after = insert_after->next_free; }
+		for (int i = 0; i < NR_ARENAS; i++) {
+			if (_arenas[i].empty()) { continue; }
+			_arenas[i].dump_state(arena_names[i]);
+		}
 
-		block->prev_free = insert_after;
+		mm_log.messagef(LogLevel::DEBUG, "FAILED ALLOCATIONS: %lu ranges", _failure_stats.range_alloc_failures);
+		for (int i = 0; i <= MaxOrder; i++) {
+			if (!_failure_stats.alloc_failures[i]) { continue; }
+			mm_log.messagef(LogLevel::DEBUG, "[%d] failed=%lu", i, _failure_stats.alloc_failures[i]);
+		}
 
-		if (insert_after)
-		{
-			block->next_free = insert_after->next_free;
-			if (insert_after->next_free) { insert_after->next_free->prev_free = block; }
-			insert_after->next_free = block;
+		for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+			if (!_failure_stats.latency[i]) { continue; }
+			mm_log.messagef(LogLevel::DEBUG, "<2^%u cycles: failed=%lu", i + 1, _failure_stats.latency[i]);
 		}
-		else
-		{
-			block->next_free = nullptr;
+
+		mm_log.messagef(LogLevel::DEBUG, "ZERO POOL: %lu pages, %lu hits, %lu misses",
+			_zero_pool_count, _zero_pool_hits, _zero_pool_misses);
+		mm_log.messagef(LogLevel::DEBUG, "HUGE POOL: %lu of %lu huge pages, %lu hits, %lu misses",
+			_huge_pool_count, _huge_pool_target, _huge_pool_hits, _huge_pool_misses);
+
+		for (int i = 0; i < MAX_CPUS; i++) {
+			const BuddyTraceRing& ring = _trace_rings[i];
+			if (!ring.head) { continue; }
+
+			mm_log.messagef(LogLevel::DEBUG, "TRACE cpu%d: %lu recorded, %lu unread, %lu lost",
+				i, ring.head, ring.head - ring.tail, ring.lost);
 		}
 	}
 
+private:
+	Arena _arenas[NR_ARENAS];
+	uint64_t _arena_reserves[NR_ARENAS];
+	BuddyFailureStats<MaxOrder> _failure_stats;
+	uint64_t* _bitmap_storage;
+	uint64_t _nr_bitmap_pages;
+	pfn_t _bitmap_pfn;
+	PageDescriptor* _pgd_base;
+	uint64_t _nr_pages;
+	uint8_t* _pageblock_mobility;
+	uint64_t* _removed_in_use;
+	uint64_t _nr_removed_in_use;
+
+	struct { pfn_t from, to; } _early_ranges[MAX_EARLY_RANGES];
+	unsigned int _nr_early_ranges;
+
+	PerCpuPageCache _pcp[NR_ARENAS][MAX_CPUS];
+	unsigned int _pcp_low = PCP_DEFAULT_LOW;
+	unsigned int _pcp_high = PCP_DEFAULT_HIGH;
+	unsigned int _pcp_batch = PCP_DEFAULT_BATCH;
+
+	PageDescriptor* _zero_pool;
+	uint64_t _zero_pool_count;
+	unsigned int _zero_pool_low = ZERO_POOL_DEFAULT_LOW;
+	unsigned int _zero_pool_high = ZERO_POOL_DEFAULT_HIGH;
+	uint64_t _zero_pool_hits, _zero_pool_misses;
+	ArenaLock _zero_pool_lock;
+	WakeQueue _zero_pool_waitq;
+	bool _zero_pool_thread_started;
+
+	PageDescriptor* _huge_pool;
+	uint64_t _huge_pool_count, _huge_pool_target;
+	uint64_t _huge_pool_hits, _huge_pool_misses;
+	ArenaLock _huge_pool_lock;
+
+	bool _tracing;
+	BuddyTraceRing _trace_rings[MAX_CPUS];
+
+	static inline BasicBuddyPageAllocator* _instance;
+	static inline Shrinker _shrinkers[MAX_SHRINKERS];
+	static inline unsigned int _nr_shrinkers;
+};
+
+/* The buddy allocator, as configured for InfOS. */
+typedef BasicBuddyPageAllocator<MAX_ORDER> BuddyPageAllocator;
+
+/**
+ * A slab of objects, cut from a block of the buddy allocator.  The header sits at the start of
+ * the block, and blocks are naturally aligned in the kernel's direct mapping, so the slab an
+ * object belongs to is found by masking its address.
+ */
+struct Slab
+{
+	Slab* prev;
+	Slab* next;
+	PageDescriptor* pages;
+	void* free_objects;
+	unsigned int in_use;
+};
+
+/**
+ * A per-CPU magazine of free objects, so that most allocations and frees are a pointer pop or
+ * push.  Only the owning CPU touches a magazine, with interrupts disabled.
+ */
+struct SlabMagazine
+{
+	unsigned int count;
+	void* objects[SLAB_MAGAZINE_SIZE];
+};
+
+/**
+ * A cache of kernel objects of one size, kept in slabs taken from the buddy allocator.  Objects
+ * can be given a constructor, which runs once when their slab is created rather than on every
+ * allocation, so objects must be handed back in their constructed state.  Slabs that empty out
+ * are kept for reuse, and given back to the buddy allocator when it runs short of memory.
+ */
+class SlabCache
+{
+public:
+	/* A function that puts a newly created object into its constructed state. */
+	typedef void (*Constructor)(void* object);
+
 	/**
-	 * Helper function that removes a block from a given order level in _free_areas 
-	 * @param block The page descriptor of the first page in the block.
-	 * @param order The order level into which to insert the block.
+	 * Sets the cache up.  This must be called once, before the cache is used.
+	 * @param name The name of the cache, for the log.
+	 * @param object_size The size of each object, in bytes.
+	 * @param ctor The constructor for new objects, or NULL if they need none.
+	 * @return Returns TRUE if the cache was set up, or FALSE if its objects are too large.
 	 */
-	void remove_block_from_free_areas(PageDescriptor* block, int order)
+	bool init(const char* name, uint64_t object_size, Constructor ctor = NULL)
 	{
-		assert(block);
-		PageDescriptor** block_list = &_free_areas[order];
+		_name = name;
+		_ctor = ctor;
+		_object_size = (object_size + SLAB_ALIGN - 1) & ~(uint64_t)(SLAB_ALIGN - 1);
 
-		if (block->prev_free) { block->prev_free->next_free = block->next_free; }
-		if (block->next_free) { block->next_free->prev_free = block->prev_free; }
-		if (*block_list == block) { *block_list = block->next_free; }
-	}
+		// constructed objects keep their contents while free, so the free list link goes after them
+		_stride = ctor ? _object_size + SLAB_ALIGN : _object_size;
 
-	/** Given a page descriptor, and an order, returns the buddy PGD.  The buddy could either be
-	 * to the left or the right of PGD, in the given order.
-	 * @param pgd The page descriptor to find the buddy for.
-	 * @param order The order in which the page descriptor lives.
-	 * @return Returns the buddy of the given page descriptor, in the given order.
-	 */
-	PageDescriptor* buddy_of(PageDescriptor* pgd, int order)
-	{
-		// assertions
-		assert(order <= MAX_ORDER);
+		_order = 0;
+		while (_order < SLAB_MAX_ORDER && objects_per_slab(_order) < SLAB_MIN_OBJECTS) { _order++; }
 
-		// offset setups
-		pfn_t order_offset = pages_per_block(order);
-		pfn_t offset_from_block_start = page_offset_from_block(pgd, order);
-		pfn_t offset_from_higher_block_start = page_offset_from_block(pgd, order + 1);
+		_objects_per_slab = objects_per_slab(_order);
+		if (!_objects_per_slab) { return false; }
 
-		// buddy logic
-		if (offset_from_block_start == 0 && offset_from_higher_block_start == 0) { return pgd + order_offset; }
-		else if (offset_from_block_start == 0) { return pgd - order_offset; }
-		else if (offset_from_higher_block_start > offset_from_block_start) { return pgd - offset_from_higher_block_start; }
-		else { return pgd + order_offset - offset_from_block_start; }
+		_partial = _full = _empty = NULL;
+		_nr_slabs = _nr_in_use = 0;
+		for (int i = 0; i < MAX_CPUS; i++) { _magazines[i].count = 0; }
+
+		link_cache(this);
+		return true;
 	}
 
 	/**
-	 * Given a pointer to a block of free memory in the order "source_order", this function will
-	 * split the block in half, and insert it into the order below.
-	 * @param block_pointer A pointer to a pointer containing the beginning of a block of free memory.
-	 * @param source_order The order in which the block of free memory exists.  Naturally,
-	 * the split will insert the two new blocks into the order below.
-	 * @return Returns the left-hand-side of the new block.
+	 * Allocates an object.
+	 * @return Returns the object, or NULL if memory ran out.
 	 */
-	PageDescriptor* split_block(PageDescriptor** block_pointer, int source_order)
+	void* alloc()
 	{
-		// assertions
-		assert(source_order <= MAX_ORDER);
-		assert(source_order > 0);
+		UniqueIRQLock l;
 
-		// setup source variables
-		PageDescriptor* source_block = *block_pointer;
-		PageDescriptor** source_block_list = &_free_areas[source_order];
+		SlabMagazine& magazine = _magazines[current_cpu()];
+		if (!magazine.count && !refill_magazine(magazine)) { return NULL; }
 
-		// remove source block from source order free area list
-		remove_block_from_free_areas(source_block, source_order);
+		return magazine.objects[--magazine.count];
+	}
 
-		// setup new variables
-		int new_order = source_order - 1;
-		PageDescriptor* newBuddy = buddy_of(source_block, new_order);
+	/**
+	 * Frees an object, which must be in its constructed state.
+	 * @param object The object.
+	 */
+	void free(void* object)
+	{
+		UniqueIRQLock l;
 
-		//add new block and buddy to new free area list
-		insert_block_into_free_areas(source_block, new_order);
-		insert_block_into_free_areas(newBuddy, new_order);
+		SlabMagazine& magazine = _magazines[current_cpu()];
+		if (magazine.count == SLAB_MAGAZINE_SIZE) { flush_magazine(magazine, SLAB_MAGAZINE_SIZE / 2); }
 
-		return newBuddy;
+		magazine.objects[magazine.count++] = object;
 	}
 
 	/**
-	 * Takes a block in the given source order, and merges it (and its buddy) into the next order.
-	 * @param block_pointer A pointer to a pointer containing a block in the pair to merge.
-	 * @param source_order The order in which the pair of blocks live.
-	 * @return Returns the new slot that points to the merged block.
+	 * Gives every empty slab back to the buddy allocator, after emptying this CPU's magazine.
+	 * @return Returns the number of pages given back.
 	 */
-	PageDescriptor** merge_block(PageDescriptor** block_pointer, int source_order)
+	uint64_t reclaim()
 	{
-		// assertions
-		assert(source_order >= 0 && source_order < MAX_ORDER);
-
-		// setup variables
-		PageDescriptor* source_block = *block_pointer;
-		PageDescriptor* source_buddy = buddy_of(source_block, source_order);
-		int new_order = source_order + 1;
-		PageDescriptor *left_block, *right_block;
+		UniqueIRQLock l;
+		flush_magazine(_magazines[current_cpu()], 0);
 
-		if (source_block < source_buddy)
+		Slab* empty;
 		{
-			left_block = source_block;
-			right_block = source_buddy;
+			UniqueArenaLock cl(_lock);
+			empty = _empty;
+			_empty = NULL;
 		}
-		else
+
+		uint64_t freed = 0;
+		while (empty)
 		{
-			left_block = source_buddy;
-			right_block = source_block;
-		}
+			Slab* next = empty->next;
+
+			BuddyPageAllocator::instance()->free_pages(empty->pages, _order);
+			stat_add(_nr_slabs, -1);
+			freed += 1ULL << _order;
 
-		// remove source block and buddy from source order free area list
-		PageDescriptor** source_block_list = &_free_areas[source_order];
-		remove_block_from_free_areas(left_block, source_order);
-		remove_block_from_free_areas(right_block, source_order);
+			empty = next;
+		}
 
-		// add merged block to new free area list
-		insert_block_into_free_areas(left_block, new_order);
+		return freed;
+	}
 
-		return &left_block;
+	/**
+	 * Dumps out the cache's counters.
+	 */
+	void dump_state() const
+	{
+		mm_log.messagef(LogLevel::DEBUG, "SLAB %s: %lu bytes, order %d, %u per slab, %lu slabs, %lu in use",
+			_name, _object_size, _order, _objects_per_slab, _nr_slabs, _nr_in_use);
 	}
 
 	/**
-	 * Merges all free blocks that can be merged with their buddy. 
+	 * Reclaims empty slabs from every cache.  This is registered as a shrinker with the buddy
+	 * allocator, so it runs when an allocation would otherwise fail.
+	 * @return Returns the number of pages given back.
 	 */
-	void full_merge()
+	static uint64_t reclaim_all()
 	{
-		for (int i = 0; i < MAX_ORDER; i++)
+		uint64_t freed = 0;
+		for (SlabCache* cache = _caches; cache; cache = cache->_next)
 		{
-			PageDescriptor* block = _free_areas[i];
-			
-			while (block->next_free)
-			{
-				if (block->next_free == buddy_of(block, i))
-				{
-					merge_block(&block, i);
-				}	
-			}
+			freed += cache->reclaim();
 		}
+
+		return freed;
 	}
 
 	/**
-	 * Helper function that takes a starting pfn, range size and top order level, and removes any blocks containing
-	 * pages in that range below the order level
-	 * @param start start pfn
-	 * @param count size of page range
-	 * @param top_order order level under which to remove the blocks
+	 * Dumps out the counters of every cache.
 	 */
-	void remove_lower_order_blocks_in_range(pfn_t start, int count, int top_order)
+	static void dump_all()
 	{
-		for (int i = 0; i < top_order; i++)
+		for (SlabCache* cache = _caches; cache; cache = cache->_next)
 		{
-			PageDescriptor* block = _free_areas[i];
-			pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(block);
-
-			while (block)
-			{
-				PageDescriptor* next = block->next_free;
-				if (start <= pfn && pfn < start + count) { remove_block_from_free_areas(block, i); }
-				block = next;
-			}
+			cache->dump_state();
 		}
-		
 	}
 
+private:
+	/**
+	 * Returns the number of bytes at the start of a slab taken by its header.
+	 */
+	static constexpr uint64_t header_size()
+	{
+		return (sizeof(Slab) + SLAB_ALIGN - 1) & ~(uint64_t)(SLAB_ALIGN - 1);
+	}
+
+	/**
+	 * Returns the number of objects that fit in a slab of the given order.
+	 * @param order The order of the slab.
+	 */
+	unsigned int objects_per_slab(int order) const
+	{
+		return ((BUDDY_PAGE_SIZE << order) - header_size()) / _stride;
+	}
 
-public:
 	/**
-	 * Allocates 2^order number of contiguous pages
-	 * @param order The power of two, of the number of contiguous pages to allocate.
-	 * @return Returns a pointer to the first page descriptor for the newly allocated page range, or NULL if
-	 * allocation failed.
+	 * Returns the free list link of a free object.
+	 * @param object The object.
 	 */
-	PageDescriptor* allocate_pages(int order) override
+	void*& free_link(void* object) const
+	{
+		return *(void **)((char *)object + (_ctor ? _object_size : 0));
+	}
+
+	/**
+	 * Returns the slab an object belongs to.
+	 * @param object The object.
+	 */
+	Slab* slab_of(void* object) const
 	{
-		// ensure all memory is in highest order possible
-		full_merge();
+		return (Slab *)((uintptr_t)object & ~(uintptr_t)((BUDDY_PAGE_SIZE << _order) - 1));
+	}
 
-		int tempOrder = order;
+	/**
+	 * Removes a slab from one of the cache's lists.
+	 * @param list The list.
+	 * @param slab The slab.
+	 */
+	static void list_remove(Slab*& list, Slab* slab)
+	{
+		if (slab->prev) { slab->prev->next = slab->next; }
+		else { list = slab->next; }
+		if (slab->next) { slab->next->prev = slab->prev; }
+	}
 
-		while (tempOrder >= 0)
-		{
-			PageDescriptor** block_list = &_free_areas[tempOrder];
-			PageDescriptor* head = *block_list;
+	/**
+	 * Adds a slab to the front of one of the cache's lists.
+	 * @param list The list.
+	 * @param slab The slab.
+	 */
+	static void list_push(Slab*& list, Slab* slab)
+	{
+		slab->prev = NULL;
+		slab->next = list;
+		if (list) { list->prev = slab; }
+		list = slab;
+	}
 
-			if (!head) { --tempOrder; continue; }
+	/**
+	 * Takes a new slab from the buddy allocator, and constructs every object in it.
+	 * @return Returns the slab, or NULL if memory ran out.
+	 */
+	Slab* create_slab()
+	{
+		BuddyPageAllocator* buddy = BuddyPageAllocator::instance();
+		if (!buddy) { return NULL; }
 
-			// the number of contiguous blocks in this order needed to satisfy the allocation.
-			int blocksNeeded = pages_per_block(order - tempOrder);
+		PageDescriptor* pages = buddy->allocate_pages(_order, MOBILITY_UNMOVABLE);
+		if (!pages) { return NULL; }
 
-			PageDescriptor* startBlock = head;
-			int consecutive_count = 1;
-			bool pagesFound = true;
+		Slab* slab = (Slab *)sys.mm().pgalloc().pgd_to_kva(pages);
+		slab->pages = pages;
+		slab->free_objects = NULL;
+		slab->in_use = 0;
 
-			// loop through free blocks to see if enough are contiguous to fill order
-			while (consecutive_count < blocksNeeded)
-			{
-				if (!startBlock->next_free) { pagesFound = false; break; }
+		// chain the objects up in address order
+		char* objects = (char *)slab + header_size();
+		for (unsigned int i = _objects_per_slab; i-- > 0;)
+		{
+			void* object = objects + i * _stride;
+			if (_ctor) { _ctor(object); }
 
-				if (startBlock->next_free == startBlock + pages_per_block(tempOrder)) { ++consecutive_count; }
-				else { startBlock = startBlock->next_free; }
-			}
+			free_link(object) = slab->free_objects;
+			slab->free_objects = object;
+		}
+
+		stat_add(_nr_slabs, 1);
+		return slab;
+	}
 
-			if (!pagesFound) { --tempOrder; continue; }
-			// if enough contiguous blocks found, remove from free areas and return start
-			else
+	/**
+	 * Fills half of a magazine with objects from the cache's slabs, making a new slab if there
+	 * are no free objects.  Callers must have interrupts disabled.
+	 * @param magazine The magazine.
+	 * @return Returns TRUE if any objects were added.
+	 */
+	bool refill_magazine(SlabMagazine& magazine)
+	{
+		while (true)
+		{
 			{
-				for (int i = 0; i < consecutive_count; i++)
+				UniqueArenaLock cl(_lock);
+
+				while (magazine.count < SLAB_MAGAZINE_SIZE / 2)
 				{
-					remove_block_from_free_areas(startBlock + i * pages_per_block(tempOrder), tempOrder);
+					Slab* slab = _partial ? _partial : _empty;
+					if (!slab) { break; }
+
+					magazine.objects[magazine.count++] = take_object(slab);
 				}
-				return startBlock;
 			}
-		}  
 
-		return NULL;
+			if (magazine.count) { return true; }
+
+			// the slab is made without the lock held, since the buddy allocator may call back
+			// into the cache to reclaim memory
+			Slab* slab = create_slab();
+			if (!slab) { return false; }
+
+			UniqueArenaLock cl(_lock);
+			list_push(_empty, slab);
+		}
 	}
 
-    /**
-	 * Frees 2^order contiguous pages.
-	 * @param pgd A pointer to an array of page descriptors to be freed.
-	 * @param order The power of two number of contiguous pages to free.
+	/**
+	 * Takes a free object from a slab, moving the slab to the right list.  Callers must hold
+	 * the cache's lock.
+	 * @param slab The slab, which must have a free object.
+	 * @return Returns the object.
 	 */
-    void free_pages(PageDescriptor* pgd, int order) override
-    {
-		pfn_t block_offset = page_offset_from_block(pgd, order);
-		pfn_t pfn = sys.mm().pgalloc().pgd_to_pfn(pgd);
+	void* take_object(Slab* slab)
+	{
+		void* object = slab->free_objects;
+		slab->free_objects = free_link(object);
 
-		if (block_offset == 0)
-		{
-			remove_lower_order_blocks_in_range(pfn, pfn + pages_per_block(order), order);
-			insert_block_into_free_areas(pgd, order);
-			return;
-		}
-		else
-		{
+		if (slab->in_use == 0) { list_remove(_empty, slab); }
+		else { list_remove(_partial, slab); }
 
-		}
-    }
+		slab->in_use++;
+		if (slab->in_use == _objects_per_slab) { list_push(_full, slab); }
+		else { list_push(_partial, slab); }
 
-    /**
-     * Marks a range of pages as available for allocation.
-     * @param start A pointer to the first page descriptors to be made available.
-     * @param count The number of page descriptors to make available.
-     */
-    virtual void insert_page_range(PageDescriptor* start, uint64_t count) override
-    {
-        if(!start) { return; }
-		PageDescriptor* block = start;
-		int start_pfn = sys.mm().pgalloc().pgd_to_pfn(start);
-		int final_pfn = sys.mm().pgalloc().pgd_to_pfn(start) + count;
+		stat_add(_nr_in_use, 1);
+		return object;
+	}
+
+	/**
+	 * Gives objects from a magazine back to their slabs.  Callers must have interrupts disabled.
+	 * @param magazine The magazine.
+	 * @param target The number of objects to leave in the magazine.
+	 */
+	void flush_magazine(SlabMagazine& magazine, unsigned int target)
+	{
+		UniqueArenaLock cl(_lock);
 
-		while(true)
+		while (magazine.count > target)
 		{
-			//find highest order to insert block
+			void* object = magazine.objects[--magazine.count];
+			Slab* slab = slab_of(object);
 
-			int 
-		}
-    }
+			free_link(object) = slab->free_objects;
+			slab->free_objects = object;
 
-    /**
-     * Marks a range of pages as unavailable for allocation.
-     * @param start A pointer to the first page descriptors to be made unavailable.
-     * @param count The number of page descriptors to make unavailable.
-     */
-    virtual void remove_page_range(PageDescriptor* start, uint64_t count) override
-    {
-        // TODO: Implement me!
-    }
+			if (slab->in_use == _objects_per_slab) { list_remove(_full, slab); }
+			else { list_remove(_partial, slab); }
+
+			slab->in_use--;
+			if (slab->in_use == 0) { list_push(_empty, slab); }
+			else { list_push(_partial, slab); }
+
+			stat_add(_nr_in_use, -1);
+		}
+	}
 
 	/**
-	 * Initialises the allocation algorithm.
-	 * @return Returns TRUE if the algorithm was successfully initialised, FALSE otherwise.
+	 * Adds a cache to the list of every cache, registering the shrinker along with the first one.
+	 * @param cache The cache.
 	 */
-	bool init(PageDescriptor* page_descriptors, uint64_t nr_page_descriptors) override
+	static void link_cache(SlabCache* cache)
 	{
-		mm_log.messagef(LogLevel::DEBUG, "Buddy Page Allocator online");
-        return true;
+		UniqueIRQLock l;
+		UniqueArenaLock cl(_caches_lock);
+
+		if (!_caches) { BuddyPageAllocator::register_shrinker(reclaim_all); }
+
+		cache->_next = _caches;
+		_caches = cache;
 	}
 
-	/**
-	 * Returns the friendly name of the allocation algorithm, for debugging and selection purposes.
-	 */
-	const char* name() const override { return "buddy"; }
+	const char* _name;
+	Constructor _ctor;
+	uint64_t _object_size, _stride;
+	int _order;
+	unsigned int _objects_per_slab;
 
-	/**
-	 * Dumps out the current state of the buddy system
-	 */
-	void dump_state() const override
+	ArenaLock _lock;
+	Slab *_partial, *_full, *_empty;
+	SlabMagazine _magazines[MAX_CPUS];
+	uint64_t _nr_slabs, _nr_in_use;
+
+	SlabCache* _next;
+	static inline SlabCache* _caches;
+	static inline ArenaLock _caches_lock;
+};
+
+/* The general purpose slab caches, one per size class. */
+static SlabCache slab_size_caches[SLAB_SIZE_CLASSES];
+static ArenaLock slab_size_caches_lock;
+static bool slab_size_caches_ready;
+
+/**
+ * Returns the general purpose slab cache for objects of the given size, setting the caches up
+ * on first use.
+ * @param size The size of the object, in bytes.
+ * @return Returns the cache, or NULL if the object is too large for any of them.
+ */
+static SlabCache* slab_size_cache(uint64_t size)
+{
+	static const char* names[SLAB_SIZE_CLASSES] = {
+		"size-16", "size-32", "size-64", "size-128", "size-256", "size-512", "size-1024", "size-2048"
+	};
+
+	// the caches must be fully set up before any CPU sees the flag, so it is published with release
+	if (!__atomic_load_n(&slab_size_caches_ready, __ATOMIC_ACQUIRE))
 	{
-		// Print out a header, so we can find the output in the logs.
-		mm_log.messagef(LogLevel::DEBUG, "BUDDY STATE:");
-
-		// Iterate over each free area.
-		for (unsigned int i = 0; i < ARRAY_SIZE(_free_areas); i++) {
-			char buffer[256];
-			snprintf(buffer, sizeof(buffer), "[%d] ", i);
-
-			// Iterate over each block in the free area.
-			PageDescriptor *pg = _free_areas[i];
-			while (pg) {
-				// Append the PFN of the free block to the output buffer.
-				snprintf(buffer, sizeof(buffer), "%s%lx ", buffer, sys.mm().pgalloc().pgd_to_pfn(pg));
-				pg = pg->next_free;
+		UniqueIRQLock l;
+		UniqueArenaLock sl(slab_size_caches_lock);
+		if (!__atomic_load_n(&slab_size_caches_ready, __ATOMIC_RELAXED))
+		{
+			for (int i = 0; i < SLAB_SIZE_CLASSES; i++)
+			{
+				slab_size_caches[i].init(names[i], SLAB_MIN_SIZE << i);
 			}
-
-			mm_log.messagef(LogLevel::DEBUG, "%s", buffer);
+			__atomic_store_n(&slab_size_caches_ready, true, __ATOMIC_RELEASE);
 		}
 	}
 
-private:
-	PageDescriptor* _free_areas[MAX_ORDER+1];
-};
+	int size_class = size <= SLAB_MIN_SIZE ? 0 : 64 - __builtin_clzll((size - 1) / SLAB_MIN_SIZE);
+	if (size_class >= SLAB_SIZE_CLASSES) { return NULL; }
+
+	return &slab_size_caches[size_class];
+}
+
+/**
+ * Allocates a small object from the general purpose slab caches.
+ * @param size The size of the object, in bytes, of at most 2KiB.
+ * @return Returns the object, or NULL if it is too large or memory ran out.
+ */
+void* slab_alloc(uint64_t size)
+{
+	SlabCache* cache = slab_size_cache(size);
+	if (!cache) { return NULL; }
+
+	return cache->alloc();
+}
+
+/**
+ * Frees an object allocated by slab_alloc().
+ * @param object The object.
+ * @param size The size it was allocated with.
+ */
+void slab_free(void* object, uint64_t size)
+{
+	if (!object) { return; }
+
+	SlabCache* cache = slab_size_cache(size);
+	assert(cache);
+
+	cache->free(object);
+}
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
 
@@ -0,0 +1,691 @@
+/*
+ * Host-side microbenchmarks for the buddy page allocator.  Each scenario runs against a fresh
+ * allocator over simulated memory, checks every allocation and free against a reference
+ * model, and reports the rate and latency percentiles of the operations it times.
+ *
+ * With -t, the allocator's trace of the first machine a scenario builds is written to a file,
+ * for buddy-replay to feed back into another build.
+ */
+
+#include "../buddy.cpp"
+#include "harness.h"
+
+#include <random>
+#include <unistd.h>
+
+/* The simulated machine is laid out like a PC: low memory below 640KiB, a hole up to 1MiB,
+ * and a hole below 4GiB for devices. */
+#define LOW_MEMORY_END	0x9f
+#define HIGH_MEMORY		0x100
+#define PCI_HOLE		0xc0000
+#define PCI_HOLE_END	0x100000
+
+/* The file the trace is written to, if one was asked for, and whether a machine is tracing. */
+static FILE *trace_file;
+static bool trace_taken;
+
+struct Options
+{
+	bool quick;
+	uint64_t insert_gib;
+	const char *only;
+};
+
+/**
+ * A fresh allocator over fresh simulated memory, with the reference model following along.
+ */
+class Machine
+{
+public:
+	Machine(uint64_t nr_pages) : memory(nr_pages), model(nr_pages), allocator(new BuddyPageAllocator())
+	{
+		allocator->init(memory.pgds(), nr_pages);
+
+		// the arenas' reserves would hide pages the model expects to be able to allocate
+		allocator->set_arena_reserve(ARENA_DMA, 0);
+		allocator->set_arena_reserve(ARENA_DMA32, 0);
+
+		if (trace_file && !trace_taken) {
+			trace_taken = _tracing = true;
+			allocator->set_tracing(true);
+		}
+	}
+
+	~Machine()
+	{
+		poll_trace();
+		delete allocator;
+	}
+
+	/**
+	 * Writes out the records in the allocator's trace rings, if this machine is being traced.
+	 * The rings overwrite their oldest records when they fill, so this is called after every
+	 * operation, outside the timed part.
+	 */
+	void poll_trace()
+	{
+		if (!_tracing) { return; }
+
+		BuddyTraceRecord records[256];
+		for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+			while (unsigned int count = allocator->read_trace(cpu, records, 256)) {
+				fwrite(records, sizeof(records[0]), count, trace_file);
+			}
+		}
+	}
+
+	/**
+	 * Inserts the memory of a PC with this many pages, skipping its holes.
+	 */
+	void insert_pc_memory()
+	{
+		insert(1, LOW_MEMORY_END);
+		insert(HIGH_MEMORY, PCI_HOLE);
+		insert(PCI_HOLE_END, memory.nr_pages());
+	}
+
+	void insert(pfn_t from, pfn_t to)
+	{
+		if (to > memory.nr_pages()) { to = memory.nr_pages(); }
+		if (from >= to) { return; }
+
+		allocator->insert_page_range(memory.pgds() + from, to - from);
+		model.insert(from, to - from);
+		poll_trace();
+
+		// the pages the free bitmaps were carved from are never allocated
+		pfn_t pfn;
+		uint64_t nr_bitmap_pages = allocator->bitmap_pages(pfn);
+		if (nr_bitmap_pages && !_bitmaps_removed) {
+			model.remove(pfn, nr_bitmap_pages);
+			_bitmaps_removed = true;
+		}
+	}
+
+	PageDescriptor *allocate(int order)
+	{
+		PageDescriptor *block = allocator->allocate_pages(order);
+		if (block) { model.allocate(block - memory.pgds(), 1ULL << order, 1ULL << order); }
+		poll_trace();
+		return block;
+	}
+
+	void free(PageDescriptor *block, int order)
+	{
+		model.free(block - memory.pgds(), 1ULL << order);
+		allocator->free_pages(block, order);
+		poll_trace();
+	}
+
+	/**
+	 * Frees every block still allocated, then allocates every free page again one at a time.
+	 * Every page the model says is free must come back exactly once.
+	 * @return Returns TRUE if the allocator and the model agree.
+	 */
+	bool check(std::vector<std::pair<PageDescriptor *, int>>& live)
+	{
+		for (auto& block : live) {
+			free(block.first, block.second);
+		}
+		live.clear();
+
+		uint64_t expected = model.nr_free(), found = 0;
+		while (PageDescriptor *page = allocate(0)) {
+			live.push_back({ page, 0 });
+			found++;
+		}
+
+		if (found != expected) { model.error("%lu pages could be allocated, but %lu were free", found, expected); }
+
+		for (auto& block : live) {
+			free(block.first, block.second);
+		}
+		live.clear();
+
+		return model.errors() == 0;
+	}
+
+	HostMemory memory;
+	ReferenceModel model;
+	BuddyPageAllocator *allocator;
+
+private:
+	bool _bitmaps_removed = false;
+	bool _tracing = false;
+};
+
+/**
+ * Keeps half of memory allocated as single pages, and frees and reallocates random ones.
+ */
+static bool churn(const Options& options)
+{
+	Machine machine(options.quick ? 1 << 16 : 1 << 18);
+	machine.insert_pc_memory();
+
+	std::mt19937_64 rng(1);
+	std::vector<std::pair<PageDescriptor *, int>> live;
+	LatencyRecorder allocs, frees;
+
+	uint64_t target = machine.model.nr_free() / 2;
+	while (live.size() < target) {
+		live.push_back({ machine.allocate(0), 0 });
+	}
+
+	uint64_t nr_ops = options.quick ? 200000 : 5000000;
+	for (uint64_t i = 0; i < nr_ops; i++) {
+		size_t victim = rng() % live.size();
+		PageDescriptor *page = live[victim].first;
+		machine.model.free(page - machine.memory.pgds(), 1);
+
+		uint64_t start = LatencyRecorder::now();
+		machine.allocator->free_pages(page, 0);
+		frees.record(LatencyRecorder::now() - start);
+
+		start = LatencyRecorder::now();
+		page = machine.allocator->allocate_pages(0);
+		allocs.record(LatencyRecorder::now() - start);
+
+		if (!page) { return machine.model.error("order-0 allocation failed with half of memory free"); }
+		machine.model.allocate(page - machine.memory.pgds(), 1, 1);
+		live[victim].first = page;
+		machine.poll_trace();
+	}
+
+	printf("churn: order-0 pages, %lu of %lu allocated\n", target, target * 2);
+	allocs.report("allocate");
+	frees.report("free");
+	return machine.check(live);
+}
+
+/**
+ * Picks an order the way a kernel does: mostly single pages, some small blocks, and the odd
+ * large one.
+ */
+static int pick_order(std::mt19937_64& rng)
+{
+	unsigned int roll = rng() % 100;
+	if (roll < 60) { return 0; }
+	if (roll < 80) { return 1; }
+	if (roll < 90) { return 2 + rng() % 2; }
+	if (roll < 98) { return 4 + rng() % 3; }
+	return 7 + rng() % 4;
+}
+
+/**
+ * Allocates and frees blocks of mixed orders, keeping around 60% of memory in use.
+ */
+static bool mixed(const Options& options)
+{
+	Machine machine(options.quick ? 1 << 16 : 1 << 18);
+	machine.insert_pc_memory();
+
+	std::mt19937_64 rng(2);
+	std::vector<std::pair<PageDescriptor *, int>> live;
+	LatencyRecorder allocs, frees;
+	uint64_t in_use = 0, failures = 0;
+
+	uint64_t target = machine.model.nr_free() * 6 / 10;
+	uint64_t nr_ops = options.quick ? 200000 : 5000000;
+	for (uint64_t i = 0; i < nr_ops; i++) {
+		if (live.empty() || (in_use < target && rng() % 2)) {
+			int order = pick_order(rng);
+
+			uint64_t start = LatencyRecorder::now();
+			PageDescriptor *block = machine.allocator->allocate_pages(order);
+			allocs.record(LatencyRecorder::now() - start);
+
+			if (!block) { failures++; machine.poll_trace(); continue; }
+			machine.model.allocate(block - machine.memory.pgds(), 1ULL << order, 1ULL << order);
+			live.push_back({ block, order });
+			in_use += 1ULL << order;
+		} else {
+			size_t victim = rng() % live.size();
+			auto block = live[victim];
+			live[victim] = live.back();
+			live.pop_back();
+			in_use -= 1ULL << block.second;
+			machine.model.free(block.first - machine.memory.pgds(), 1ULL << block.second);
+
+			uint64_t start = LatencyRecorder::now();
+			machine.allocator->free_pages(block.first, block.second);
+			frees.record(LatencyRecorder::now() - start);
+		}
+
+		machine.poll_trace();
+	}
+
+	printf("mixed: orders 0-10, ~60%% of memory in use, %lu failed allocations\n", failures);
+	allocs.report("allocate");
+	frees.report("free");
+	return machine.check(live);
+}
+
+/**
+ * Fills memory with single pages, frees every other one so nothing can merge, and times
+ * allocations that must fail.  Then frees the rest, timing the frees that merge all the way
+ * back up, and checks that memory came back together.
+ */
+static bool fragmentation(const Options& options)
+{
+	Machine machine(options.quick ? 1 << 16 : 1 << 18);
+	machine.insert_pc_memory();
+
+	std::vector<std::pair<PageDescriptor *, int>> live;
+	while (PageDescriptor *page = machine.allocate(0)) {
+		live.push_back({ page, 0 });
+	}
+
+	// free the odd page frames, leaving no two free buddies anywhere
+	std::vector<std::pair<PageDescriptor *, int>> held;
+	for (auto& page : live) {
+		if ((page.first - machine.memory.pgds()) & 1) { machine.free(page.first, 0); }
+		else { held.push_back(page); }
+	}
+
+	LatencyRecorder failed, merges;
+	for (int order = 1; order <= 10; order++) {
+		for (int i = 0; i < (options.quick ? 100 : 1000); i++) {
+			uint64_t start = LatencyRecorder::now();
+			PageDescriptor *block = machine.allocator->allocate_pages(order);
+			failed.record(LatencyRecorder::now() - start);
+			machine.poll_trace();
+
+			if (block) { return machine.model.error("order-%d allocation succeeded in fully fragmented memory", order); }
+		}
+	}
+
+	for (auto& page : held) {
+		machine.model.free(page.first - machine.memory.pgds(), 1);
+
+		uint64_t start = LatencyRecorder::now();
+		machine.allocator->free_pages(page.first, 0);
+		merges.record(LatencyRecorder::now() - start);
+		machine.poll_trace();
+	}
+	held.clear();
+	live.clear();
+
+	// a block as large as the largest the model says is free must be available again
+	int order = MAX_ORDER;
+	while (order > 0) {
+		bool found = false;
+		for (pfn_t pfn = 0; pfn + (1ULL << order) <= machine.model.nr_pages() && !found; pfn += 1ULL << order) {
+			found = machine.model.block_free(pfn, 1ULL << order);
+		}
+		if (found) { break; }
+		order--;
+	}
+
+	PageDescriptor *block = machine.allocate(order);
+	if (!block) { return machine.model.error("no order-%d block after freeing everything", order); }
+	machine.free(block, order);
+
+	printf("fragmentation: every other page allocated, then all freed (order %d back)\n", order);
+	failed.report("failed allocate");
+	merges.report("merging free");
+	return machine.check(live);
+}
+
+/**
+ * Removes ranges of memory while some of their pages are allocated, including one before the
+ * free bitmaps exist.  Pages that were allocated must be dropped when they are freed, and
+ * must come back when their range is inserted again.
+ */
+static bool remove(const Options& options)
+{
+	Machine machine(options.quick ? 1 << 16 : 1 << 18);
+	uint64_t nr_pages = machine.memory.nr_pages();
+
+	// low memory is too small for the bitmaps, so the hole punched in it waits with it
+	machine.insert(1, LOW_MEMORY_END);
+	machine.allocator->remove_page_range(machine.memory.pgds() + 0x40, 0x10);
+	machine.model.remove(0x40, 0x10);
+	machine.insert(HIGH_MEMORY, nr_pages);
+
+	std::mt19937_64 rng(3);
+	std::vector<std::pair<PageDescriptor *, int>> live;
+	uint64_t in_use = 0;
+	while (in_use < machine.model.nr_free()) {
+		int order = pick_order(rng);
+		PageDescriptor *block = machine.allocate(order);
+		if (!block) { break; }
+
+		live.push_back({ block, order });
+		in_use += 1ULL << order;
+	}
+
+	// punch holes through the allocated blocks, at odd offsets
+	LatencyRecorder removes;
+	for (int i = 0; i < 16; i++) {
+		pfn_t from = HIGH_MEMORY + rng() % (nr_pages / 2);
+		uint64_t count = 1 + rng() % 3000;
+
+		uint64_t start = LatencyRecorder::now();
+		machine.allocator->remove_page_range(machine.memory.pgds() + from, count);
+		removes.record(LatencyRecorder::now() - start);
+
+		machine.model.remove(from, count);
+		machine.poll_trace();
+	}
+
+	// every other block goes back now, so the allocator runs with holes in use
+	std::vector<std::pair<PageDescriptor *, int>> held;
+	for (size_t i = 0; i < live.size(); i++) {
+		if (i & 1) { machine.free(live[i].first, live[i].second); }
+		else { held.push_back(live[i]); }
+	}
+
+	live.clear();
+	if (!machine.check(held)) { return false; }
+
+	// after a removed range comes back, all of it is free again
+	machine.insert(0x40, 0x50);
+	for (pfn_t pfn = HIGH_MEMORY; pfn < nr_pages; pfn++) {
+		if (machine.model.state(pfn) != ReferenceModel::ABSENT) { continue; }
+
+		pfn_t end = pfn;
+		while (end < nr_pages && machine.model.state(end) == ReferenceModel::ABSENT) { end++; }
+
+		// the bitmaps' own pages are never given back
+		pfn_t bitmap_pfn;
+		uint64_t nr_bitmap_pages = machine.allocator->bitmap_pages(bitmap_pfn);
+		if (pfn == bitmap_pfn && end == bitmap_pfn + nr_bitmap_pages) { pfn = end; continue; }
+
+		machine.insert(pfn, end);
+		pfn = end;
+	}
+
+	printf("remove: 16 ranges removed with half of memory allocated\n");
+	removes.report("remove_page_range");
+	return machine.check(live);
+}
+
+/**
+ * Times inserting the memory of a large machine, which should cost close to nothing per page.
+ */
+static bool insert(const Options& options)
+{
+	uint64_t nr_pages = (options.quick ? 4 : options.insert_gib) << 18;
+	LatencyRecorder inserts;
+
+	bool ok = true;
+	for (int round = 0; round < (options.quick ? 2 : 5); round++) {
+		Machine machine(nr_pages);
+
+		uint64_t start = LatencyRecorder::now();
+		machine.allocator->insert_page_range(machine.memory.pgds() + HIGH_MEMORY, nr_pages - HIGH_MEMORY);
+		inserts.record(LatencyRecorder::now() - start);
+
+		pfn_t pfn;
+		uint64_t nr_bitmap_pages = machine.allocator->bitmap_pages(pfn);
+		uint64_t expected = nr_pages - HIGH_MEMORY - nr_bitmap_pages;
+		if (machine.allocator->nr_free_pages() != expected) {
+			ok = machine.model.error("%lu pages free after insertion, not %lu", machine.allocator->nr_free_pages(), expected);
+		}
+
+		PageDescriptor *block = machine.allocator->allocate_pages(MAX_ORDER);
+		if (!block || (block - machine.memory.pgds()) % (1ULL << MAX_ORDER)) {
+			ok = machine.model.error("no aligned order-%d block after insertion", MAX_ORDER);
+		}
+	}
+
+	printf("insert: %lu GiB in one range\n", nr_pages >> 18);
+	inserts.report("insert_page_range");
+	return ok;
+}
+
+/**
+ * The page frame helpers BuddyArena used before it cached the page descriptor base, as they
+ * were: every PFN goes through the kernel's page allocator, buddies are found from the offsets
+ * into the block and its parent, and orders are found a bit at a time.
+ */
+namespace old_helpers
+{
+	static pfn_t pages_per_block(int order) { return 1 << order; }
+
+	static pfn_t page_offset_from_block(PageDescriptor *pgd, int order)
+	{
+		return sys.mm().pgalloc().pgd_to_pfn(pgd) % pages_per_block(order);
+	}
+
+	static PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	{
+		pfn_t order_offset = pages_per_block(order);
+		pfn_t offset_from_block_start = page_offset_from_block(pgd, order);
+		pfn_t offset_from_higher_block_start = page_offset_from_block(pgd, order + 1);
+
+		if (offset_from_block_start == 0 && offset_from_higher_block_start == 0) { return pgd + order_offset; }
+		else if (offset_from_block_start == 0) { return pgd - order_offset; }
+		else if (offset_from_higher_block_start > offset_from_block_start) { return pgd - offset_from_higher_block_start; }
+		else { return pgd + order_offset - offset_from_block_start; }
+	}
+
+	static int get_max_order(int block_size)
+	{
+		int order = 0;
+		while ((1 << order) < block_size) {
+			order++;
+		}
+		return order;
+	}
+}
+
+/**
+ * The same helpers as BuddyArena has them now, working from the cached page descriptor base.
+ */
+namespace new_helpers
+{
+	static PageDescriptor *pgd_base;
+
+	static pfn_t pages_per_block(int order) { return (pfn_t)1 << order; }
+
+	static pfn_t page_offset_from_block(PageDescriptor *pgd, int order)
+	{
+		return (pgd - pgd_base) & (pages_per_block(order) - 1);
+	}
+
+	static PageDescriptor *buddy_of(PageDescriptor *pgd, int order)
+	{
+		return pgd_base + ((pgd - pgd_base) ^ pages_per_block(order));
+	}
+
+	static int get_max_order(uint64_t block_size)
+	{
+		return block_size <= 1 ? 0 : 64 - __builtin_clzll(block_size - 1);
+	}
+}
+
+/**
+ * Times a helper over every input, a number of rounds over, and prints the mean time of one call.
+ * @return Returns the results of every call XORed together, to check against the other helper.
+ */
+template<typename F>
+static uint64_t time_helper(const char *name, size_t nr_inputs, int rounds, F helper)
+{
+	uint64_t sum = 0, cycles = 0;
+	LatencyRecorder total;
+
+	for (int round = 0; round < rounds; round++) {
+		uint64_t start = LatencyRecorder::now();
+		for (size_t i = 0; i < nr_inputs; i++) {
+			sum ^= helper(i);
+		}
+		uint64_t end = LatencyRecorder::now();
+
+		// keep the calls from being hoisted out of the timed loop along with their results
+		asm volatile("" : "+r"(sum));
+		cycles += end - start;
+	}
+
+	total.record(cycles);
+	printf("  %-24s %9lu ops %11.2fns/op\n", name, (uint64_t)nr_inputs * rounds,
+		total.percentile_ns(1) / ((double)nr_inputs * rounds));
+	return sum;
+}
+
+/**
+ * Compares the page frame helpers BuddyArena used before and after it cached the page
+ * descriptor base, on random blocks and sizes.  Both versions must agree on every result.
+ */
+static bool helpers(const Options& options)
+{
+	Machine machine(1 << 18);
+	new_helpers::pgd_base = machine.memory.pgds();
+
+	std::mt19937_64 rng(1);
+	size_t nr_inputs = 1 << 16;
+	std::vector<PageDescriptor *> blocks(nr_inputs);
+	std::vector<int> orders(nr_inputs);
+	std::vector<uint64_t> sizes(nr_inputs);
+
+	for (size_t i = 0; i < nr_inputs; i++) {
+		orders[i] = rng() % MAX_ORDER;
+		pfn_t pfn = (rng() % (machine.memory.nr_pages() >> (orders[i] + 1))) << (orders[i] + 1);
+		blocks[i] = machine.memory.pgds() + pfn + (rng() & 1 ? 1ULL << orders[i] : 0);
+		sizes[i] = 1 + rng() % (1ULL << MAX_ORDER);
+	}
+
+	int rounds = options.quick ? 20 : 500;
+	bool ok = true;
+
+	printf("helpers: page frame arithmetic, before and after the cached page descriptor base\n");
+
+	uint64_t before = time_helper("buddy_of before", nr_inputs, rounds,
+		[&](size_t i) { return (uint64_t)old_helpers::buddy_of(blocks[i], orders[i]); });
+	uint64_t after = time_helper("buddy_of after", nr_inputs, rounds,
+		[&](size_t i) { return (uint64_t)new_helpers::buddy_of(blocks[i], orders[i]); });
+	if (before != after) { ok = machine.model.error("buddy_of gives different buddies before and after"); }
+
+	before = time_helper("page_offset before", nr_inputs, rounds,
+		[&](size_t i) { return old_helpers::page_offset_from_block(blocks[i], orders[i] + 1); });
+	after = time_helper("page_offset after", nr_inputs, rounds,
+		[&](size_t i) { return new_helpers::page_offset_from_block(blocks[i], orders[i] + 1); });
+	if (before != after) { ok = machine.model.error("page_offset_from_block gives different offsets before and after"); }
+
+	before = time_helper("get_max_order before", nr_inputs, rounds,
+		[&](size_t i) { return (uint64_t)old_helpers::get_max_order(sizes[i]); });
+	after = time_helper("get_max_order after", nr_inputs, rounds,
+		[&](size_t i) { return (uint64_t)new_helpers::get_max_order(sizes[i]); });
+	if (before != after) { ok = machine.model.error("get_max_order gives different orders before and after"); }
+
+	return ok;
+}
+
+/**
+ * Churns small objects of the sizes the schedulers keep through the general purpose slab caches,
+ * checking that no two live objects overlap, and that every page comes back once the empty
+ * slabs are reclaimed.  This runs last, since the caches outlive the machine.
+ */
+static bool slab(const Options& options)
+{
+	static const uint64_t sizes[] = { 16, 40, 64, 72, 200, 1000, 2048 };
+	struct Object { uint64_t *object; uint64_t size; };
+
+	Machine machine(1 << 16);
+	machine.insert_pc_memory();
+
+	std::mt19937_64 rng(5);
+	std::vector<Object> live;
+	LatencyRecorder allocs, frees;
+
+	auto release = [&](size_t i) {
+		Object o = live[i];
+		if (o.object[0] != (uint64_t)o.object || o.object[o.size / 8 - 1] != o.size) {
+			machine.model.error("slab object %p was overwritten", o.object);
+		}
+
+		uint64_t start = LatencyRecorder::now();
+		slab_free(o.object, o.size);
+		frees.record(LatencyRecorder::now() - start);
+
+		live[i] = live.back();
+		live.pop_back();
+		machine.poll_trace();
+	};
+
+	uint64_t nr_ops = options.quick ? 200000 : 2000000;
+	for (uint64_t op = 0; op < nr_ops; op++) {
+		if (live.size() >= 20000 || (!live.empty() && rng() % 2)) {
+			release(rng() % live.size());
+			continue;
+		}
+
+		uint64_t size = sizes[rng() % (sizeof(sizes) / sizeof(sizes[0]))];
+		uint64_t start = LatencyRecorder::now();
+		uint64_t *object = (uint64_t *)slab_alloc(size);
+		allocs.record(LatencyRecorder::now() - start);
+
+		if (!object) { return machine.model.error("slab_alloc(%lu) failed", size); }
+		if ((uintptr_t)object % SLAB_ALIGN) { machine.model.error("slab object %p is not aligned", object); }
+
+		// tag both ends, so an object handed out twice is caught when either is freed
+		object[0] = (uint64_t)object;
+		object[size / 8 - 1] = size;
+		live.push_back({ object, size });
+		machine.poll_trace();
+	}
+
+	while (!live.empty()) {
+		release(live.size() - 1);
+	}
+
+	if (slab_alloc(4096)) { machine.model.error("slab_alloc(4096) did not fail"); }
+
+	// the model never saw the slabs' pages go, so every page it has free must be back
+	SlabCache::reclaim_all();
+
+	printf("slab: small objects of scheduler sizes, up to 20000 live\n");
+	allocs.report("slab_alloc");
+	frees.report("slab_free");
+
+	std::vector<std::pair<PageDescriptor *, int>> none;
+	return machine.check(none);
+}
+
+static const struct
+{
+	const char *name;
+	bool (*run)(const Options&);
+} scenarios[] = {
+	{ "churn", churn },
+	{ "mixed", mixed },
+	{ "fragmentation", fragmentation },
+	{ "remove", remove },
+	{ "insert", insert },
+	{ "helpers", helpers },
+	{ "slab", slab },
+};
+
+int main(int argc, char **argv)
+{
+	Options options = { false, 16, NULL };
+
+	int opt;
+	while ((opt = getopt(argc, argv, "qvg:s:t:")) != -1) {
+		switch (opt) {
+		case 'q': options.quick = true; break;
+		case 'v': mm_log.enable(true); break;
+		case 'g': options.insert_gib = strtoull(optarg, NULL, 0); break;
+		case 's': options.only = optarg; break;
+		case 't':
+			trace_file = fopen(optarg, "wb");
+			if (!trace_file) { perror(optarg); return 2; }
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-q] [-v] [-g insert-gib] [-s scenario] [-t trace-file]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	int failed = 0;
+	for (auto& scenario : scenarios) {
+		if (options.only && strcmp(options.only, scenario.name)) { continue; }
+
+		bool ok = scenario.run(options);
+		printf("  %-24s %s\n", "reference model", ok ? "ok" : "MISMATCH");
+		if (!ok) { failed++; }
+	}
+
+	if (trace_file) { fclose(trace_file); }
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,274 @@
+/*
+ * Replays a trace of the buddy allocator, as exported by read_trace(), into a fresh allocator
+ * built from this tree, and reports the latency of each kind of operation and how fragmented
+ * free memory became over the course of the trace.  Traces recorded under an old build become
+ * regression benchmarks for a new one.
+ *
+ * The trace is a file of BuddyTraceRecord, from any number of CPUs, which are merged by their
+ * timestamps.  It must start with the allocator's first insert_page_range() calls, since those
+ * decide how much memory the replay runs with.  Blocks are matched by the page frame the trace
+ * gave out, since a different build may well give out a different one.  Traces do not record
+ * mobility types, so every allocation is replayed as unmovable, and allocations that failed in
+ * the trace are not replayed at all.
+ */
+
+#include "../buddy.cpp"
+#include "harness.h"
+
+#include <unordered_map>
+#include <unistd.h>
+
+/* Fragmentation is reported for allocations of these orders. */
+#define REPORT_SMALL_ORDER	3
+#define REPORT_LARGE_ORDER	HUGE_PAGE_ORDER
+
+/**
+ * A block the trace gave out, and the block the replay gave out in its place.
+ */
+struct LiveBlock
+{
+	PageDescriptor *block;
+	uint64_t nr_pages;
+	bool range;
+};
+
+/**
+ * The replay's counters of where it could not follow the trace.
+ */
+struct Divergence
+{
+	uint64_t moved;			// given out at a different page frame than in the trace
+	uint64_t failed;		// succeeded in the trace, but failed in the replay
+	uint64_t unmatched;		// freed in the trace, but never given out in the replay
+	uint64_t skipped;		// failed in the trace, so not replayed
+};
+
+static const char *event_names[] = {
+	"allocate", "failed allocate", "free", "allocate range", "free range", "insert range", "remove range"
+};
+
+#define NR_EVENTS	(sizeof(event_names) / sizeof(event_names[0]))
+
+/**
+ * Loads a trace file, and puts its records in the order they happened.
+ * @return Returns FALSE if the file could not be read or is not a trace.
+ */
+static bool load_trace(const char *path, std::vector<BuddyTraceRecord>& records)
+{
+	FILE *f = fopen(path, "rb");
+	if (!f) {
+		perror(path);
+		return false;
+	}
+
+	BuddyTraceRecord buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, sizeof(buffer[0]), 4096, f)) > 0) {
+		records.insert(records.end(), buffer, buffer + count);
+	}
+
+	bool ok = !ferror(f);
+	long size = ftell(f);
+	fclose(f);
+
+	if (!ok || size % sizeof(BuddyTraceRecord)) {
+		fprintf(stderr, "%s: not a trace of %lu-byte records\n", path, sizeof(BuddyTraceRecord));
+		return false;
+	}
+
+	std::stable_sort(records.begin(), records.end(), [](const BuddyTraceRecord& a, const BuddyTraceRecord& b) {
+		return a.timestamp < b.timestamp;
+	});
+
+	return true;
+}
+
+/**
+ * Returns the fragmentation index of free memory across every arena for allocations of the
+ * given order, in thousandths, as the arenas' own fragmentation_index() does.
+ */
+static unsigned int fragmentation_index(BuddyPageAllocator& allocator, int order)
+{
+	uint64_t free_pages = 0, usable_pages = 0;
+	for (int i = 0; i < NR_ARENAS; i++) {
+		const BuddyStats<MAX_ORDER>& stats = allocator.arena((ArenaType)i).stats();
+		for (int j = 0; j <= MAX_ORDER; j++) {
+			free_pages += stats.free_blocks[j] << j;
+			if (j >= order) { usable_pages += stats.free_blocks[j] << j; }
+		}
+	}
+
+	return free_pages ? ((free_pages - usable_pages) * 1000) / free_pages : 0;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_windows = 20;
+	bool zero_reserves = false;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "vw:z")) != -1) {
+		switch (opt) {
+		case 'v': mm_log.enable(true); break;
+		case 'w': nr_windows = strtoul(optarg, NULL, 0); break;
+		case 'z': zero_reserves = true; break;
+		default:
+			fprintf(stderr, "usage: %s [-v] [-w windows] [-z] trace-file\n", argv[0]);
+			fprintf(stderr, "  -z  keeps no arena reserves, as buddy-bench does\n");
+			return 2;
+		}
+	}
+
+	if (optind != argc - 1) {
+		fprintf(stderr, "usage: %s [-v] [-w windows] [-z] trace-file\n", argv[0]);
+		return 2;
+	}
+
+	std::vector<BuddyTraceRecord> records;
+	if (!load_trace(argv[optind], records)) { return 1; }
+
+	// the machine is as large as the memory the trace inserted
+	uint64_t nr_pages = 0;
+	for (auto& record : records) {
+		if (record.event == TRACE_INSERT_RANGE && record.pfn + (uint64_t)record.arg > nr_pages) { nr_pages = record.pfn + (uint64_t)record.arg; }
+	}
+
+	if (!nr_pages) {
+		fprintf(stderr, "%s: the trace never inserts any memory, so it did not start from boot\n", argv[optind]);
+		return 1;
+	}
+
+	HostMemory memory(nr_pages);
+	ReferenceModel model(nr_pages);
+	BuddyPageAllocator *allocator = new BuddyPageAllocator();
+	allocator->init(memory.pgds(), nr_pages);
+
+	if (zero_reserves) {
+		allocator->set_arena_reserve(ARENA_DMA, 0);
+		allocator->set_arena_reserve(ARENA_DMA32, 0);
+	}
+
+	std::unordered_map<uint32_t, LiveBlock> live;
+	Divergence divergence = { };
+	LatencyRecorder totals[NR_EVENTS];
+	LatencyRecorder window_allocs, window_frees;
+	bool bitmaps_removed = false;
+
+	if (!nr_windows) { nr_windows = 1; }
+	uint64_t window = (records.size() + nr_windows - 1) / nr_windows;
+
+	printf("replaying %lu records over %lu MiB\n", (uint64_t)records.size(), nr_pages >> 8);
+	printf("  %9s %10s  frag-%-2d frag-%-2d %12s %12s %12s %12s\n", "records", "free pages", REPORT_SMALL_ORDER, REPORT_LARGE_ORDER,
+		"alloc p50", "alloc p99", "free p50", "free p99");
+
+	for (uint64_t i = 0; i < records.size(); i++) {
+		const BuddyTraceRecord& record = records[i];
+		PageDescriptor *pgd = record.pfn < nr_pages ? memory.pgds() + record.pfn : NULL;
+		uint64_t start, cycles = 0;
+
+		switch (record.event) {
+		case TRACE_ALLOC:
+		case TRACE_ALLOC_RANGE: {
+			bool range = record.event == TRACE_ALLOC_RANGE;
+			uint64_t count = range ? record.arg : 1ULL << record.arg;
+
+			start = LatencyRecorder::now();
+			PageDescriptor *block = range ? allocator->allocate_contiguous_pages(count) : allocator->allocate_pages(record.arg);
+			cycles = LatencyRecorder::now() - start;
+
+			if (!block) {
+				divergence.failed++;
+				break;
+			}
+
+			model.allocate(block - memory.pgds(), count, range ? 1 : count);
+			if (block != pgd) { divergence.moved++; }
+			live[record.pfn] = { block, count, range };
+			break;
+		}
+
+		case TRACE_FREE:
+		case TRACE_FREE_RANGE: {
+			auto it = live.find(record.pfn);
+			if (it == live.end()) {
+				divergence.unmatched++;
+				break;
+			}
+
+			LiveBlock block = it->second;
+			live.erase(it);
+			model.free(block.block - memory.pgds(), block.nr_pages);
+
+			start = LatencyRecorder::now();
+			if (block.range) { allocator->free_contiguous_pages(block.block, block.nr_pages); }
+			else { allocator->free_pages(block.block, __builtin_ctzll(block.nr_pages)); }
+			cycles = LatencyRecorder::now() - start;
+			break;
+		}
+
+		case TRACE_INSERT_RANGE:
+			start = LatencyRecorder::now();
+			allocator->insert_page_range(pgd, record.arg);
+			cycles = LatencyRecorder::now() - start;
+			model.insert(record.pfn, record.arg);
+
+			// the pages the free bitmaps were carved from are never allocated
+			if (!bitmaps_removed) {
+				pfn_t pfn;
+				uint64_t nr_bitmap_pages = allocator->bitmap_pages(pfn);
+				if (nr_bitmap_pages) {
+					model.remove(pfn, nr_bitmap_pages);
+					bitmaps_removed = true;
+				}
+			}
+			break;
+
+		case TRACE_REMOVE_RANGE:
+			if (!pgd || record.pfn + (uint64_t)record.arg > nr_pages) {
+				model.error("range at %x removed beyond the memory inserted", record.pfn);
+				break;
+			}
+
+			start = LatencyRecorder::now();
+			allocator->remove_page_range(pgd, record.arg);
+			cycles = LatencyRecorder::now() - start;
+			model.remove(record.pfn, record.arg);
+			break;
+
+		case TRACE_ALLOC_FAILED:
+			divergence.skipped++;
+			break;
+
+		default:
+			model.error("record %lu has unknown event %u", i, record.event);
+			break;
+		}
+
+		if (cycles) {
+			totals[record.event].record(cycles);
+			if (record.event == TRACE_ALLOC || record.event == TRACE_ALLOC_RANGE) { window_allocs.record(cycles); }
+			if (record.event == TRACE_FREE || record.event == TRACE_FREE_RANGE) { window_frees.record(cycles); }
+		}
+
+		if ((i + 1) % window == 0 || i + 1 == records.size()) {
+			printf("  %9lu %10lu  %7u %7u %10.0fns %10.0fns %10.0fns %10.0fns\n", i + 1, allocator->nr_free_pages(),
+				fragmentation_index(*allocator, REPORT_SMALL_ORDER), fragmentation_index(*allocator, REPORT_LARGE_ORDER),
+				window_allocs.percentile_ns(0.5), window_allocs.percentile_ns(0.99),
+				window_frees.percentile_ns(0.5), window_frees.percentile_ns(0.99));
+
+			window_allocs = LatencyRecorder();
+			window_frees = LatencyRecorder();
+		}
+	}
+
+	printf("totals:\n");
+	for (unsigned int i = 0; i < NR_EVENTS; i++) {
+		if (totals[i].count()) { totals[i].report(event_names[i]); }
+	}
+
+	printf("  %lu blocks at other page frames than traced, %lu allocations failed, %lu frees unmatched, %lu failed allocations skipped\n",
+		divergence.moved, divergence.failed, divergence.unmatched, divergence.skipped);
+	printf("  %-24s %s\n", "reference model", model.errors() ? "MISMATCH" : "ok");
+
+	return model.errors() ? 1 : 0;
+}
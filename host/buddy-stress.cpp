@@ -0,0 +1,184 @@
+/*
+ * Multi-threaded stress test of the buddy arenas' lock-free paths.  Threads allocate and free
+ * blocks of mixed orders and mobility types, in bulk and as ranges, all at once on one arena.
+ * Every page has an owner that is swapped atomically as blocks change hands, so a page handed
+ * to two threads at once is caught as it happens.  When the threads are done, every page must
+ * be back in the free areas and merged into the blocks it started as.
+ *
+ * The per-CPU page caches are left out: on the host every thread would share CPU 0's cache,
+ * which only its own CPU may touch.
+ */
+
+#include "../buddy.cpp"
+#include "harness.h"
+
+#include <atomic>
+#include <random>
+#include <thread>
+#include <unistd.h>
+
+/* The arena is a single block of this order, so it must come back as exactly that.  It is kept
+ * small, so that threads run out of memory and fight over splits and merges. */
+#define STRESS_ORDER	12
+
+/* The most blocks each thread holds on to at once. */
+#define STRESS_MAX_HELD		64
+
+typedef BuddyArena<MAX_ORDER> Arena;
+
+/**
+ * One page frame's current owner: a thread number plus one, or zero while the page is free.
+ */
+static std::vector<std::atomic<unsigned int>> owners;
+static std::atomic<uint64_t> double_allocations, bad_frees;
+
+/**
+ * Takes ownership of the pages of a block that has just been allocated.
+ */
+static void take_pages(PageDescriptor *pgds, PageDescriptor *block, uint64_t count, unsigned int thread)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		unsigned int owner = owners[block - pgds + i].exchange(thread + 1);
+		if (owner && double_allocations++ < 10) {
+			fprintf(stderr, "page %lx given to thread %u while thread %u held it\n", block - pgds + i, thread, owner - 1);
+		}
+	}
+}
+
+/**
+ * Gives up ownership of the pages of a block that is about to be freed.
+ */
+static void release_pages(PageDescriptor *pgds, PageDescriptor *block, uint64_t count, unsigned int thread)
+{
+	for (uint64_t i = 0; i < count; i++) {
+		unsigned int owner = thread + 1;
+		if (!owners[block - pgds + i].compare_exchange_strong(owner, 0) && bad_frees++ < 10) {
+			fprintf(stderr, "page %lx freed by thread %u but owned by %d\n", block - pgds + i, thread, (int)owner - 1);
+		}
+	}
+}
+
+struct Held
+{
+	PageDescriptor *block;
+	uint64_t nr_pages;
+	int order;
+	bool range;
+};
+
+/**
+ * The body of each stress thread.
+ */
+static void stress(Arena& arena, PageDescriptor *pgds, unsigned int thread, uint64_t nr_ops, std::atomic<uint64_t>& nr_failures)
+{
+	std::mt19937_64 rng(thread * 7919 + 1);
+	std::vector<Held> held;
+
+	auto release = [&](const Held& h) {
+		release_pages(pgds, h.block, h.nr_pages, thread);
+		if (h.range) { arena.free_range(h.block, h.nr_pages); }
+		else { arena.free_block(h.block, h.order); }
+	};
+
+	for (uint64_t op = 0; op < nr_ops; op++) {
+		unsigned int roll = rng() % 100;
+
+		if (held.size() >= STRESS_MAX_HELD || (!held.empty() && roll < 45)) {
+			size_t victim = rng() % held.size();
+			release(held[victim]);
+			held[victim] = held.back();
+			held.pop_back();
+		} else if (roll < 85) {
+			int order = rng() % 4 ? rng() % 3 : rng() % 7;
+			MobilityType mobility = (MobilityType)(rng() % MOBILITY_TYPES);
+
+			PageDescriptor *block = arena.allocate_block(order, mobility);
+			if (!block) { nr_failures++; continue; }
+
+			take_pages(pgds, block, 1ULL << order, thread);
+			held.push_back({ block, 1ULL << order, order, false });
+		} else if (roll < 95) {
+			PageDescriptor *blocks[16];
+			int order = rng() % 2;
+			unsigned int count = arena.allocate_blocks_bulk(order, (MobilityType)(rng() % MOBILITY_TYPES), blocks, 1 + rng() % 16);
+			if (!count) { nr_failures++; continue; }
+
+			for (unsigned int i = 0; i < count; i++) {
+				take_pages(pgds, blocks[i], 1ULL << order, thread);
+			}
+
+			// give them straight back together, so bulk frees race with everything else too
+			for (unsigned int i = 0; i < count; i++) {
+				release_pages(pgds, blocks[i], 1ULL << order, thread);
+			}
+			arena.free_blocks_bulk(blocks, count, order);
+		} else {
+			uint64_t nr_pages = 1 + rng() % 100;
+			PageDescriptor *range = arena.allocate_range(nr_pages, (MobilityType)(rng() % MOBILITY_TYPES));
+			if (!range) { nr_failures++; continue; }
+
+			take_pages(pgds, range, nr_pages, thread);
+			held.push_back({ range, nr_pages, 0, true });
+		}
+	}
+
+	for (auto& h : held) {
+		release(h);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int nr_threads = std::thread::hardware_concurrency();
+	uint64_t nr_ops = 500000;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "qt:n:")) != -1) {
+		switch (opt) {
+		case 'q': nr_ops = 50000; break;
+		case 't': nr_threads = strtoul(optarg, NULL, 0); break;
+		case 'n': nr_ops = strtoull(optarg, NULL, 0); break;
+		default:
+			fprintf(stderr, "usage: %s [-q] [-t threads] [-n ops-per-thread]\n", argv[0]);
+			return 2;
+		}
+	}
+
+	if (nr_threads < 4) { nr_threads = 4; }
+	if (nr_threads > 16) { nr_threads = 16; }
+
+	uint64_t nr_pages = 1ULL << STRESS_ORDER;
+	HostMemory memory(nr_pages);
+	owners = std::vector<std::atomic<unsigned int>>(nr_pages);
+
+	std::vector<uint64_t> storage(arena_bitmap_words(nr_pages, MAX_ORDER));
+	std::vector<uint8_t> pageblock_mobility(nr_pages >> PAGEBLOCK_ORDER, MOBILITY_MOVABLE);
+
+	Arena *arena = new Arena();
+	arena->init(0, nr_pages, storage.data(), pageblock_mobility.data(), memory.pgds());
+	arena->free_range(memory.pgds(), nr_pages);
+
+	std::atomic<uint64_t> nr_failures(0);
+	std::vector<std::thread> threads;
+	for (unsigned int i = 0; i < nr_threads; i++) {
+		threads.emplace_back(stress, std::ref(*arena), memory.pgds(), i, nr_ops, std::ref(nr_failures));
+	}
+	for (auto& thread : threads) {
+		thread.join();
+	}
+
+	uint64_t lost = nr_pages - arena->nr_free_pages();
+	uint64_t top_blocks = arena->stats().free_blocks[STRESS_ORDER];
+	uint64_t counted = 0;
+	for (int i = 0; i <= MAX_ORDER; i++) {
+		counted += arena->stats().free_blocks[i] << i;
+	}
+
+	printf("%u threads, %lu ops each, %lu allocations failed for want of memory\n", nr_threads, nr_ops, nr_failures.load());
+	printf("  double allocations %lu, bad frees %lu, pages lost %lu, order-%d blocks %lu of 1, counted %lu of %lu\n",
+		double_allocations.load(), bad_frees.load(), lost, STRESS_ORDER, top_blocks, counted, nr_pages);
+
+	bool ok = !double_allocations && !bad_frees && !lost && top_blocks == 1 && counted == nr_pages;
+	printf("  %s\n", ok ? "ok" : "FAILED");
+	return ok ? 0 : 1;
+}
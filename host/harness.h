@@ -0,0 +1,266 @@
+/*
+ * Shared pieces of the host-side allocator tools: simulated physical memory, a reference
+ * model of which pages are allocated, and latency percentiles.
+ */
+#pragma once
+
+#include <infos/kernel/kernel.h>
+#include <infos/mm/page-allocator.h>
+
+#include <algorithm>
+#include <cstdarg>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include <sys/mman.h>
+
+/**
+ * A stretch of simulated physical memory, and the page descriptors for it.  Both are mapped
+ * lazily, so memory is only really used for the pages that are touched, and multi-GiB
+ * machines fit on an ordinary host.
+ */
+class HostMemory
+{
+public:
+	/**
+	 * Maps the memory and its page descriptors, and points the kernel's page allocator at them.
+	 * @param nr_pages The number of page frames.
+	 */
+	HostMemory(uint64_t nr_pages) : _nr_pages(nr_pages)
+	{
+		_pgds = (infos::mm::PageDescriptor *)map(nr_pages * sizeof(infos::mm::PageDescriptor));
+		_memory = (char *)map(nr_pages << 12);
+		infos::kernel::sys.mm().pgalloc().attach(_pgds, nr_pages, _memory);
+	}
+
+	~HostMemory()
+	{
+		munmap(_pgds, _nr_pages * sizeof(infos::mm::PageDescriptor));
+		munmap(_memory, _nr_pages << 12);
+	}
+
+	infos::mm::PageDescriptor *pgds() const { return _pgds; }
+	uint64_t nr_pages() const { return _nr_pages; }
+
+private:
+	static void *map(uint64_t size)
+	{
+		void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (p == MAP_FAILED) {
+			fprintf(stderr, "unable to map %lu bytes of simulated memory\n", size);
+			exit(1);
+		}
+
+		return p;
+	}
+
+	infos::mm::PageDescriptor *_pgds;
+	char *_memory;
+	uint64_t _nr_pages;
+};
+
+/**
+ * Tracks what every page frame should be, independently of the allocator, and checks each
+ * allocation and free the allocator makes against it.
+ */
+class ReferenceModel
+{
+public:
+	/* Pages removed while allocated stay allocated until they are freed, and are then gone. */
+	enum PageState : uint8_t { ABSENT, FREE, ALLOCATED, REMOVED };
+
+	ReferenceModel(uint64_t nr_pages) : _pages(nr_pages, ABSENT), _nr_free(0), _errors(0) { }
+
+	/**
+	 * Records a range of page frames being given to the allocator.
+	 */
+	void insert(pfn_t pfn, uint64_t count)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] != ABSENT) { error("page %lx inserted twice", pfn + i); continue; }
+
+			_pages[pfn + i] = FREE;
+			_nr_free++;
+		}
+	}
+
+	/**
+	 * Records a range of page frames being taken out of use.  Free pages go at once, and
+	 * allocated ones when they are freed.
+	 */
+	void remove(pfn_t pfn, uint64_t count)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] == FREE) {
+				_pages[pfn + i] = ABSENT;
+				_nr_free--;
+			} else if (_pages[pfn + i] == ALLOCATED) {
+				_pages[pfn + i] = REMOVED;
+			}
+		}
+	}
+
+	/**
+	 * Checks that an allocated block is aligned and was entirely free, and marks it allocated.
+	 * @return Returns TRUE if the allocation was valid.
+	 */
+	bool allocate(pfn_t pfn, uint64_t count, uint64_t alignment)
+	{
+		if (pfn % alignment) { return error("block at %lx is not aligned to %lu pages", pfn, alignment); }
+		if (pfn + count > _pages.size()) { return error("block at %lx runs off the end of memory", pfn); }
+
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] == ALLOCATED || _pages[pfn + i] == REMOVED) { return error("page %lx allocated twice", pfn + i); }
+			if (_pages[pfn + i] == ABSENT) { return error("page %lx allocated but not inserted", pfn + i); }
+		}
+
+		for (uint64_t i = 0; i < count; i++) {
+			_pages[pfn + i] = ALLOCATED;
+		}
+
+		_nr_free -= count;
+		return true;
+	}
+
+	/**
+	 * Checks that a block being freed is allocated, and marks it free.
+	 * @return Returns TRUE if the free was valid.
+	 */
+	bool free(pfn_t pfn, uint64_t count)
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] != ALLOCATED && _pages[pfn + i] != REMOVED) { return error("page %lx freed but not allocated", pfn + i); }
+		}
+
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] == REMOVED) {
+				_pages[pfn + i] = ABSENT;
+				continue;
+			}
+
+			_pages[pfn + i] = FREE;
+			_nr_free++;
+		}
+
+		return true;
+	}
+
+	/**
+	 * @return Returns TRUE if every page of a naturally aligned block is free in the model.
+	 */
+	bool block_free(pfn_t pfn, uint64_t count) const
+	{
+		for (uint64_t i = 0; i < count; i++) {
+			if (_pages[pfn + i] != FREE) { return false; }
+		}
+
+		return true;
+	}
+
+	PageState state(pfn_t pfn) const { return (PageState)_pages[pfn]; }
+	uint64_t nr_pages() const { return _pages.size(); }
+	uint64_t nr_free() const { return _nr_free; }
+	uint64_t errors() const { return _errors; }
+
+	bool error(const char *format, ...) __attribute__((format(printf, 2, 3)))
+	{
+		if (_errors++ < 10) {
+			va_list args;
+			va_start(args, format);
+			fprintf(stderr, "model: ");
+			vfprintf(stderr, format, args);
+			fputc('\n', stderr);
+			va_end(args);
+		}
+
+		return false;
+	}
+
+private:
+	std::vector<uint8_t> _pages;
+	uint64_t _nr_free;
+	uint64_t _errors;
+};
+
+/**
+ * Collects the latencies of individual operations, in cycles, and reports percentiles in
+ * nanoseconds along with the rate the operations ran at, counting only the time spent in them.
+ */
+class LatencyRecorder
+{
+public:
+	LatencyRecorder() : _total(0) { }
+
+	static uint64_t now() { return __builtin_ia32_rdtsc(); }
+
+	void record(uint64_t cycles)
+	{
+		_samples.push_back(cycles);
+		_total += cycles;
+	}
+
+	uint64_t count() const { return _samples.size(); }
+
+	/**
+	 * Returns a latency percentile of the operations recorded, in nanoseconds, or zero if
+	 * there were none.
+	 * @param p The percentile, as a fraction.
+	 */
+	double percentile_ns(double p)
+	{
+		if (_samples.empty()) { return 0; }
+
+		std::sort(_samples.begin(), _samples.end());
+		return percentile(p);
+	}
+
+	/**
+	 * Prints a line with the rate and latency percentiles of the operations recorded.
+	 * @param name What the operations were.
+	 */
+	void report(const char *name)
+	{
+		if (_samples.empty()) {
+			printf("  %-24s no operations\n", name);
+			return;
+		}
+
+		std::sort(_samples.begin(), _samples.end());
+
+		double rate = _total ? (double)_samples.size() * 1e9 / to_ns(_total) : 0;
+		printf("  %-24s %9lu ops %11.0f ops/s  p50 %6.0fns  p90 %6.0fns  p99 %7.0fns  p99.9 %8.0fns  max %9.0fns\n",
+			name, (uint64_t)_samples.size(), rate,
+			percentile(0.5), percentile(0.9), percentile(0.99), percentile(0.999), to_ns(_samples.back()));
+	}
+
+private:
+	static uint64_t wall_clock()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	/**
+	 * Works out how many cycles the cycle counter ticks per nanosecond, once.
+	 */
+	static double cycles_per_ns()
+	{
+		static double ratio = 0;
+		if (!ratio) {
+			uint64_t wall = wall_clock(), cycles = now();
+			while (wall_clock() - wall < 20000000) { }
+			ratio = (double)(now() - cycles) / (wall_clock() - wall);
+		}
+
+		return ratio;
+	}
+
+	static double to_ns(uint64_t cycles) { return cycles / cycles_per_ns(); }
+
+	double percentile(double p) const { return to_ns(_samples[(size_t)(p * (_samples.size() - 1))]); }
+
+	std::vector<uint64_t> _samples;
+	uint64_t _total;
+};
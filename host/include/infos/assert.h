@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for the InfOS kernel assertions.
+ */
+#pragma once
+
+#include <cassert>
@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for the InfOS core definitions.
+ */
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define __packed __attribute__((packed))
+#define __unused __attribute__((unused))
+
+typedef uint64_t pfn_t;
+typedef uintptr_t virt_addr_t;
+typedef uintptr_t phys_addr_t;
@@ -0,0 +1,56 @@
+/*
+ * Host stand-in for the InfOS command-line argument registration.  Every handler is registered
+ * under its key, and host tools pass values to them with set_cmdline_argument(), as the kernel
+ * does with its command line at boot.
+ */
+#pragma once
+
+#include <string.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class CmdLineArgument
+		{
+		public:
+			typedef void (*Handler)(const char *value);
+
+			CmdLineArgument(const char *key, Handler handler) : key(key), handler(handler), next(first())
+			{
+				first() = this;
+			}
+
+			static CmdLineArgument *&first()
+			{
+				static CmdLineArgument *head;
+				return head;
+			}
+
+			const char *key;
+			Handler handler;
+			CmdLineArgument *next;
+		};
+
+		/**
+		 * Passes a value to the handler registered for a command-line argument.
+		 * @return Returns FALSE if no handler is registered for the key.
+		 */
+		inline bool set_cmdline_argument(const char *key, const char *value)
+		{
+			for (CmdLineArgument *arg = CmdLineArgument::first(); arg; arg = arg->next) {
+				if (strcmp(arg->key, key) == 0) {
+					arg->handler(value);
+					return true;
+				}
+			}
+
+			return false;
+		}
+	}
+}
+
+#define RegisterCmdLineArgument(_name, _key) \
+	static void __cmdline_##_name(const char *value); \
+	static infos::kernel::CmdLineArgument __cmdline_arg_##_name(_key, __cmdline_##_name); \
+	static void __cmdline_##_name(const char *value)
@@ -0,0 +1,23 @@
+/*
+ * Host stand-in for the InfOS kernel object.
+ */
+#pragma once
+
+#include <infos/mm/mm.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Kernel
+		{
+		public:
+			infos::mm::MemoryManager& mm() { return _mm; }
+
+		private:
+			infos::mm::MemoryManager _mm;
+		};
+
+		extern Kernel sys;
+	}
+}
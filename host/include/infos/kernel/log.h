@@ -0,0 +1,54 @@
+/*
+ * Host stand-in for the InfOS component logs.  Messages are dropped unless the log has been
+ * enabled, in which case they go to stderr.
+ */
+#pragma once
+
+#include <stdio.h>
+#include <stdarg.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		enum class LogLevel
+		{
+			DEBUG,
+			INFO,
+			WARNING,
+			ERROR,
+			FATAL
+		};
+
+		class ComponentLog
+		{
+		public:
+			ComponentLog(const char *name) : _name(name), _enabled(false) { }
+
+			void enable(bool enabled) { _enabled = enabled; }
+
+			void message(LogLevel level, const char *message) { messagef(level, "%s", message); }
+
+			void messagef(LogLevel level, const char *format, ...) __attribute__((format(printf, 3, 4)))
+			{
+				(void)level;
+				if (!_enabled) { return; }
+
+				va_list args;
+				va_start(args, format);
+				fprintf(stderr, "%s: ", _name);
+				vfprintf(stderr, format, args);
+				fputc('\n', stderr);
+				va_end(args);
+			}
+
+		private:
+			const char *_name;
+			bool _enabled;
+		};
+
+		extern ComponentLog syslog;
+		extern ComponentLog mm_log;
+		extern ComponentLog sched_log;
+	}
+}
@@ -0,0 +1,27 @@
+/*
+ * Host stand-in for the InfOS processes.  Threads created on the host are handed back, but
+ * never started.
+ */
+#pragma once
+
+#include <infos/kernel/thread.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class Process
+		{
+		public:
+			Thread& create_thread(ThreadPrivilege::ThreadPrivilege privilege, Thread::thread_proc_t proc,
+				SchedulingEntityPriority::SchedulingEntityPriority priority = SchedulingEntityPriority::NORMAL)
+			{
+				(void)privilege;
+				(void)proc;
+				return *new Thread(priority);
+			}
+		};
+
+		extern Process *kernel_process;
+	}
+}
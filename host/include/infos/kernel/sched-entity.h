@@ -0,0 +1,59 @@
+/*
+ * Host stand-in for the InfOS scheduling entities.  Whoever drives a scheduler sets the state
+ * of its entities directly.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace SchedulingEntityPriority
+		{
+			enum SchedulingEntityPriority
+			{
+				REALTIME = 0,
+				INTERACTIVE = 1,
+				NORMAL = 2,
+				DAEMON = 3
+			};
+		}
+
+		namespace SchedulingEntityState
+		{
+			enum SchedulingEntityState
+			{
+				STOPPED,
+				SLEEPING,
+				RUNNABLE,
+				RUNNING
+			};
+		}
+
+		class SchedulingEntity
+		{
+		public:
+			typedef uint64_t EntityRuntime;
+			typedef uint64_t EntityStartTime;
+
+			SchedulingEntity(SchedulingEntityPriority::SchedulingEntityPriority priority) : _priority(priority) { }
+			virtual ~SchedulingEntity() { }
+
+			EntityRuntime cpu_runtime() const { return _cpu_runtime; }
+			void update_accounting(EntityRuntime delta) { _cpu_runtime += delta; }
+
+			SchedulingEntityPriority::SchedulingEntityPriority priority() const { return _priority; }
+			void priority(SchedulingEntityPriority::SchedulingEntityPriority priority) { _priority = priority; }
+
+			SchedulingEntityState::SchedulingEntityState state() const { return _state; }
+			void state(SchedulingEntityState::SchedulingEntityState state) { _state = state; }
+
+		private:
+			EntityRuntime _cpu_runtime = 0;
+			SchedulingEntityPriority::SchedulingEntityPriority _priority;
+			SchedulingEntityState::SchedulingEntityState _state = SchedulingEntityState::RUNNABLE;
+		};
+	}
+}
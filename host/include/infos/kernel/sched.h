@@ -0,0 +1,49 @@
+/*
+ * Host stand-in for the InfOS scheduler interface.  Each scheduler registers a factory, so a
+ * host tool can build a fresh instance of any of them for every run.
+ */
+#pragma once
+
+#include <infos/kernel/sched-entity.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		class SchedulingAlgorithm
+		{
+		public:
+			virtual ~SchedulingAlgorithm() { }
+
+			virtual const char *name() const = 0;
+			virtual void init() { }
+			virtual void add_to_runqueue(SchedulingEntity& entity) = 0;
+			virtual void remove_from_runqueue(SchedulingEntity& entity) = 0;
+			virtual SchedulingEntity *pick_next_entity() = 0;
+		};
+
+		class SchedulerRegistration
+		{
+		public:
+			typedef SchedulingAlgorithm *(*Factory)();
+
+			SchedulerRegistration(Factory factory) : factory(factory), next(first())
+			{
+				first() = this;
+			}
+
+			static SchedulerRegistration *&first()
+			{
+				static SchedulerRegistration *head;
+				return head;
+			}
+
+			Factory factory;
+			SchedulerRegistration *next;
+		};
+	}
+}
+
+#define RegisterScheduler(_t) \
+	static infos::kernel::SchedulingAlgorithm *__create_sched_##_t() { return new _t(); } \
+	static infos::kernel::SchedulerRegistration __sched_##_t(__create_sched_##_t)
@@ -0,0 +1,31 @@
+/*
+ * Host stand-in for the InfOS threads.  Threads are never run on the host.
+ */
+#pragma once
+
+#include <infos/kernel/sched-entity.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		namespace ThreadPrivilege
+		{
+			enum ThreadPrivilege
+			{
+				Kernel,
+				User
+			};
+		}
+
+		class Thread : public SchedulingEntity
+		{
+		public:
+			typedef void (*thread_proc_t)(void *);
+
+			Thread(SchedulingEntityPriority::SchedulingEntityPriority priority = SchedulingEntityPriority::NORMAL) : SchedulingEntity(priority) { }
+
+			void start() { }
+		};
+	}
+}
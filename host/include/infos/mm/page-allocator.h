@@ -0,0 +1,73 @@
+/*
+ * Host stand-in for the InfOS page allocator.  The page descriptors and the memory they
+ * describe are ordinary host memory, set up by whoever drives the algorithm.
+ */
+#pragma once
+
+#include <infos/define.h>
+#include <infos/assert.h>
+
+namespace infos
+{
+	namespace mm
+	{
+		enum class PageDescriptorType
+		{
+			INVALID = 0,
+			RESERVED = 1,
+			AVAILABLE = 2,
+			ALLOCATED = 3
+		};
+
+		struct PageDescriptor
+		{
+			PageDescriptor *next_free, *prev_free;
+			PageDescriptorType type;
+			uint64_t refcount;
+		} __packed;
+
+		class PageAllocatorAlgorithm
+		{
+		public:
+			virtual ~PageAllocatorAlgorithm() { }
+
+			virtual bool init(PageDescriptor *page_descriptors, uint64_t nr_page_descriptors) = 0;
+			virtual PageDescriptor *allocate_pages(int order) = 0;
+			virtual void free_pages(PageDescriptor *pgd, int order) = 0;
+			virtual void insert_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual void remove_page_range(PageDescriptor *start, uint64_t count) = 0;
+			virtual const char *name() const = 0;
+			virtual void dump_state() const = 0;
+		};
+
+		class PageAllocator
+		{
+		public:
+			/**
+			 * Points the page allocator at a set of page descriptors, and the memory they describe.
+			 * @param pgds The page descriptor of page frame zero.
+			 * @param nr_pgds The number of page descriptors.
+			 * @param memory The memory of page frame zero.
+			 */
+			void attach(PageDescriptor *pgds, uint64_t nr_pgds, char *memory)
+			{
+				_pgds = pgds;
+				_nr_pgds = nr_pgds;
+				_memory = memory;
+			}
+
+			uint64_t nr_pgds() const { return _nr_pgds; }
+
+			pfn_t pgd_to_pfn(const PageDescriptor *pgd) const { return (pfn_t)(pgd - _pgds); }
+			PageDescriptor *pfn_to_pgd(pfn_t pfn) const { return &_pgds[pfn]; }
+			virt_addr_t pgd_to_kva(const PageDescriptor *pgd) const { return (virt_addr_t)(_memory + (pgd_to_pfn(pgd) << 12)); }
+
+		private:
+			PageDescriptor *_pgds;
+			uint64_t _nr_pgds;
+			char *_memory;
+		};
+	}
+}
+
+#define RegisterPageAllocator(_t) _t __pgalloc_##_t
@@ -0,0 +1,41 @@
+/*
+ * Host stand-in for the InfOS linked list, on top of std::list.
+ */
+#pragma once
+
+#include <list>
+
+namespace infos
+{
+	namespace util
+	{
+		template<typename T>
+		class List
+		{
+		public:
+			void enqueue(T value) { _list.push_back(value); }
+			void append(T value) { _list.push_back(value); }
+
+			T pop()
+			{
+				T value = _list.front();
+				_list.pop_front();
+				return value;
+			}
+
+			T dequeue() { return pop(); }
+
+			void remove(T value) { _list.remove(value); }
+			T first() const { return _list.front(); }
+			T last() const { return _list.back(); }
+			unsigned int count() const { return _list.size(); }
+			bool empty() const { return _list.empty(); }
+
+			typename std::list<T>::const_iterator begin() const { return _list.begin(); }
+			typename std::list<T>::const_iterator end() const { return _list.end(); }
+
+		private:
+			std::list<T> _list;
+		};
+	}
+}
@@ -0,0 +1,18 @@
+/*
+ * Host stand-in for the InfOS locks.  There are no interrupts on the host, so holding an IRQ
+ * lock does nothing: code that must be safe across CPUs uses its own atomics and spinlocks.
+ */
+#pragma once
+
+namespace infos
+{
+	namespace util
+	{
+		class UniqueIRQLock
+		{
+		public:
+			UniqueIRQLock() { }
+			~UniqueIRQLock() { }
+		};
+	}
+}
@@ -0,0 +1,4 @@
+/*
+ * Host stand-in for the InfOS map.  Nothing built on the host uses it.
+ */
+#pragma once
@@ -0,0 +1,16 @@
+/*
+ * Host stand-in for the InfOS maths helpers.
+ */
+#pragma once
+
+namespace infos
+{
+	namespace util
+	{
+		template<typename T>
+		T __min(T a, T b) { return a < b ? a : b; }
+
+		template<typename T>
+		T __max(T a, T b) { return a > b ? a : b; }
+	}
+}
@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for the InfOS formatted printing routines.
+ */
+#pragma once
+
+#include <stdio.h>
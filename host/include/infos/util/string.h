@@ -0,0 +1,6 @@
+/*
+ * Host stand-in for the InfOS string routines.
+ */
+#pragma once
+
+#include <string.h>
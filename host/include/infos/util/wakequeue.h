@@ -0,0 +1,20 @@
+/*
+ * Host stand-in for the InfOS wait queues.  No kernel threads run on the host, so sleeping
+ * returns at once and waking does nothing.
+ */
+#pragma once
+
+#include <infos/util/lock.h>
+
+namespace infos
+{
+	namespace util
+	{
+		class WakeQueue
+		{
+		public:
+			void sleep(UniqueIRQLock& l) { (void)l; }
+			void wake() { }
+		};
+	}
+}
@@ -0,0 +1,491 @@
+/*
+ * A discrete-event simulator for the schedulers.  sched-mq.cpp and sched-adv.cpp are built as
+ * they are, against the stand-in headers, and driven through the SchedulingAlgorithm interface
+ * by scripted workloads on one simulated CPU: the timer ticks, threads run for as long as their
+ * work lets them, and block, wake and exit as the kernel would make them.  Every scheduler runs
+ * every workload in each of its modes, and for each run the simulator reports the cost of the
+ * scheduling calls, how long threads of each priority waited to run once they were runnable,
+ * how evenly CPU-bound threads of each priority shared the CPU, and how often a thread starved.
+ *
+ * Simulated time is in nanoseconds, and the runtime threads are charged with is the same.
+ */
+
+#include <infos/kernel/sched.h>
+#include <infos/kernel/thread.h>
+#include <infos/kernel/cmdline.h>
+#include <infos/kernel/log.h>
+
+#include "../slab.h"
+#include "harness.h"
+
+#include <queue>
+#include <random>
+#include <unistd.h>
+
+using namespace infos::kernel;
+
+/* The length of a timer tick. */
+#define TICK	1000000ULL
+
+#define NR_PRIORITIES	4
+
+static const char *priority_names[NR_PRIORITIES] = { "realtime", "interactive", "normal", "daemon" };
+
+/* With -n, slab_alloc() fails, as it does when the buddy allocator is not the page allocator. */
+static bool no_slab;
+static uint64_t bad_slab_frees;
+
+/**
+ * The schedulers' small records come from the slab caches in the kernel.  Here they come from
+ * the host's heap, or from nowhere at all.
+ */
+void* slab_alloc(uint64_t size)
+{
+	return no_slab ? NULL : calloc(1, size);
+}
+
+void slab_free(void* object, uint64_t size)
+{
+	// nothing came from the slab caches, so nothing should go back to them
+	if (no_slab) { bad_slab_frees++; }
+	free(object);
+}
+
+/**
+ * One group of identical threads in a workload.
+ */
+struct ThreadGroup
+{
+	unsigned int count;
+	SchedulingEntityPriority::SchedulingEntityPriority priority;
+	uint64_t start;			// when the threads are created
+	uint64_t burst;			// the mean CPU time between sleeps, or 0 for threads that never sleep
+	uint64_t sleep;			// the mean time each sleep lasts
+	uint64_t work;			// the mean CPU time before the thread exits, or 0 for threads that run forever
+};
+
+struct Workload
+{
+	const char *name;
+	const char *description;
+	uint64_t duration;
+	std::vector<ThreadGroup> groups;
+};
+
+/**
+ * A scheduler, and the command-line argument that puts it in one of its modes.
+ */
+struct SchedulerMode
+{
+	const char *scheduler;
+	const char *key;
+	const char *value;
+};
+
+static const SchedulerMode modes[] = {
+	{ "mq", "sched.mq.mode", "" },
+	{ "mq", "sched.mq.mode", "mlfq" },
+	{ "adv", "sched.adv.mode", "" },
+	{ "adv", "sched.adv.mode", "fair" },
+};
+
+/**
+ * A simulated thread, which the scheduler sees as an ordinary scheduling entity.
+ */
+struct SimThread : public Thread
+{
+	SimThread(const ThreadGroup& group) : Thread(group.priority), group(group) { }
+
+	const ThreadGroup& group;
+	uint64_t burst_left;	// CPU time until it next blocks
+	uint64_t work_left;		// CPU time until it exits
+	uint64_t cpu_time = 0;
+	uint64_t runnable_since = 0;
+	bool waiting = false;	// runnable, but not running
+	bool finished = false;
+};
+
+/**
+ * Collects plain values, such as simulated times, and reports percentiles of them.
+ */
+class Samples
+{
+public:
+	void add(uint64_t value) { _values.push_back(value); }
+	uint64_t count() const { return _values.size(); }
+
+	double percentile_ms(double p)
+	{
+		if (_values.empty()) { return 0; }
+
+		std::sort(_values.begin(), _values.end());
+		return _values[(size_t)(p * (_values.size() - 1))] / 1e6;
+	}
+
+private:
+	std::vector<uint64_t> _values;
+};
+
+/**
+ * Returns Jain's fairness index of a set of shares: 1 if they are all equal, down to 1/n if
+ * one of them has everything.
+ */
+static double jain_index(const std::vector<uint64_t>& shares)
+{
+	double sum = 0, sum_squares = 0;
+	for (uint64_t share : shares) {
+		sum += share;
+		sum_squares += (double)share * share;
+	}
+
+	return sum_squares ? sum * sum / (shares.size() * sum_squares) : 1;
+}
+
+/**
+ * Runs one workload against one scheduler, and reports on it.
+ */
+class Simulation
+{
+public:
+	Simulation(SchedulingAlgorithm& scheduler, const Workload& workload, uint64_t starvation, unsigned int seed)
+		: _scheduler(scheduler), _workload(workload), _starvation(starvation), _rng(seed) { }
+
+	~Simulation()
+	{
+		for (SimThread *thread : _threads) {
+			delete thread;
+		}
+	}
+
+	/**
+	 * Runs the workload to the end.
+	 * @return Returns FALSE if the scheduler did something it must never do.
+	 */
+	bool run()
+	{
+		for (auto& group : _workload.groups) {
+			for (unsigned int i = 0; i < group.count; i++) {
+				SimThread *thread = new SimThread(group);
+				thread->work_left = group.work ? random_time(group.work) : ~0ULL;
+				thread->burst_left = group.burst ? random_time(group.burst) : ~0ULL;
+				thread->state(SchedulingEntityState::SLEEPING);
+
+				_threads.push_back(thread);
+				_events.push({ group.start, thread });
+			}
+		}
+
+		uint64_t next_tick = TICK;
+		while (_now < _workload.duration) {
+			uint64_t next = std::min(next_tick, _workload.duration);
+			if (!_events.empty()) { next = std::min(next, _events.top().time); }
+			if (_current) { next = std::min(next - _now, std::min(_current->burst_left, _current->work_left)) + _now; }
+
+			if (_current) { charge(_current, next - _now); }
+			_now = next;
+
+			// threads that wake while another runs wait for the next tick, but an idle CPU picks
+			bool reschedule = wake_threads() && !_current;
+
+			if (_current && !_current->work_left) {
+				block(_current, SchedulingEntityState::STOPPED);
+				reschedule = true;
+			} else if (_current && !_current->burst_left) {
+				block(_current, SchedulingEntityState::SLEEPING);
+				reschedule = true;
+			}
+
+			if (_now == next_tick) {
+				next_tick += TICK;
+				reschedule = true;
+			}
+
+			if (reschedule) { pick(); }
+		}
+
+		// threads still waiting at the end count if they have already waited too long
+		for (SimThread *thread : _threads) {
+			if (thread->waiting && _now - thread->runnable_since > _starvation) { _starved[thread->priority()]++; }
+		}
+
+		return _errors == 0;
+	}
+
+	void report()
+	{
+		_picks.report("pick_next_entity");
+		_adds.report("add_to_runqueue");
+		_removes.report("remove_from_runqueue");
+
+		uint64_t busy = 0;
+		for (SimThread *thread : _threads) {
+			busy += thread->cpu_time;
+		}
+
+		printf("  %-12s %7s %9s %9s %9s %9s %9s %8s %9s\n", "priority", "threads", "waits", "p50", "p90", "p99", "max", "starved", "fairness");
+		for (unsigned int priority = 0; priority < NR_PRIORITIES; priority++) {
+			unsigned int nr_threads = 0;
+			std::vector<uint64_t> hogs;
+			for (SimThread *thread : _threads) {
+				if (thread->priority() != priority) { continue; }
+
+				nr_threads++;
+				if (!thread->group.burst && !thread->group.work) { hogs.push_back(thread->cpu_time); }
+			}
+			if (!nr_threads) { continue; }
+
+			Samples& waits = _waits[priority];
+			printf("  %-12s %7u %9lu %7.2fms %7.2fms %7.2fms %7.2fms %8lu", priority_names[priority], nr_threads, waits.count(),
+				waits.percentile_ms(0.5), waits.percentile_ms(0.9), waits.percentile_ms(0.99), waits.percentile_ms(1), _starved[priority]);
+
+			// fairness only means something between threads that always want the CPU
+			if (hogs.size() > 1 && *std::max_element(hogs.begin(), hogs.end())) { printf(" %9.3f\n", jain_index(hogs)); }
+			else { printf(" %9s\n", "-"); }
+		}
+
+		unsigned int finished = 0;
+		for (SimThread *thread : _threads) {
+			if (thread->finished) { finished++; }
+		}
+
+		printf("  CPU busy %.1f%%, %lu context switches, %u of %lu threads finished\n",
+			busy * 100.0 / _now, _switches, finished, (uint64_t)_threads.size());
+	}
+
+private:
+	struct Event
+	{
+		uint64_t time;
+		SimThread *thread;
+
+		bool operator>(const Event& other) const { return time > other.time; }
+	};
+
+	uint64_t random_time(uint64_t mean)
+	{
+		std::exponential_distribution<double> distribution(1.0 / mean);
+		return std::max<uint64_t>(1, distribution(_rng));
+	}
+
+	void charge(SimThread *thread, uint64_t delta)
+	{
+		thread->update_accounting(delta);
+		thread->cpu_time += delta;
+		if (thread->burst_left != ~0ULL) { thread->burst_left -= delta; }
+		if (thread->work_left != ~0ULL) { thread->work_left -= delta; }
+	}
+
+	/**
+	 * Makes every thread due to wake or start by now runnable.
+	 * @return Returns TRUE if any did.
+	 */
+	bool wake_threads()
+	{
+		bool woken = false;
+		while (!_events.empty() && _events.top().time <= _now) {
+			SimThread *thread = _events.top().thread;
+			_events.pop();
+
+			thread->state(SchedulingEntityState::RUNNABLE);
+			thread->waiting = true;
+			thread->runnable_since = _now;
+
+			uint64_t start = LatencyRecorder::now();
+			_scheduler.add_to_runqueue(*thread);
+			_adds.record(LatencyRecorder::now() - start);
+			woken = true;
+		}
+
+		return woken;
+	}
+
+	/**
+	 * Takes the running thread off the CPU, because it has gone to sleep or exited.
+	 */
+	void block(SimThread *thread, SchedulingEntityState::SchedulingEntityState state)
+	{
+		thread->state(state);
+
+		uint64_t start = LatencyRecorder::now();
+		_scheduler.remove_from_runqueue(*thread);
+		_removes.record(LatencyRecorder::now() - start);
+
+		if (state == SchedulingEntityState::STOPPED) {
+			thread->finished = true;
+		} else {
+			_events.push({ _now + random_time(thread->group.sleep), thread });
+			thread->burst_left = random_time(thread->group.burst);
+		}
+
+		_current = NULL;
+	}
+
+	/**
+	 * Asks the scheduler what to run next, and checks that it can be run.
+	 */
+	void pick()
+	{
+		uint64_t start = LatencyRecorder::now();
+		SchedulingEntity *entity = _scheduler.pick_next_entity();
+		_picks.record(LatencyRecorder::now() - start);
+
+		SimThread *next = static_cast<SimThread *>(entity);
+		if (next && next->state() != SchedulingEntityState::RUNNABLE && next->state() != SchedulingEntityState::RUNNING) {
+			error("picked a thread that is not runnable");
+			next = NULL;
+		}
+
+		if (next != _current) {
+			_switches++;
+
+			if (_current) {
+				_current->state(SchedulingEntityState::RUNNABLE);
+				_current->waiting = true;
+				_current->runnable_since = _now;
+			}
+
+			if (next) {
+				uint64_t waited = _now - next->runnable_since;
+				_waits[next->priority()].add(waited);
+				if (waited > _starvation) { _starved[next->priority()]++; }
+
+				next->state(SchedulingEntityState::RUNNING);
+				next->waiting = false;
+			}
+
+			_current = next;
+		}
+
+		if (!_current) {
+			for (SimThread *thread : _threads) {
+				if (thread->waiting) {
+					error("left the CPU idle with runnable threads");
+					break;
+				}
+			}
+		}
+	}
+
+	void error(const char *message)
+	{
+		if (_errors++ < 10) { fprintf(stderr, "  at %.3fms: %s\n", _now / 1e6, message); }
+	}
+
+	SchedulingAlgorithm& _scheduler;
+	const Workload& _workload;
+	uint64_t _starvation;
+	std::mt19937_64 _rng;
+
+	std::vector<SimThread *> _threads;
+	std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+	SimThread *_current = NULL;
+	uint64_t _now = 0;
+
+	LatencyRecorder _picks, _adds, _removes;
+	Samples _waits[NR_PRIORITIES];
+	uint64_t _starved[NR_PRIORITIES] = {};
+	uint64_t _switches = 0;
+	uint64_t _errors = 0;
+};
+
+/**
+ * Builds a fresh instance of a registered scheduler.
+ * @return Returns the scheduler, or NULL if none has the name.
+ */
+static SchedulingAlgorithm *create_scheduler(const char *name)
+{
+	for (SchedulerRegistration *reg = SchedulerRegistration::first(); reg; reg = reg->next) {
+		SchedulingAlgorithm *scheduler = reg->factory();
+		if (strcmp(scheduler->name(), name) == 0) { return scheduler; }
+
+		delete scheduler;
+	}
+
+	return NULL;
+}
+
+static std::vector<Workload> workloads(bool quick)
+{
+	using namespace SchedulingEntityPriority;
+
+	uint64_t second = 1000 * TICK;
+	uint64_t duration = quick ? second : 10 * second;
+	unsigned int burst = quick ? 1000 : 4000;
+
+	return {
+		{ "hogs", "8 CPU-bound threads", duration, {
+			{ 8, NORMAL, 0, 0, 0, 0 },
+		} },
+		{ "sleepers", "4 CPU hogs and 16 I/O-bound threads, at the same priority", duration, {
+			{ 4, NORMAL, 0, 0, 0, 0 },
+			{ 16, NORMAL, 0, TICK / 5, 10 * TICK, 0 },
+		} },
+		{ "burst", "2 CPU hogs, then a burst of thousands of short threads", duration, {
+			{ 2, NORMAL, 0, 0, 0, 0 },
+			{ burst, NORMAL, duration / 10, 0, 0, TICK / 2 },
+		} },
+		{ "mixed", "sleepers at every priority, and hogs at the lower two", duration, {
+			{ 2, REALTIME, 0, TICK / 2, 5 * TICK, 0 },
+			{ 4, INTERACTIVE, 0, TICK / 5, 10 * TICK, 0 },
+			{ 3, NORMAL, 0, 0, 0, 0 },
+			{ 4, NORMAL, 0, TICK, 20 * TICK, 0 },
+			{ 2, DAEMON, 0, 0, 0, 0 },
+		} },
+	};
+}
+
+int main(int argc, char **argv)
+{
+	bool quick = false;
+	const char *only = NULL;
+	uint64_t starvation = 500 * TICK;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "nqvs:t:")) != -1) {
+		switch (opt) {
+		case 'n': no_slab = true; break;
+		case 'q': quick = true; break;
+		case 'v': syslog.enable(true); break;
+		case 's': only = optarg; break;
+		case 't': starvation = strtoull(optarg, NULL, 0) * TICK; break;
+		default:
+			fprintf(stderr, "usage: %s [-n] [-q] [-v] [-s workload] [-t starvation-ticks]\n", argv[0]);
+			fprintf(stderr, "  -n  fails every slab allocation, so the schedulers use the kernel heap\n");
+			return 2;
+		}
+	}
+
+	int failed = 0;
+	for (auto& workload : workloads(quick)) {
+		if (only && strcmp(only, workload.name)) { continue; }
+
+		for (auto& mode : modes) {
+			SchedulingAlgorithm *scheduler = create_scheduler(mode.scheduler);
+			if (!scheduler) {
+				fprintf(stderr, "no scheduler is registered as %s\n", mode.scheduler);
+				return 1;
+			}
+
+			set_cmdline_argument(mode.key, mode.value);
+			scheduler->init();
+
+			printf("%s: %s, %s%s%s%s\n", workload.name, workload.description, mode.scheduler,
+				*mode.value ? " (" : "", mode.value, *mode.value ? ")" : "");
+
+			Simulation simulation(*scheduler, workload, starvation, 1);
+			bool ok = simulation.run();
+			simulation.report();
+			printf("  %-24s %s\n", "scheduler", ok ? "ok" : "FAILED");
+			if (!ok) { failed++; }
+
+			delete scheduler;
+		}
+	}
+
+	if (bad_slab_frees) {
+		fprintf(stderr, "%lu records were freed to the slab caches, which gave out none\n", bad_slab_frees);
+		failed++;
+	}
+
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,20 @@
+/*
+ * The kernel objects the host stand-ins declare.
+ */
+
+#include <infos/kernel/kernel.h>
+#include <infos/kernel/log.h>
+#include <infos/kernel/process.h>
+
+namespace infos
+{
+	namespace kernel
+	{
+		Kernel sys;
+		Process *kernel_process = new Process();
+
+		ComponentLog syslog("sys");
+		ComponentLog mm_log("mm");
+		ComponentLog sched_log("sched");
+	}
+}
@@ -6,13 +6,261 @@
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/lock.h>
+#include <infos/util/string.h>
 #include <infos/util/map.h>
 
+#include "sched-common.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+#define BALANCE_INTERVAL    32
+#define NICE_0_WEIGHT       1024
+
+/* The weight of each nice value from -20 to 19.  Each step is worth about 10% of the CPU against
+ * a thread one step away, and a nice value of 0 has weight NICE_0_WEIGHT. */
+static const unsigned int nice_weights[40] = {
+    88761, 71755, 56483, 46273, 36291,
+    29154, 23254, 18705, 14949, 11916,
+    9548, 7620, 6100, 4904, 3906,
+    3121, 2501, 1991, 1586, 1277,
+    1024, 820, 655, 526, 423,
+    335, 272, 215, 172, 137,
+    110, 87, 70, 56, 45,
+    36, 29, 23, 18, 15,
+};
+
+/* Whether priority levels share the CPU in proportion to their shares, from the "sched.adv.mode"
+ * argument, rather than taking turns in runs of consecutive slices. */
+static bool fair_share_mode;
+
+/* The share of the CPU each priority level gets in fair-share mode, from the "sched.adv.shares"
+ * argument.  The defaults are in the same proportions as the consecutive slice runs. */
+static unsigned int level_shares[4] = {40, 30, 20, 10};
+
+RegisterCmdLineArgument(SchedAdvMode, "sched.adv.mode")
+{
+    fair_share_mode = strcmp(value, "fair") == 0;
+}
+
+RegisterCmdLineArgument(SchedAdvShares, "sched.adv.shares")
+{
+    const char *c = value;
+    for (int level = 0; level < 4 && *c; level++)
+    {
+        unsigned int share = 0;
+        for (; *c >= '0' && *c <= '9'; c++)
+        {
+            share = share * 10 + (*c - '0');
+        }
+
+        if (share) { level_shares[level] = share; }
+        if (*c == ',') { c++; }
+    }
+}
+
+/**
+ * A nice value set for an entity, kept across the times it sleeps.
+ */
+struct NiceSetting
+{
+    SchedulingEntity *entity;
+    int nice;
+    bool from_heap;     // allocated from the kernel heap rather than a slab cache
+};
+
+/**
+ * The scheduler's own record of an entity, kept in the run queue for its priority level while it
+ * is runnable.  It is kept while the entity sleeps, so that the entity wakes with the virtual
+ * runtime it went to sleep with, on the CPU it last ran on, and is only let go once it stops.
+ */
+struct RunqueueNode
+{
+    SchedulingEntity *entity;
+    SchedulingEntity::EntityRuntime vruntime;       // time run so far, on the level's virtual clock
+    SchedulingEntity::EntityRuntime last_runtime;   // the entity's cpu_runtime() when vruntime was last brought up to date
+    SchedulingEntity::EntityRuntime lag;            // how far vruntime was ahead of the level's baseline when it slept
+    unsigned int level;
+    unsigned int heap_index;
+    unsigned int cpu;
+    unsigned int weight;                            // from the entity's nice value
+    uint64_t wake_time;                             // the cycle counter when it became runnable, or 0 once it has run
+    bool queued;
+    RunqueueNode *next_free;                        // the next node in its shard's free list
+    bool from_heap;                                 // allocated from the kernel heap rather than a slab cache
+};
+
+/**
+ * A binary min-heap of run queue nodes, ordered by virtual runtime.  The node that has run the
+ * least is always at the top, and every node knows its own position, so any node can be removed
+ * or moved in O(log n).
+ */
+class VruntimeHeap
+{
+public:
+    ~VruntimeHeap() { delete[] _nodes; }
+
+    bool empty() const { return _count == 0; }
+    unsigned int count() const { return _count; }
+
+    /**
+     * @return Returns the node with the least virtual runtime, or NULL if the heap is empty.
+     */
+    RunqueueNode *first() const { return _count ? _nodes[0] : NULL; }
+
+    /**
+     * @return Returns the node at a position in the heap, which must be less than count().
+     */
+    RunqueueNode *at(unsigned int i) const { return _nodes[i]; }
+
+    /**
+     * Adds a node to the heap.
+     * @param node The node.
+     * @return Returns false if the heap was full and memory ran out, leaving the node out.
+     */
+    bool insert(RunqueueNode *node)
+    {
+        if (!reserve()) { return false; }
+
+        node->heap_index = _count;
+        _nodes[_count++] = node;
+        sift_up(node->heap_index);
+        return true;
+    }
+
+    /**
+     * Makes room for one more node, if there is none.
+     * @return Returns false if the heap was full and memory ran out.
+     */
+    bool reserve() { return _count < _capacity || grow(); }
+
+    /**
+     * Removes a node from the heap.
+     * @param node The node.
+     */
+    void remove(RunqueueNode *node)
+    {
+        unsigned int i = node->heap_index;
+
+        _count--;
+        if (i == _count) { return; }
+
+        place(_nodes[_count], i);
+        sift_up(i);
+        sift_down(_nodes[i]->heap_index);
+    }
+
+    /**
+     * Moves a node to its right place after its virtual runtime has changed.
+     * @param node The node.
+     */
+    void update(RunqueueNode *node)
+    {
+        sift_up(node->heap_index);
+        sift_down(node->heap_index);
+    }
+
+private:
+    void place(RunqueueNode *node, unsigned int i)
+    {
+        _nodes[i] = node;
+        node->heap_index = i;
+    }
+
+    void sift_up(unsigned int i)
+    {
+        RunqueueNode *node = _nodes[i];
+        while (i > 0)
+        {
+            unsigned int parent = (i - 1) / 2;
+            if (_nodes[parent]->vruntime <= node->vruntime) { break; }
+
+            place(_nodes[parent], i);
+            i = parent;
+        }
+        place(node, i);
+    }
+
+    void sift_down(unsigned int i)
+    {
+        RunqueueNode *node = _nodes[i];
+        while (true)
+        {
+            unsigned int child = i * 2 + 1;
+            if (child >= _count) { break; }
+            if (child + 1 < _count && _nodes[child + 1]->vruntime < _nodes[child]->vruntime) { child++; }
+            if (node->vruntime <= _nodes[child]->vruntime) { break; }
+
+            place(_nodes[child], i);
+            i = child;
+        }
+        place(node, i);
+    }
+
+    bool grow()
+    {
+        unsigned int capacity = _capacity ? _capacity * 2 : 16;
+        RunqueueNode **nodes = new RunqueueNode *[capacity];
+        if (!nodes) { return false; }
+
+        for (unsigned int i = 0; i < _count; i++) { nodes[i] = _nodes[i]; }
+        delete[] _nodes;
+
+        _nodes = nodes;
+        _capacity = capacity;
+        return true;
+    }
+
+    RunqueueNode **_nodes = NULL;
+    unsigned int _count = 0;
+    unsigned int _capacity = 0;
+};
+
+/**
+ * One shard of the scheduler's records of entities.  Entities are spread over the shards by
+ * address, and each shard has its own lock, so CPUs waking and putting to sleep different
+ * entities rarely wait for each other.
+ */
+struct EntityShard
+{
+    RunqueueLock lock;
+    EntityTable<RunqueueNode> nodes;
+    EntityTable<NiceSetting> nice_settings;
+    EntityTable<DeadlineEntity> deadlines;
+    RunqueueNode *free_nodes = NULL;
+};
+
+/**
+ * The run queues of one CPU, one per priority level, and the state of the CPU's picking.
+ */
+struct CpuRunqueue
+{
+    RunqueueLock lock;
+    VruntimeHeap levels[4];
+    SchedulingEntity::EntityRuntime min_vruntime[4] = {0,0,0,0};
+    int consecutive_counts[4] = {0,0,0,0};
+    RunqueueNode *current = NULL;
+
+    // in fair-share mode, the time each level has run, scaled by its share
+    SchedulingEntity::EntityRuntime level_vruntime[4] = {0,0,0,0};
+    SchedulingEntity::EntityRuntime min_level_vruntime = 0;
+
+    // read without the lock by other CPUs looking for work
+    unsigned int nr_queued[4] = {0,0,0,0};
+    unsigned int nr_running = 0;
+    unsigned int current_level = 4;
+
+    unsigned int ticks = 0;
+
+    SchedCpuStats stats = {};
+    DeadlineRunqueue dl;
+
+    // entities woken on this CPU, made runnable at its next pick
+    WakeupQueue wakeups;
+};
+
 /**
  * A Multiple Queue priority scheduling algorithm
  */
@@ -38,29 +286,15 @@ public:
      */
     void add_to_runqueue(SchedulingEntity& entity) override
     {
-        UniqueIRQLock l;
-        switch (entity.priority())
-        {
-            case SchedulingEntityPriority::REALTIME:
-                runqueues[SchedulingEntityPriority::REALTIME].enqueue(&entity);
-                break;
-            
-            case SchedulingEntityPriority::INTERACTIVE:
-                runqueues[SchedulingEntityPriority::INTERACTIVE].enqueue(&entity);
-                break;
+        // this takes no locks, so it is safe from any context, and the entity is made runnable
+        // at this CPU's next pick
+        if (wakeup_queue_push(cpus[current_cpu()].wakeups, &entity, read_cycle_counter())) { return; }
 
-            case SchedulingEntityPriority::NORMAL:
-                runqueues[SchedulingEntityPriority::NORMAL].enqueue(&entity);
-                break;
-
-            case SchedulingEntityPriority::DAEMON:
-                runqueues[SchedulingEntityPriority::DAEMON].enqueue(&entity);
-                break;
-            
-            default:
-                syslog.messagef(LogLevel::DEBUG, "Thread priority unknown ?");
-                break;
-        }
+        // the queue is full, so make the entity runnable now
+        UniqueIRQLock l;
+        EntityShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+        enqueue_entity(entity, read_cycle_counter());
     }
 
     /**
@@ -70,17 +304,34 @@ public:
     void remove_from_runqueue(SchedulingEntity& entity) override
     {
         UniqueIRQLock l;
-        List<SchedulingEntity *> * runqueue;
-        unsigned int pre;
 
-        for (int i = 0; i < 4; i++)
+        // a wakeup from before the entity stopped being runnable must not take effect after it
+        flush_wakeups();
+
+        EntityShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+        dequeue_entity(entity);
+
+        // a stopped thread will not run again, so give back its node, its nice setting and any
+        // bandwidth it reserved, before its address can be reused by another thread
+        if (entity.state() != SchedulingEntityState::STOPPED) { return; }
+
+        RunqueueNode *node = shard.nodes.find(&entity);
+        if (node)
+        {
+            shard.nodes.remove(&entity);
+            free_node(shard, node);
+        }
+
+        NiceSetting *setting = shard.nice_settings.find(&entity);
+        if (setting)
         {
-            runqueue = &runqueues[i];
-           
-            pre = runqueue->count();
-            runqueue->remove(&entity);
-            if (runqueue->count() < pre) { return; }
+            shard.nice_settings.remove(&entity);
+            free_record(setting);
         }
+
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de) { release_deadline(de); }
     }
 
     /**
@@ -90,24 +341,646 @@ public:
      */
     SchedulingEntity *pick_next_entity() override
     {
-        List<SchedulingEntity *> * runqueue;
+        UniqueIRQLock l;
+        unsigned int cpu = current_cpu();
+        CpuRunqueue& rq = cpus[cpu];
+
+        // make every entity woken since the last pick runnable, in one batch
+        if (!wakeup_queue_empty(rq.wakeups)) { drain_wakeups(cpu); }
+
+        // an idle CPU looks for work every time, a busy one only now and then
+        if (__atomic_load_n(&rq.nr_running, __ATOMIC_RELAXED) == 0 || ++rq.ticks % BALANCE_INTERVAL == 0)
+        {
+            pull_entity(cpu);
+        }
+
+        UniqueRunqueueLock rl(rq.lock);
+        account_current(rq);
+
+        // deadline entities with budget left run ahead of every level, earliest deadline first
+        uint64_t now = sched_clock();
+        DeadlineEntity *throttled = deadline_charge(rq.dl, now);
+        if (throttled) { trace(TRACE_THROTTLE, cpu, throttled->entity, 4); }
+        deadline_replenish(rq.dl, now);
+
+        DeadlineEntity *de = rq.dl.ready.first();
+        if (de)
+        {
+            set_current(rq, NULL);
+            account_deadline_pick(cpu, de, now);
+            return de->entity;
+        }
+        rq.dl.running = NULL;
+
+        RunqueueNode *previous = rq.current;
+        RunqueueNode *next = fair_share_mode ? pick_by_share(rq) : pick_by_slices(rq);
+        set_current(rq, next);
+        account_pick(cpu, previous, next);
+
+        return next ? next->entity : NULL;
+    }
+
+    /**
+     * Sets the nice value of an entity, which weights its share of the CPU against the other
+     * entities at its priority level.  The setting is kept while the entity sleeps, until it is
+     * set back to 0.
+     * @param entity The entity.
+     * @param nice The nice value, from -20 (the largest share) to 19 (the smallest).
+     * @return Returns true if the nice value was set, or false if it is out of range or there
+     * was no memory to record it.
+     */
+    bool set_nice(SchedulingEntity& entity, int nice)
+    {
+        if (nice < -20 || nice > 19) { return false; }
+
+        UniqueIRQLock l;
+        EntityShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+
+        NiceSetting *setting = shard.nice_settings.find(&entity);
+        if (nice == 0)
+        {
+            if (setting)
+            {
+                shard.nice_settings.remove(&entity);
+                free_record(setting);
+            }
+        }
+        else if (setting)
+        {
+            setting->nice = nice;
+        }
+        else
+        {
+            setting = alloc_record<NiceSetting>();
+            if (!setting) { return false; }
+
+            setting->entity = &entity;
+            setting->nice = nice;
+            if (!shard.nice_settings.insert(setting))
+            {
+                free_record(setting);
+                return false;
+            }
+        }
+
+        // a sleeping entity picks its weight up again when it wakes
+        RunqueueNode *node = shard.nodes.find(&entity);
+        if (node && node->queued)
+        {
+            CpuRunqueue& rq = lock_node_cpu(node);
+
+            // charge the time run so far at the old weight
+            if (node == rq.current) { account_current(rq); }
+            node->weight = nice_weights[nice + 20];
+
+            rq.lock.unlock();
+        }
+
+        return true;
+    }
+
+    /**
+     * Puts an entity in the deadline class, where it is guaranteed runtime units of CPU time
+     * within deadline units of the start of every period, ahead of every priority level.  It
+     * is throttled once it has used its runtime for the period, so it cannot take more than
+     * its share.  The request is only admitted if a CPU has enough bandwidth left unreserved.
+     * Times are in the units of sched_clock().
+     * @param entity The entity.
+     * @param runtime The CPU time needed in each period.
+     * @param deadline The time from the start of each period by which the runtime is needed.
+     * @param period The time between the starts of periods.
+     * @return Returns true if the entity was admitted, or false if the parameters are invalid,
+     * no CPU has the bandwidth or room left for it, or memory ran out.
+     */
+    bool set_deadline(SchedulingEntity& entity, uint64_t runtime, uint64_t deadline, uint64_t period)
+    {
+        if (!runtime || runtime > deadline || deadline > period) { return false; }
+        uint64_t bandwidth = deadline_bandwidth(runtime, deadline);
+
+        UniqueIRQLock l;
+        EntityShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+
+        // a new record is made before admission, so running out of memory leaves nothing reserved
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        DeadlineEntity *created = NULL;
+        if (!de)
+        {
+            created = alloc_record<DeadlineEntity>();
+            if (!created) { return false; }
+
+            created->entity = &entity;
+            if (!shard.deadlines.insert(created))
+            {
+                free_record(created);
+                return false;
+            }
+        }
+
+        unsigned int cpu = admit_deadline(de, bandwidth);
+        if (cpu >= MAX_CPUS)
+        {
+            if (created)
+            {
+                shard.deadlines.remove(&entity);
+                free_record(created);
+            }
+            return false;
+        }
+
+        bool queued = dequeue_entity(entity);
+        if (created) { de = created; }
+
+        de->runtime = runtime;
+        de->deadline = deadline;
+        de->period = period;
+        de->bandwidth = bandwidth;
+        de->cpu = cpu;
+        de->abs_deadline = 0;
+        de->budget = 0;
+        de->throttled = false;
+
+        if (queued) { enqueue_entity(entity, read_cycle_counter()); }
+        return true;
+    }
+
+    /**
+     * Takes an entity out of the deadline class, back to its priority level, and gives back
+     * the bandwidth it reserved.
+     * @param entity The entity.
+     */
+    void clear_deadline(SchedulingEntity& entity)
+    {
+        UniqueIRQLock l;
+        EntityShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (!de) { return; }
+
+        bool queued = dequeue_entity(entity);
+        release_deadline(de);
+        if (queued) { enqueue_entity(entity, read_cycle_counter()); }
+    }
+
+    /**
+     * Turns tracing of run queue events on or off.
+     * @param enabled TRUE to record events in the per-CPU trace ring buffers.
+     */
+    void set_tracing(bool enabled)
+    {
+        __atomic_store_n(&tracing, enabled, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Exports trace records from a CPU's trace ring buffer, oldest first, removing them from
+     * the ring.  This can be called from any CPU while tracing carries on.
+     * @param cpu The CPU whose ring to read.
+     * @param records The array to copy the records into.
+     * @param max The number of records the array has room for.
+     * @return Returns the number of records copied.
+     */
+    unsigned int read_trace(unsigned int cpu, SchedTraceRecord *records, unsigned int max)
+    {
+        if (cpu >= MAX_CPUS) { return 0; }
+
+        UniqueIRQLock l;
+        UniqueRunqueueLock tl(trace_read_lock);
+        return trace_ring_read(trace_rings[cpu], records, max);
+    }
+
+    /**
+     * Takes a snapshot of the scheduler's counters, summed over every CPU.  This can be called
+     * from any CPU at any time, and rates come from the difference between two snapshots.
+     * @param telemetry The snapshot to fill in.
+     */
+    void read_telemetry(SchedTelemetry& telemetry)
+    {
+        memset(&telemetry, 0, sizeof(telemetry));
+        telemetry.timestamp = read_cycle_counter();
+
+        for (unsigned int i = 0; i < MAX_CPUS; i++)
+        {
+            const SchedCpuStats& stats = cpus[i].stats;
+
+            telemetry.picks += __atomic_load_n(&stats.picks, __ATOMIC_RELAXED);
+            telemetry.context_switches += __atomic_load_n(&stats.context_switches, __ATOMIC_RELAXED);
+            for (unsigned int level = 0; level < 4; level++)
+            {
+                telemetry.queued[level] += __atomic_load_n(&cpus[i].nr_queued[level], __ATOMIC_RELAXED);
+                telemetry.queued_sum[level] += __atomic_load_n(&stats.queued_sum[level], __ATOMIC_RELAXED);
+                telemetry.budget_forced[level] += __atomic_load_n(&stats.budget_forced[level], __ATOMIC_RELAXED);
+            }
+            for (unsigned int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+            {
+                telemetry.wakeup_latency[bucket] += __atomic_load_n(&stats.wakeup_latency[bucket], __ATOMIC_RELAXED);
+            }
+
+            telemetry.trace_lost += __atomic_load_n(&trace_rings[i].lost, __ATOMIC_RELAXED);
+        }
+    }
+
+    /**
+     * Writes the scheduler's counters to the system log.
+     */
+    void dump_state()
+    {
+        SchedTelemetry telemetry;
+        read_telemetry(telemetry);
+
+        syslog.messagef(LogLevel::DEBUG, "SCHED %s: %lu picks, %lu context switches, %lu trace records lost",
+            name(), telemetry.picks, telemetry.context_switches, telemetry.trace_lost);
+
+        for (unsigned int level = 0; level < 4; level++)
+        {
+            syslog.messagef(LogLevel::DEBUG, "level %u: %lu queued, %lu average, %lu picks forced by budget",
+                level, telemetry.queued[level], telemetry.picks ? telemetry.queued_sum[level] / telemetry.picks : 0,
+                telemetry.budget_forced[level]);
+        }
+
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            if (!telemetry.wakeup_latency[i]) { continue; }
+            syslog.messagef(LogLevel::DEBUG, "wakeup <2^%u cycles: %lu", i + 1, telemetry.wakeup_latency[i]);
+        }
+    }
+
+private:
+    const int priority_levels_count = 4;
+    CpuRunqueue cpus[MAX_CPUS];
+    EntityShard shards[ENTITY_SHARDS];
+    RunqueueLock admission_lock;        // guards dl_bandwidth and dl_entities
+    uint64_t dl_bandwidth[MAX_CPUS] = {};
+    unsigned int dl_entities[MAX_CPUS] = {};
+    int consecutive_maxs[4] = {4,3,2,1};
+
+    bool tracing = false;
+    SchedTraceRing trace_rings[MAX_CPUS];
+    RunqueueLock trace_read_lock;
+
+    /**
+     * Records an event in this CPU's trace ring buffer, if tracing is enabled.  The run queue
+     * the event was on must be locked.
+     * @param event The event.
+     * @param cpu The CPU whose run queue the event was on.
+     * @param entity The entity the event is about, or NULL if there is none.
+     * @param level The level of the entity.
+     */
+    void trace(SchedTraceEvent event, unsigned int cpu, const SchedulingEntity *entity, unsigned int level)
+    {
+        if (__builtin_expect(!__atomic_load_n(&tracing, __ATOMIC_RELAXED), 1)) { return; }
+
+        SchedTraceRecord record;
+        record.timestamp = read_cycle_counter();
+        record.entity = (uint64_t)(uintptr_t)entity;
+        record.queued = level < 4 ? cpus[cpu].nr_queued[level] : 0;
+        record.event = event;
+        record.level = level;
+        record.cpu = cpu;
+        record.reserved = 0;
+
+        trace_ring_push(trace_rings[current_cpu()], record);
+    }
+
+    /**
+     * Updates a CPU's counters and trace for the entity it has picked.  Its run queue must be locked.
+     * @param cpu The CPU.
+     * @param previous The entity the CPU was running, or NULL.
+     * @param next The entity picked, or NULL if there is nothing to run.
+     */
+    void account_pick(unsigned int cpu, RunqueueNode *previous, RunqueueNode *next)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        SchedCpuStats& stats = rq.stats;
+
+        stat_add(stats.picks, 1);
+        for (unsigned int level = 0; level < 4; level++) { stat_add(stats.queued_sum[level], rq.nr_queued[level]); }
+
+        if (!next)
+        {
+            trace(TRACE_IDLE, cpu, NULL, 4);
+            return;
+        }
+
+        if (next != previous) { stat_add(stats.context_switches, 1); }
+
+        for (unsigned int level = 0; level < next->level; level++)
+        {
+            if (rq.nr_queued[level])
+            {
+                stat_add(stats.budget_forced[next->level], 1);
+                break;
+            }
+        }
+
+        if (next->wake_time)
+        {
+            record_latency(stats.wakeup_latency, read_cycle_counter() - next->wake_time);
+            next->wake_time = 0;
+        }
+
+        trace(TRACE_PICK, cpu, next->entity, next->level);
+    }
+
+    /**
+     * Returns the shard of the per-entity tables an entity belongs to.
+     */
+    EntityShard& shard_of(const SchedulingEntity& entity)
+    {
+        return shards[entity_shard(&entity)];
+    }
+
+    /**
+     * Makes runnable the entities waiting in a CPU's wakeup queue, in the order they woke up.
+     * It takes out at most a queue's worth, so CPUs that keep pushing cannot hold it here.
+     * Interrupts must be disabled.
+     * @param cpu The CPU whose queue to drain.
+     */
+    void drain_wakeups(unsigned int cpu)
+    {
+        WakeupQueue& queue = cpus[cpu].wakeups;
+        UniqueRunqueueLock wl(queue.lock);
+
+        SchedulingEntity *entity;
+        uint64_t wake_time;
+        for (unsigned int i = 0; i < WAKEUP_QUEUE_SIZE && wakeup_queue_pop(queue, entity, wake_time); i++)
+        {
+            EntityShard& shard = shard_of(*entity);
+            UniqueRunqueueLock sl(shard.lock);
+            enqueue_entity(*entity, wake_time);
+        }
+    }
+
+    /**
+     * Makes every wakeup pushed so far on any CPU take effect.  A CPU part way through draining
+     * its queue has already taken the wakeups out, so this waits for it to finish.  Interrupts
+     * must be disabled, and no shard may be locked.
+     */
+    void flush_wakeups()
+    {
+        for (unsigned int i = 0; i < nr_cpus_online(); i++)
+        {
+            WakeupQueue& queue = cpus[i].wakeups;
+            if (wakeup_queue_empty(queue) && !queue.lock.locked()) { continue; }
+
+            drain_wakeups(i);
+        }
+    }
+
+    /**
+     * Makes an entity runnable, in the deadline class if it has deadline parameters, or else at
+     * its priority level.  The entity's shard must be locked.
+     * @param entity The entity.
+     * @param wake_time The cycle counter when it woke up.
+     */
+    void enqueue_entity(SchedulingEntity& entity, uint64_t wake_time)
+    {
+        EntityShard& shard = shard_of(entity);
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de)
+        {
+            if (de->queued) { return; }
+
+            CpuRunqueue& rq = cpus[de->cpu];
+            UniqueRunqueueLock rl(rq.lock);
+
+            de->wake_time = wake_time;
+            deadline_enqueue(rq.dl, de, sched_clock());
+            __atomic_store_n(&rq.nr_running, rq.nr_running + 1, __ATOMIC_RELAXED);
+            trace(TRACE_ENQUEUE, de->cpu, &entity, 4);
+            return;
+        }
+
+        unsigned int level = entity.priority();
+        if (level >= (unsigned int)priority_levels_count)
+        {
+            syslog.messagef(LogLevel::DEBUG, "Thread priority unknown ?");
+            return;
+        }
+
+        RunqueueNode *node = shard.nodes.find(&entity);
+        if (node && node->queued) { return; }
+
+        bool woken = node != NULL;
+        if (!woken)
+        {
+            node = alloc_node(shard);
+            if (!node)
+            {
+                syslog.messagef(LogLevel::ERROR, "Out of memory for run queue node");
+                return;
+            }
+
+            node->entity = &entity;
+            if (!shard.nodes.insert(node))
+            {
+                free_node(shard, node);
+                syslog.messagef(LogLevel::ERROR, "Out of memory for run queue node");
+                return;
+            }
+        }
+
+        unsigned int cpu = select_cpu(woken ? node->cpu : MAX_CPUS);
+        CpuRunqueue& rq = cpus[cpu];
+        UniqueRunqueueLock rl(rq.lock);
+
+        // a thread that slept keeps the virtual runtime it had, so sleeping cannot buy it extra
+        // CPU time, but it does not fall behind the baseline either, so it cannot claim a backlog
+        // of runtime.  A new thread starts at the baseline.
+        SchedulingEntity::EntityRuntime vruntime = rq.min_vruntime[level];
+        if (woken && node->cpu == cpu && node->level == level)
+        {
+            if (node->vruntime > vruntime) { vruntime = node->vruntime; }
+        }
+        else if (woken)
+        {
+            vruntime += node->lag;
+        }
+
+        node->level = level;
+        node->cpu = cpu;
+        node->vruntime = vruntime;
+        node->last_runtime = entity.cpu_runtime();
+        node->weight = weight_of(entity);
+        node->wake_time = wake_time;
+
+        if (!enqueue(rq, node))
+        {
+            syslog.messagef(LogLevel::ERROR, "Out of memory for run queue");
+            return;
+        }
+
+        node->queued = true;
+        trace(TRACE_ENQUEUE, cpu, &entity, level);
+    }
+
+    /**
+     * Makes an entity no longer runnable, in whichever class it is in.  The entity's shard must
+     * be locked.
+     * @return Returns true if the entity was runnable.
+     */
+    bool dequeue_entity(SchedulingEntity& entity)
+    {
+        EntityShard& shard = shard_of(entity);
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de && de->queued)
+        {
+            CpuRunqueue& rq = cpus[de->cpu];
+            UniqueRunqueueLock rl(rq.lock);
+
+            // charge it for the time it ran before it stopped
+            if (rq.dl.running == de) { deadline_charge(rq.dl, sched_clock()); }
+
+            deadline_dequeue(rq.dl, de);
+            __atomic_store_n(&rq.nr_running, rq.nr_running - 1, __ATOMIC_RELAXED);
+            trace(TRACE_DEQUEUE, de->cpu, &entity, 4);
+            return true;
+        }
+
+        RunqueueNode *node = shard.nodes.find(&entity);
+        if (!node || !node->queued) { return false; }
+
+        CpuRunqueue& rq = lock_node_cpu(node);
+        if (node == rq.current)
+        {
+            // bring its virtual runtime up to date, since it is kept while it sleeps
+            account_current(rq);
+            set_current(rq, NULL);
+        }
+
+        dequeue(rq, node);
+        node->queued = false;
+        node->lag = node->vruntime > rq.min_vruntime[node->level] ? node->vruntime - rq.min_vruntime[node->level] : 0;
+        trace(TRACE_DEQUEUE, node->cpu, &entity, node->level);
+        rq.lock.unlock();
+
+        return true;
+    }
+
+    /**
+     * Takes a node from a shard's free list, so that threads starting and stopping reuse the
+     * nodes of earlier ones rather than allocating.  The list only grows from the slab caches
+     * when it is empty.  The shard must be locked.
+     * @return Returns the node, or NULL if memory ran out.
+     */
+    RunqueueNode *alloc_node(EntityShard& shard)
+    {
+        RunqueueNode *node = shard.free_nodes;
+        if (!node) { return alloc_record<RunqueueNode>(); }
+
+        shard.free_nodes = node->next_free;
+        bool from_heap = node->from_heap;
+        *node = RunqueueNode();
+        node->from_heap = from_heap;
+        return node;
+    }
+
+    void free_node(EntityShard& shard, RunqueueNode *node)
+    {
+        node->entity = NULL;
+        node->next_free = shard.free_nodes;
+        shard.free_nodes = node;
+    }
+
+    /**
+     * Finds a CPU with room to reserve a deadline entity's bandwidth, preferring the one it
+     * is already on, and moves its reservation there.  The entity's shard must be locked.
+     * @param de The entity, or NULL if it is not in the deadline class yet.
+     * @param bandwidth The bandwidth it needs.
+     * @return Returns the CPU, or MAX_CPUS if none has room, in which case nothing is reserved.
+     */
+    unsigned int admit_deadline(const DeadlineEntity *de, uint64_t bandwidth)
+    {
+        uint64_t limit = (DEADLINE_BANDWIDTH_PERCENT << BANDWIDTH_SHIFT) / 100;
+        UniqueRunqueueLock al(admission_lock);
+
+        unsigned int cpu = MAX_CPUS;
+        if (de && dl_bandwidth[de->cpu] - de->bandwidth + bandwidth <= limit) { cpu = de->cpu; }
+
+        // a CPU's deadline heaps only have room for so many entities
+        for (unsigned int i = 0; cpu == MAX_CPUS && i < nr_cpus_online(); i++)
+        {
+            if (de && i == de->cpu) { continue; }
+            if (dl_bandwidth[i] + bandwidth <= limit && dl_entities[i] < DEADLINE_MAX_ENTITIES) { cpu = i; }
+        }
+        if (cpu == MAX_CPUS) { return MAX_CPUS; }
+
+        if (de)
+        {
+            dl_bandwidth[de->cpu] -= de->bandwidth;
+            dl_entities[de->cpu]--;
+        }
+        dl_bandwidth[cpu] += bandwidth;
+        dl_entities[cpu]++;
+        return cpu;
+    }
+
+    /**
+     * Takes an entity that is not runnable out of the deadline class.  The entity's shard must
+     * be locked.
+     */
+    void release_deadline(DeadlineEntity *de)
+    {
+        admission_lock.lock();
+        dl_bandwidth[de->cpu] -= de->bandwidth;
+        dl_entities[de->cpu]--;
+        admission_lock.unlock();
+
+        shard_of(*de->entity).deadlines.remove(de->entity);
+        free_record(de);
+    }
+
+    /**
+     * Updates a CPU's counters and trace for the deadline entity it has picked, and starts
+     * charging it for its time.  Its run queue must be locked.
+     */
+    void account_deadline_pick(unsigned int cpu, DeadlineEntity *de, uint64_t now)
+    {
+        CpuRunqueue& rq = cpus[cpu];
+        SchedCpuStats& stats = rq.stats;
+
+        stat_add(stats.picks, 1);
+        if (rq.dl.running != de)
+        {
+            stat_add(stats.context_switches, 1);
+            rq.dl.running = de;
+            rq.dl.running_since = now;
+        }
+
+        if (de->wake_time)
+        {
+            record_latency(stats.wakeup_latency, read_cycle_counter() - de->wake_time);
+            de->wake_time = 0;
+        }
+
+        trace(TRACE_PICK_DEADLINE, cpu, de->entity, 4);
+    }
+
+    /**
+     * Picks the next entity by letting each level run in turn, for a run of consecutive slices
+     * that is longer the higher its priority.
+     */
+    RunqueueNode *pick_by_slices(CpuRunqueue& rq)
+    {
+        VruntimeHeap * runqueue;
         bool looped = false;
 
         for (int i = 0; i < priority_levels_count; i++)
         {
             // skip priority level if max consecutive slices reached
-            if (consecutive_counts[i] >= consecutive_maxs[i])
+            if (rq.consecutive_counts[i] >= consecutive_maxs[i])
             {
                 continue;
             }
-            runqueue = &runqueues[i];
+            runqueue = &rq.levels[i];
 
             if (runqueue->empty())
             {
                 // if not lowest priority, reset consecutive and continue
                 if (i < SchedulingEntityPriority::DAEMON) 
                 { 
-                    consecutive_counts[i] = 0;
+                    rq.consecutive_counts[i] = 0;
                     continue; 
                 }
                 else 
@@ -116,7 +989,7 @@ public:
                     if (looped) { return NULL; }
                     else
                     {
-                        reset_consecutive_counts();
+                        reset_consecutive_counts(rq);
                         i = -1;
                         looped = true;
                         continue;
@@ -124,52 +997,237 @@ public:
                 }
             }
 
-            if (runqueue->count() == 1) 
+            //cfs algorithm: the entity that has run least is always at the top of the heap
+            RunqueueNode *next = runqueue->first();
+            rq.consecutive_counts[i]++;
+
+            // reset all if all consecutive counts maxed out
+            if (rq.consecutive_counts[SchedulingEntityPriority::DAEMON] >= consecutive_maxs[SchedulingEntityPriority::DAEMON]) 
             { 
-                consecutive_counts[i]++;
-                // reset all if all consecutive counts maxed out
-                if (consecutive_counts[SchedulingEntityPriority::DAEMON] >= consecutive_maxs[SchedulingEntityPriority::DAEMON]) 
-                { 
-                    reset_consecutive_counts();
-                }
-                return runqueue->first(); 
+                reset_consecutive_counts(rq);
             }
 
-            //cfs algorithm
-            SchedulingEntity::EntityRuntime min_runtime = 0;
-            SchedulingEntity *min_runtime_entity = NULL;
+            return next;
+        }
+        return NULL;
+    }
 
-            for (const auto& entity : *runqueue) {
-                if (min_runtime_entity == NULL || entity->cpu_runtime() < min_runtime) {
-                    min_runtime_entity = entity;
-                    min_runtime = entity->cpu_runtime();
-                }
-            }
-            consecutive_counts[i]++;
+    /**
+     * Picks the next entity by running the level that is furthest behind its share of the CPU,
+     * and within it the entity that is furthest behind its own share of the level.
+     */
+    RunqueueNode *pick_by_share(CpuRunqueue& rq)
+    {
+        int next_level = -1;
 
-            // reset all if all consecutive counts maxed out
-            if (consecutive_counts[SchedulingEntityPriority::DAEMON] >= consecutive_maxs[SchedulingEntityPriority::DAEMON]) 
-            { 
-                reset_consecutive_counts();
+        for (int i = 0; i < priority_levels_count; i++)
+        {
+            if (rq.levels[i].empty()) { continue; }
+            if (next_level < 0 || rq.level_vruntime[i] < rq.level_vruntime[next_level]) { next_level = i; }
+        }
+
+        return next_level < 0 ? NULL : rq.levels[next_level].first();
+    }
+
+    /**
+     * Returns the weight of an entity, from its nice value.  The entity's shard must be locked.
+     */
+    unsigned int weight_of(const SchedulingEntity& entity)
+    {
+        NiceSetting *setting = shard_of(entity).nice_settings.find(&entity);
+        return nice_weights[(setting ? setting->nice : 0) + 20];
+    }
+
+    /**
+     * Locks the run queue of the CPU a node is on.  The node may be pulled to another CPU until
+     * its run queue is locked, so this checks again once it has the lock.
+     */
+    CpuRunqueue& lock_node_cpu(RunqueueNode *node)
+    {
+        while (true)
+        {
+            unsigned int cpu = __atomic_load_n(&node->cpu, __ATOMIC_RELAXED);
+            CpuRunqueue& rq = cpus[cpu];
+
+            rq.lock.lock();
+            if (node->cpu == cpu) { return rq; }
+            rq.lock.unlock();
+        }
+    }
+
+    /**
+     * Chooses the CPU a waking entity should run on: the one it last ran on if that is known,
+     * or else the one with the least to do.
+     * @param last_cpu The CPU the entity last ran on, or MAX_CPUS if it is new.
+     */
+    unsigned int select_cpu(unsigned int last_cpu)
+    {
+        if (last_cpu < nr_cpus_online()) { return last_cpu; }
+
+        unsigned int cpu = 0;
+        for (unsigned int i = 1; i < nr_cpus_online(); i++)
+        {
+            if (__atomic_load_n(&cpus[i].nr_running, __ATOMIC_RELAXED) < __atomic_load_n(&cpus[cpu].nr_running, __ATOMIC_RELAXED)) { cpu = i; }
+        }
+        return cpu;
+    }
+
+    /**
+     * Adds a node to its level's run queue on a CPU, whose lock must be held.
+     * @return Returns false if the run queue could not grow to take it.
+     */
+    bool enqueue(CpuRunqueue& rq, RunqueueNode *node)
+    {
+        // a level that has been idle starts level with the others, rather than with a backlog of CPU time
+        if (rq.levels[node->level].empty() && rq.level_vruntime[node->level] < rq.min_level_vruntime)
+        {
+            rq.level_vruntime[node->level] = rq.min_level_vruntime;
+        }
+
+        if (!rq.levels[node->level].insert(node)) { return false; }
+
+        __atomic_store_n(&rq.nr_queued[node->level], rq.levels[node->level].count(), __ATOMIC_RELAXED);
+        __atomic_store_n(&rq.nr_running, rq.nr_running + 1, __ATOMIC_RELAXED);
+        return true;
+    }
+
+    void dequeue(CpuRunqueue& rq, RunqueueNode *node)
+    {
+        rq.levels[node->level].remove(node);
+        __atomic_store_n(&rq.nr_queued[node->level], rq.levels[node->level].count(), __ATOMIC_RELAXED);
+        __atomic_store_n(&rq.nr_running, rq.nr_running - 1, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Returns the number of entities waiting to run at a level on a CPU, not counting the one
+     * it is running.  This is read without the CPU's lock, so it is only a hint.
+     */
+    unsigned int nr_waiting(const CpuRunqueue& rq, unsigned int level) const
+    {
+        unsigned int queued = __atomic_load_n(&rq.nr_queued[level], __ATOMIC_RELAXED);
+
+        if (queued && __atomic_load_n(&rq.current_level, __ATOMIC_RELAXED) == level) { queued--; }
+        return queued;
+    }
+
+    void set_current(CpuRunqueue& rq, RunqueueNode *node)
+    {
+        rq.current = node;
+        __atomic_store_n(&rq.current_level, node ? node->level : 4, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Balances a CPU against the others, by pulling over one entity waiting at the highest
+     * priority level where the busiest CPU has more waiting than this CPU has queued.
+     * @param cpu The CPU to pull work to.
+     */
+    void pull_entity(unsigned int cpu)
+    {
+        CpuRunqueue& dst = cpus[cpu];
+
+        for (unsigned int level = 0; level < (unsigned int)priority_levels_count; level++)
+        {
+            unsigned int queued = __atomic_load_n(&dst.nr_queued[level], __ATOMIC_RELAXED);
+            unsigned int busiest = MAX_CPUS;
+            unsigned int busiest_waiting = queued;
+
+            for (unsigned int i = 0; i < nr_cpus_online(); i++)
+            {
+                if (i == cpu) { continue; }
+
+                unsigned int waiting = nr_waiting(cpus[i], level);
+                if (waiting > busiest_waiting)
+                {
+                    busiest = i;
+                    busiest_waiting = waiting;
+                }
             }
 
-            return min_runtime_entity;
+            if (busiest < MAX_CPUS && migrate_entity(busiest, cpu, level)) { return; }
         }
-        return NULL;
     }
 
-private:
-    const int priority_levels_count = 4;
-    List<SchedulingEntity *> runqueues[4];
-    int consecutive_counts[4] = {0,0,0,0};
-    int consecutive_maxs[4] = {4,3,2,1};
+    /**
+     * Moves one entity that is not running from a level on one CPU to the same level on another.
+     * Its virtual runtime keeps its distance from the level's baseline.
+     * @return Returns true if an entity was moved.
+     */
+    bool migrate_entity(unsigned int from, unsigned int to, unsigned int level)
+    {
+        CpuRunqueue& src = cpus[from];
+        CpuRunqueue& dst = cpus[to];
+
+        // always lock the lower-numbered CPU first
+        UniqueRunqueueLock l1(from < to ? src.lock : dst.lock);
+        UniqueRunqueueLock l2(from < to ? dst.lock : src.lock);
+
+        // check again under the locks, now that nothing can change
+        VruntimeHeap& heap = src.levels[level];
+        bool running_here = src.current && src.current->level == level;
+        if (heap.count() - running_here <= dst.levels[level].count()) { return false; }
+
+        // make room first, so the node is never taken off one CPU with nowhere to go
+        if (!dst.levels[level].reserve()) { return false; }
+
+        RunqueueNode *node = heap.first();
+        if (node == src.current) { node = heap.at(1); }
+
+        dequeue(src, node);
+
+        SchedulingEntity::EntityRuntime lag = 0;
+        if (node->vruntime > src.min_vruntime[level]) { lag = node->vruntime - src.min_vruntime[level]; }
+        node->vruntime = dst.min_vruntime[level] + lag;
+        __atomic_store_n(&node->cpu, to, __ATOMIC_RELAXED);
+
+        enqueue(dst, node);
+        trace(TRACE_MIGRATE, to, node->entity, level);
+        return true;
+    }
+
+    /**
+     * Charges the entity a CPU picked last time for the time it has run since, scaled down by
+     * its weight, and moves it to its new place in its run queue.  The level's baseline only
+     * ever moves forwards, following the least virtual runtime in the queue.  In fair-share
+     * mode the level is charged in the same way, scaled down by its share.
+     */
+    void account_current(CpuRunqueue& rq)
+    {
+        RunqueueNode *current = rq.current;
+        if (!current) { return; }
+
+        SchedulingEntity::EntityRuntime runtime = current->entity->cpu_runtime();
+        SchedulingEntity::EntityRuntime delta = runtime - current->last_runtime;
+        current->vruntime += delta * NICE_0_WEIGHT / current->weight;
+        current->last_runtime = runtime;
+
+        VruntimeHeap& runqueue = rq.levels[current->level];
+        runqueue.update(current);
+
+        SchedulingEntity::EntityRuntime least = runqueue.first()->vruntime;
+        if (least > rq.min_vruntime[current->level]) { rq.min_vruntime[current->level] = least; }
+
+        if (!fair_share_mode) { return; }
+
+        rq.level_vruntime[current->level] += delta * NICE_0_WEIGHT / level_shares[current->level];
+
+        bool found = false;
+        SchedulingEntity::EntityRuntime least_level = 0;
+        for (int i = 0; i < priority_levels_count; i++)
+        {
+            if (rq.levels[i].empty()) { continue; }
+            if (!found || rq.level_vruntime[i] < least_level) { least_level = rq.level_vruntime[i]; }
+            found = true;
+        }
+
+        if (found && least_level > rq.min_level_vruntime) { rq.min_level_vruntime = least_level; }
+    }
     
-    void reset_consecutive_counts()
+    void reset_consecutive_counts(CpuRunqueue& rq)
     {
-        consecutive_counts[0] = 0;
-        consecutive_counts[1] = 0;
-        consecutive_counts[2] = 0;
-        consecutive_counts[3] = 0;
+        rq.consecutive_counts[0] = 0;
+        rq.consecutive_counts[1] = 0;
+        rq.consecutive_counts[2] = 0;
+        rq.consecutive_counts[3] = 0;
     }
 };
 
@@ -0,0 +1,677 @@
+/*
+ * Scheduler infrastructure shared by the priority schedulers in sched-mq.cpp and sched-adv.cpp:
+ * run queue locks, counters and tracing, the per-CPU wakeup queues, the deadline class, and the
+ * sharded tables of per-entity records.
+ */
+#pragma once
+
+#include <infos/kernel/sched.h>
+#include <infos/util/lock.h>
+
+#include "slab.h"
+
+using namespace infos::kernel;
+using namespace infos::util;
+
+#define MAX_CPUS            8
+
+/* The number of records in each CPU's trace ring buffer.  This must be a power of two. */
+#define TRACE_RING_SIZE     4096
+
+/* The number of buckets in the scheduler's log2 latency histograms. */
+#define LATENCY_BUCKETS     32
+
+/* Deadline entities may reserve at most this percentage of each CPU, leaving the rest to the priority levels. */
+#define DEADLINE_BANDWIDTH_PERCENT  95
+
+/* CPU bandwidths are fixed-point fractions of a CPU, with this many fractional bits. */
+#define BANDWIDTH_SHIFT     20
+
+/* The most deadline entities each CPU admits, which sizes its deadline heaps up front. */
+#define DEADLINE_MAX_ENTITIES   64
+
+/* The number of wakeups each CPU's wakeup queue can hold.  This must be a power of two. */
+#define WAKEUP_QUEUE_SIZE   256
+
+/* The number of shards the per-entity tables are split into, each with its own lock.  This must
+ * be a power of two, and at most 256. */
+#define ENTITY_SHARDS       16
+
+/**
+ * Returns the index of the CPU we are running on.  InfOS only brings up the boot processor,
+ * so for now this is always zero.
+ */
+static inline unsigned int current_cpu()
+{
+    return 0;
+}
+
+/**
+ * Returns the number of CPUs that are running, and so picking entities from their run queues.
+ */
+static inline unsigned int nr_cpus_online()
+{
+    return 1;
+}
+
+/**
+ * A test-and-set spin lock, guarding a run queue or other scheduler state shared between CPUs.
+ * Interrupts must already be disabled when it is taken.
+ */
+class RunqueueLock
+{
+public:
+    void lock()
+    {
+        while (__atomic_test_and_set(&_locked, __ATOMIC_ACQUIRE)) {
+            while (__atomic_load_n(&_locked, __ATOMIC_RELAXED)) { __builtin_ia32_pause(); }
+        }
+    }
+
+    void unlock() { __atomic_clear(&_locked, __ATOMIC_RELEASE); }
+
+    /**
+     * @return Returns true if the lock was held at some point during the call.
+     */
+    bool locked() const { return __atomic_load_n(&_locked, __ATOMIC_ACQUIRE); }
+
+private:
+    bool _locked = false;
+};
+
+/**
+ * Holds a run queue lock for as long as it is in scope.
+ */
+class UniqueRunqueueLock
+{
+public:
+    UniqueRunqueueLock(RunqueueLock& lock) : _lock(lock) { _lock.lock(); }
+    ~UniqueRunqueueLock() { _lock.unlock(); }
+
+private:
+    RunqueueLock& _lock;
+};
+
+/**
+ * Reads the CPU's cycle counter, for cheap latency measurements.
+ */
+static inline uint64_t read_cycle_counter()
+{
+    return __builtin_ia32_rdtsc();
+}
+
+/**
+ * Adds to one of the counters, which other CPUs may be reading at the same time.
+ * @param counter The counter.
+ * @param delta The amount to add.
+ */
+static inline void stat_add(uint64_t& counter, uint64_t delta)
+{
+    __atomic_fetch_add(&counter, delta, __ATOMIC_RELAXED);
+}
+
+/**
+ * Adds a number of cycles to a log2 latency histogram, in which bucket i counts latencies of
+ * less than 2^(i+1) cycles.
+ */
+static inline void record_latency(uint64_t *histogram, uint64_t cycles)
+{
+    unsigned int bucket = 63 - __builtin_clzll(cycles | 1);
+    stat_add(histogram[bucket < LATENCY_BUCKETS ? bucket : LATENCY_BUCKETS - 1], 1);
+}
+
+/**
+ * The events the scheduler can trace.
+ */
+enum SchedTraceEvent
+{
+    TRACE_ENQUEUE = 0,      // an entity became runnable
+    TRACE_DEQUEUE,          // an entity stopped being runnable
+    TRACE_PICK,             // an entity was picked to run
+    TRACE_IDLE,             // there was nothing to run
+    TRACE_MIGRATE,          // an entity was pulled to the recorded CPU
+    TRACE_PICK_DEADLINE,    // a deadline entity was picked to run, recorded at level 4
+    TRACE_THROTTLE,         // a deadline entity ran out of budget, recorded at level 4
+};
+
+/**
+ * A single trace record, in the binary format the trace is exported in.
+ */
+struct SchedTraceRecord
+{
+    uint64_t timestamp;     // the cycle counter of the CPU that recorded it
+    uint64_t entity;        // the address of the entity, to tell entities apart, or 0 if there is none
+    uint32_t queued;        // the number of entities queued at the level afterwards
+    uint8_t event;
+    uint8_t level;
+    uint8_t cpu;            // the CPU whose run queue the event was on
+    uint8_t reserved;
+};
+
+/**
+ * A per-CPU ring buffer of trace records.  Only the owning CPU adds records, with interrupts
+ * disabled, and a reader on any CPU can take them out at the same time.  When the ring is full,
+ * new records are dropped and counted as lost, so the writer never moves the reader's tail.
+ */
+struct SchedTraceRing
+{
+    SchedTraceRecord records[TRACE_RING_SIZE];
+    uint64_t head, tail, lost;
+};
+
+/**
+ * Counters kept by each CPU as it schedules, which can be read at any time.
+ */
+struct SchedCpuStats
+{
+    uint64_t picks;
+    uint64_t context_switches;
+    uint64_t queued_sum[4];                     // queue length at each level, summed over every pick
+    uint64_t budget_forced[4];                  // picks at a level while a higher level had work waiting, which
+                                                // only adv's slice budgets do; mq always runs the highest level
+    uint64_t wakeup_latency[LATENCY_BUCKETS];   // cycles from becoming runnable to first running
+};
+
+/**
+ * A snapshot of the scheduler's counters, summed over every CPU.
+ */
+struct SchedTelemetry
+{
+    uint64_t timestamp;                         // the cycle counter when the snapshot was taken
+    uint64_t queued[4];                         // entities queued at each level now
+    uint64_t picks;
+    uint64_t context_switches;
+    uint64_t queued_sum[4];
+    uint64_t budget_forced[4];
+    uint64_t wakeup_latency[LATENCY_BUCKETS];
+    uint64_t trace_lost;
+};
+
+/**
+ * Adds a record to a trace ring, if there is room for it.
+ */
+static inline void trace_ring_push(SchedTraceRing& ring, const SchedTraceRecord& record)
+{
+    uint64_t head = ring.head;
+    if (head - __atomic_load_n(&ring.tail, __ATOMIC_ACQUIRE) == TRACE_RING_SIZE)
+    {
+        __atomic_store_n(&ring.lost, ring.lost + 1, __ATOMIC_RELAXED);
+        return;
+    }
+
+    ring.records[head & (TRACE_RING_SIZE - 1)] = record;
+    __atomic_store_n(&ring.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Takes records out of a trace ring, oldest first.  Only one reader may use a ring at a time.
+ * @return Returns the number of records copied.
+ */
+static inline unsigned int trace_ring_read(SchedTraceRing& ring, SchedTraceRecord *records, unsigned int max)
+{
+    uint64_t tail = ring.tail;
+    uint64_t head = __atomic_load_n(&ring.head, __ATOMIC_ACQUIRE);
+
+    unsigned int copied = 0;
+    while (copied < max && tail != head)
+    {
+        records[copied++] = ring.records[tail & (TRACE_RING_SIZE - 1)];
+        tail++;
+    }
+
+    __atomic_store_n(&ring.tail, tail, __ATOMIC_RELEASE);
+    return copied;
+}
+
+/**
+ * A bounded queue of entities that have woken up, which any CPU can push onto without taking a
+ * lock or disabling interrupts, even from an interrupt handler.  Each cell's sequence number
+ * says whether it is free for the push at its position, or holds a wakeup ready to be taken out.
+ * Wakeups are taken out by one CPU at a time, which holds the queue's lock until they have all
+ * been made runnable.
+ */
+struct WakeupQueue
+{
+    struct Cell
+    {
+        uint64_t sequence;
+        SchedulingEntity *entity;
+        uint64_t wake_time;     // the cycle counter when it was pushed
+    };
+
+    WakeupQueue()
+    {
+        for (unsigned int i = 0; i < WAKEUP_QUEUE_SIZE; i++) { cells[i].sequence = i; }
+    }
+
+    Cell cells[WAKEUP_QUEUE_SIZE];
+    uint64_t head = 0;          // the position of the next push, claimed by pushers
+    uint64_t tail = 0;          // the position of the next wakeup to take out
+    RunqueueLock lock;
+};
+
+/**
+ * Pushes a wakeup onto a wakeup queue.
+ * @return Returns false if the queue is full.
+ */
+static inline bool wakeup_queue_push(WakeupQueue& queue, SchedulingEntity *entity, uint64_t wake_time)
+{
+    uint64_t pos = __atomic_load_n(&queue.head, __ATOMIC_RELAXED);
+    WakeupQueue::Cell *cell;
+
+    while (true)
+    {
+        cell = &queue.cells[pos & (WAKEUP_QUEUE_SIZE - 1)];
+        int64_t lag = (int64_t)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+
+        // the cell still holds the wakeup from a lap ago
+        if (lag < 0) { return false; }
+
+        if (lag > 0) { pos = __atomic_load_n(&queue.head, __ATOMIC_RELAXED); }
+        else if (__atomic_compare_exchange_n(&queue.head, &pos, pos + 1, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) { break; }
+    }
+
+    cell->entity = entity;
+    cell->wake_time = wake_time;
+    __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * Takes the oldest wakeup out of a wakeup queue.  The queue's lock must be held.
+ * @return Returns false if there is no wakeup at the tail, or its pusher has not finished writing it.
+ */
+static inline bool wakeup_queue_pop(WakeupQueue& queue, SchedulingEntity *& entity, uint64_t& wake_time)
+{
+    uint64_t pos = queue.tail;
+    WakeupQueue::Cell& cell = queue.cells[pos & (WAKEUP_QUEUE_SIZE - 1)];
+    if (__atomic_load_n(&cell.sequence, __ATOMIC_ACQUIRE) != pos + 1) { return false; }
+
+    entity = cell.entity;
+    wake_time = cell.wake_time;
+    __atomic_store_n(&cell.sequence, pos + WAKEUP_QUEUE_SIZE, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue.tail, pos + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+/**
+ * @return Returns true if nothing has been pushed onto a wakeup queue that has not been taken out.
+ */
+static inline bool wakeup_queue_empty(const WakeupQueue& queue)
+{
+    return __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE) == __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Returns the shard of the per-entity tables an entity belongs to.  This uses the top bits of its
+ * hash, since the tables pick slots with the bits below.
+ */
+static inline unsigned int entity_shard(const SchedulingEntity *entity)
+{
+    uint64_t key = (uint64_t)(uintptr_t)entity;
+    return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 56) & (ENTITY_SHARDS - 1);
+}
+
+/**
+ * Returns the time that deadlines are measured against.  Deadline parameters are in the same
+ * units, which are cycles of the CPU's cycle counter.
+ */
+static inline uint64_t sched_clock()
+{
+    return read_cycle_counter();
+}
+
+/**
+ * Allocates one of the scheduler's records, zeroed.  Records come from the slab caches, so that
+ * waking and sleeping threads do not go through the kernel heap, but the slab caches only exist
+ * while the buddy allocator is the page allocator, so otherwise they come from the kernel heap.
+ * @tparam T The type of record, which has a from_heap member.
+ * @return Returns the record, or NULL if memory ran out.
+ */
+template<typename T>
+static inline T *alloc_record()
+{
+    T *record = (T *)slab_alloc(sizeof(T));
+    if (record)
+    {
+        *record = T();
+        return record;
+    }
+
+    record = new T();
+    if (record) { record->from_heap = true; }
+    return record;
+}
+
+/**
+ * Frees a record allocated by alloc_record(), back to wherever it came from.
+ */
+template<typename T>
+static inline void free_record(T *record)
+{
+    if (record->from_heap) { delete record; }
+    else { slab_free(record, sizeof(T)); }
+}
+
+/**
+ * An entity in the deadline class, which has asked for runtime units of CPU time within deadline
+ * units of the start of every period.  It is kept while the entity sleeps, and it always runs on
+ * the CPU its bandwidth was reserved on.
+ */
+struct DeadlineEntity
+{
+    SchedulingEntity *entity;
+    uint64_t runtime;
+    uint64_t deadline;
+    uint64_t period;
+    uint64_t bandwidth;         // runtime / deadline, as a fixed-point fraction of a CPU
+    unsigned int cpu;
+
+    uint64_t abs_deadline;      // when the runtime of the current period must have been delivered
+    uint64_t next_period;       // when the next period starts, and the budget is refilled
+    uint64_t budget;            // runtime left in the current period
+    uint64_t wake_time;         // the cycle counter when it became runnable, or 0 once it has run
+    bool queued;
+    bool throttled;             // out of budget, and not runnable until next_period
+    unsigned int heap_index;
+    bool from_heap;             // allocated from the kernel heap rather than a slab cache
+};
+
+/**
+ * A binary min-heap of deadline entities, ordered by one of their times.  It has room for every
+ * entity its CPU admits, so waking and throttling entities never allocate.
+ * @tparam Key The time the heap is ordered by.
+ */
+template<uint64_t DeadlineEntity::*Key>
+class DeadlineHeap
+{
+public:
+    bool empty() const { return _count == 0; }
+
+    /**
+     * @return Returns the entity with the earliest time, or NULL if the heap is empty.
+     */
+    DeadlineEntity *first() const { return _count ? _entities[0] : NULL; }
+
+    void insert(DeadlineEntity *entity)
+    {
+        entity->heap_index = _count;
+        _entities[_count++] = entity;
+        sift_up(entity->heap_index);
+    }
+
+    void remove(DeadlineEntity *entity)
+    {
+        unsigned int i = entity->heap_index;
+
+        _count--;
+        if (i == _count) { return; }
+
+        place(_entities[_count], i);
+        sift_up(i);
+        sift_down(_entities[i]->heap_index);
+    }
+
+private:
+    void place(DeadlineEntity *entity, unsigned int i)
+    {
+        _entities[i] = entity;
+        entity->heap_index = i;
+    }
+
+    void sift_up(unsigned int i)
+    {
+        DeadlineEntity *entity = _entities[i];
+        while (i > 0)
+        {
+            unsigned int parent = (i - 1) / 2;
+            if (_entities[parent]->*Key <= entity->*Key) { break; }
+
+            place(_entities[parent], i);
+            i = parent;
+        }
+        place(entity, i);
+    }
+
+    void sift_down(unsigned int i)
+    {
+        DeadlineEntity *entity = _entities[i];
+        while (true)
+        {
+            unsigned int child = i * 2 + 1;
+            if (child >= _count) { break; }
+            if (child + 1 < _count && _entities[child + 1]->*Key < _entities[child]->*Key) { child++; }
+            if (entity->*Key <= _entities[child]->*Key) { break; }
+
+            place(_entities[child], i);
+            i = child;
+        }
+        place(entity, i);
+    }
+
+    DeadlineEntity *_entities[DEADLINE_MAX_ENTITIES];
+    unsigned int _count = 0;
+};
+
+/**
+ * The deadline entities of one CPU.  Runnable entities with budget left are picked earliest
+ * deadline first, and those that have run out wait in order of when their budget is refilled.
+ */
+struct DeadlineRunqueue
+{
+    DeadlineHeap<&DeadlineEntity::abs_deadline> ready;
+    DeadlineHeap<&DeadlineEntity::next_period> throttled;
+    DeadlineEntity *running = NULL;
+    uint64_t running_since = 0;
+};
+
+/**
+ * Returns the share of a CPU that runtime units of CPU time within every deadline units
+ * reserves, as a fixed-point fraction with BANDWIDTH_SHIFT fractional bits.  The runtime is
+ * shifted in 128 bits, so long runtimes do not overflow.
+ * @param runtime The runtime, which must be no more than the deadline.
+ * @param deadline The deadline, which must not be zero.
+ */
+static inline uint64_t deadline_bandwidth(uint64_t runtime, uint64_t deadline)
+{
+    return (uint64_t)(((unsigned __int128)runtime << BANDWIDTH_SHIFT) / deadline);
+}
+
+/**
+ * Makes a deadline entity runnable.  If it is out of budget it waits for its next period.
+ * Otherwise it starts a new period, unless the current one has time left and running the rest
+ * of its budget before the deadline would stay within its bandwidth.
+ */
+static inline void deadline_enqueue(DeadlineRunqueue& dl, DeadlineEntity *de, uint64_t now)
+{
+    de->queued = true;
+
+    if (de->throttled && now < de->next_period)
+    {
+        dl.throttled.insert(de);
+        return;
+    }
+
+    // budget / (abs_deadline - now) > runtime / deadline, cross-multiplied in 128 bits, since
+    // the products of two times in cycles can overflow 64 bits
+    if (now >= de->abs_deadline
+        || (unsigned __int128)de->budget * de->deadline > (unsigned __int128)(de->abs_deadline - now) * de->runtime)
+    {
+        de->abs_deadline = now + de->deadline;
+        de->next_period = now + de->period;
+        de->budget = de->runtime;
+    }
+
+    de->throttled = false;
+    dl.ready.insert(de);
+}
+
+static inline void deadline_dequeue(DeadlineRunqueue& dl, DeadlineEntity *de)
+{
+    if (de->throttled) { dl.throttled.remove(de); }
+    else { dl.ready.remove(de); }
+
+    if (dl.running == de) { dl.running = NULL; }
+    de->queued = false;
+}
+
+/**
+ * Charges the deadline entity a CPU was running for the time since it was last charged, and
+ * throttles it if its budget has run out.
+ * @return Returns the entity if it was throttled, or NULL.
+ */
+static inline DeadlineEntity *deadline_charge(DeadlineRunqueue& dl, uint64_t now)
+{
+    DeadlineEntity *de = dl.running;
+    if (!de) { return NULL; }
+
+    uint64_t used = now - dl.running_since;
+    de->budget -= used < de->budget ? used : de->budget;
+    dl.running_since = now;
+
+    if (de->budget) { return NULL; }
+
+    dl.ready.remove(de);
+    de->throttled = true;
+    dl.throttled.insert(de);
+    dl.running = NULL;
+    return de;
+}
+
+/**
+ * Refills the budget of every throttled deadline entity whose next period has started.
+ */
+static inline void deadline_replenish(DeadlineRunqueue& dl, uint64_t now)
+{
+    DeadlineEntity *de;
+    while ((de = dl.throttled.first()) && de->next_period <= now)
+    {
+        dl.throttled.remove(de);
+
+        // after a long gap, start afresh rather than catching up on missed periods
+        if (de->next_period + de->period <= now) { de->next_period = now; }
+
+        de->abs_deadline = de->next_period + de->deadline;
+        de->next_period += de->period;
+        de->budget = de->runtime;
+        de->throttled = false;
+        dl.ready.insert(de);
+    }
+}
+
+/**
+ * An open-addressing hash table from scheduling entities to records about them, which point back
+ * to their entity.  Slots are probed linearly, and removal shifts later entries back into the
+ * gap, so there are no tombstones and lookups stay short.
+ * @tparam T The type of record, which has an entity member.
+ */
+template<typename T>
+class EntityTable
+{
+public:
+    ~EntityTable() { delete[] _slots; }
+
+    /**
+     * Looks up the record for an entity.
+     * @param entity The entity.
+     * @return Returns the record, or NULL if the entity is not in the table.
+     */
+    T *find(const SchedulingEntity *entity) const
+    {
+        if (!_capacity) { return NULL; }
+
+        for (unsigned int i = slot_of(entity); _slots[i]; i = (i + 1) & (_capacity - 1))
+        {
+            if (_slots[i]->entity == entity) { return _slots[i]; }
+        }
+        return NULL;
+    }
+
+    /**
+     * Adds a record, whose entity must not already be in the table.
+     * @param record The record.
+     * @return Returns false if the table was full and memory ran out, leaving the record out.
+     */
+    bool insert(T *record)
+    {
+        // keep the table at most half full
+        if ((_count + 1) * 2 > _capacity && !grow()) { return false; }
+
+        place(record);
+        _count++;
+        return true;
+    }
+
+    /**
+     * Removes the record for an entity, if there is one.
+     * @param entity The entity.
+     */
+    void remove(const SchedulingEntity *entity)
+    {
+        if (!_capacity) { return; }
+
+        unsigned int i = slot_of(entity);
+        while (_slots[i] && _slots[i]->entity != entity) { i = (i + 1) & (_capacity - 1); }
+        if (!_slots[i]) { return; }
+
+        // shift back every entry after the gap that would otherwise no longer be found
+        unsigned int gap = i;
+        for (unsigned int j = (i + 1) & (_capacity - 1); _slots[j]; j = (j + 1) & (_capacity - 1))
+        {
+            unsigned int home = slot_of(_slots[j]->entity);
+            if (((j - home) & (_capacity - 1)) >= ((j - gap) & (_capacity - 1)))
+            {
+                _slots[gap] = _slots[j];
+                gap = j;
+            }
+        }
+
+        _slots[gap] = NULL;
+        _count--;
+    }
+
+private:
+    unsigned int slot_of(const SchedulingEntity *entity) const
+    {
+        uint64_t key = (uint64_t)(uintptr_t)entity;
+        return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) & (_capacity - 1);
+    }
+
+    void place(T *record)
+    {
+        unsigned int i = slot_of(record->entity);
+        while (_slots[i]) { i = (i + 1) & (_capacity - 1); }
+
+        _slots[i] = record;
+    }
+
+    /**
+     * Doubles the table's capacity.  The old slots are only let go once the new ones exist.
+     * @return Returns false if memory ran out, leaving the table as it was.
+     */
+    bool grow()
+    {
+        unsigned int capacity = _capacity ? _capacity * 2 : 64;
+        T **slots = new T *[capacity];
+        if (!slots) { return false; }
+
+        for (unsigned int i = 0; i < capacity; i++) { slots[i] = NULL; }
+
+        T **old_slots = _slots;
+        unsigned int old_capacity = _capacity;
+        _slots = slots;
+        _capacity = capacity;
+
+        for (unsigned int i = 0; i < old_capacity; i++)
+        {
+            if (old_slots[i]) { place(old_slots[i]); }
+        }
+
+        delete[] old_slots;
+        return true;
+    }
+
+    T **_slots = NULL;
+    unsigned int _capacity = 0;
+    unsigned int _count = 0;
+};
\ No newline at end of file
@@ -6,13 +6,153 @@
 #include <infos/kernel/sched.h>
 #include <infos/kernel/thread.h>
 #include <infos/kernel/log.h>
-#include <infos/util/list.h>
+#include <infos/kernel/cmdline.h>
 #include <infos/util/lock.h>
+#include <infos/util/string.h>
 #include <infos/util/map.h>
 
+#include "sched-common.h"
+
 using namespace infos::kernel;
 using namespace infos::util;
 
+#define BALANCE_INTERVAL    32
+#define WAKE_HINTS          256
+
+/* In MLFQ mode, the unit timeslices are measured in, as CPU time in the units of cpu_runtime(),
+ * which are nanoseconds. */
+#define MLFQ_QUANTUM        1000000ULL
+
+/* In MLFQ mode, the CPU time each CPU runs between boosts of every entity up to interactive. */
+#define MLFQ_BOOST_INTERVAL (250 * MLFQ_QUANTUM)
+
+/**
+ * Remembers the CPU and run queue level an entity was on when it left the run queues, and
+ * whether it had used up its slice, so that it can go back there when it wakes up.  The cache
+ * is direct-mapped, and a collision just loses the hint.  CPUs may record and look up hints at
+ * the same time, so a hint read while it is being replaced can belong to another entity, which
+ * only costs a poorer placement.
+ */
+class WakeHints
+{
+public:
+    void record(const SchedulingEntity *entity, unsigned int cpu, unsigned int level, bool slice_used)
+    {
+        Hint& hint = _hints[slot_of(entity)];
+        __atomic_store_n(&hint.entity, entity, __ATOMIC_RELAXED);
+        __atomic_store_n(&hint.cpu, cpu, __ATOMIC_RELAXED);
+        __atomic_store_n(&hint.level, level, __ATOMIC_RELAXED);
+        __atomic_store_n(&hint.slice_used, slice_used, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Looks up where an entity was when it last left the run queues.
+     * @param entity The entity.
+     * @param cpu Set to the CPU it was on.
+     * @param level Set to the level it was at.
+     * @param slice_used Set to true if it had used up its slice, or was not running at all.
+     * @return Returns true if this is known.
+     */
+    bool lookup(const SchedulingEntity *entity, unsigned int& cpu, unsigned int& level, bool& slice_used) const
+    {
+        const Hint& hint = _hints[slot_of(entity)];
+        if (__atomic_load_n(&hint.entity, __ATOMIC_RELAXED) != entity) { return false; }
+
+        cpu = __atomic_load_n(&hint.cpu, __ATOMIC_RELAXED);
+        level = __atomic_load_n(&hint.level, __ATOMIC_RELAXED);
+        slice_used = __atomic_load_n(&hint.slice_used, __ATOMIC_RELAXED);
+        return true;
+    }
+
+private:
+    struct Hint
+    {
+        const SchedulingEntity *entity;
+        unsigned int cpu;
+        unsigned int level;
+        bool slice_used;
+    };
+
+    static unsigned int slot_of(const SchedulingEntity *entity)
+    {
+        uint64_t key = (uint64_t)(uintptr_t)entity;
+        return (unsigned int)((key * 0x9e3779b97f4a7c15ULL) >> 32) % WAKE_HINTS;
+    }
+
+    Hint _hints[WAKE_HINTS] = {};
+};
+
+/* Whether threads move between levels by how they use the CPU, from the "sched.mq.mode"
+ * argument, rather than staying at their own priority. */
+static bool mlfq_mode;
+
+/* In MLFQ mode, the CPU time an entity runs for at each level before another is picked, in
+ * quanta.  Lower levels hold mostly CPU-bound threads, so they get longer slices and switch
+ * less often. */
+static const unsigned int mlfq_timeslices[4] = {1, 2, 4, 8};
+
+RegisterCmdLineArgument(SchedMQMode, "sched.mq.mode")
+{
+    mlfq_mode = strcmp(value, "mlfq") == 0;
+}
+
+/**
+ * Links a runnable entity into the circular run queue for its priority level.
+ */
+struct RunqueueLink
+{
+    SchedulingEntity *entity;
+    RunqueueLink *prev;
+    RunqueueLink *next;
+    unsigned int level;
+    unsigned int cpu;
+    uint64_t wake_time;     // the cycle counter when it became runnable, or 0 once it has run
+    SchedulingEntity::EntityRuntime level_runtime;  // in MLFQ mode, the CPU time it has run at its level
+    bool from_heap;         // allocated from the kernel heap rather than a slab cache
+};
+
+/**
+ * One shard of the scheduler's records of entities.  Entities are spread over the shards by
+ * address, and each shard has its own lock, so CPUs waking and putting to sleep different
+ * entities rarely wait for each other.
+ */
+struct LinkShard
+{
+    RunqueueLock lock;
+    EntityTable<RunqueueLink> links;
+    EntityTable<DeadlineEntity> deadlines;
+    RunqueueLink *free_links = NULL;
+};
+
+/**
+ * The run queues of one CPU, one per priority level.
+ */
+struct CpuLinkRunqueue
+{
+    RunqueueLock lock;
+    RunqueueLink *levels[4] = {NULL,NULL,NULL,NULL};
+    unsigned int nonempty_levels = 0;
+    RunqueueLink *current = NULL;
+
+    // read without the lock by other CPUs looking for work
+    unsigned int nr_queued[4] = {0,0,0,0};
+    unsigned int nr_running = 0;
+    unsigned int current_level = 4;
+
+    unsigned int picks = 0;
+
+    // in MLFQ mode, slices and boosts follow the CPU time run here, rather than the number of picks
+    SchedulingEntity::EntityRuntime busy_time = 0;
+    SchedulingEntity::EntityRuntime last_runtime = 0;   // the current entity's cpu_runtime() when it was last charged
+    SchedulingEntity::EntityRuntime next_boost = MLFQ_BOOST_INTERVAL;
+
+    SchedCpuStats stats = {};
+    DeadlineRunqueue dl;
+
+    // entities woken on this CPU, made runnable at its next pick
+    WakeupQueue wakeups;
+};
+
 /**
  * A Multiple Queue priority scheduling algorithm
  */
@@ -38,29 +178,15 @@ public:
      */
     void add_to_runqueue(SchedulingEntity& entity) override
     {
-        UniqueIRQLock l;
-        switch (entity.priority())
-        {
-            case SchedulingEntityPriority::REALTIME:
-                runqueues[SchedulingEntityPriority::REALTIME].enqueue(&entity);
-                break;
-            
-            case SchedulingEntityPriority::INTERACTIVE:
-                runqueues[SchedulingEntityPriority::INTERACTIVE].enqueue(&entity);
-                break;
+        // this takes no locks, so it is safe from any context, and the entity is made runnable
+        // at this CPU's next pick
+        if (wakeup_queue_push(cpus[current_cpu()].wakeups, &entity, read_cycle_counter())) { return; }
 
-            case SchedulingEntityPriority::NORMAL:
-                runqueues[SchedulingEntityPriority::NORMAL].enqueue(&entity);
-                break;
-
-            case SchedulingEntityPriority::DAEMON:
-                runqueues[SchedulingEntityPriority::DAEMON].enqueue(&entity);
-                break;
-            
-            default:
-                syslog.messagef(LogLevel::DEBUG, "Thread priority unknown ?");
-                break;
-        }
+        // the queue is full, so make the entity runnable now
+        UniqueIRQLock l;
+        LinkShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+        enqueue_entity(entity, read_cycle_counter());
     }
 
     /**
@@ -70,17 +196,17 @@ public:
     void remove_from_runqueue(SchedulingEntity& entity) override
     {
         UniqueIRQLock l;
-        List<SchedulingEntity *> * runqueue;
-        unsigned int pre;
 
-        for (int i = 0; i < 4; i++)
-        {
-            runqueue = &runqueues[i];
-           
-            pre = runqueue->count();
-            runqueue->remove(&entity);
-            if (runqueue->count() < pre) { return; }
-        }
+        // a wakeup from before the entity stopped being runnable must not take effect after it
+        flush_wakeups();
+
+        LinkShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+        dequeue_entity(entity);
+
+        // a stopped thread will not run again, so give back any bandwidth it reserved
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de && entity.state() == SchedulingEntityState::STOPPED) { release_deadline(de); }
     }
 
     /**
@@ -90,29 +216,798 @@ public:
      */
     SchedulingEntity *pick_next_entity() override
     {
-        List<SchedulingEntity *> * runqueue;
+        UniqueIRQLock l;
+        unsigned int cpu = current_cpu();
+        CpuLinkRunqueue& rq = cpus[cpu];
 
-        for (int i = 0; i < 4; i++)
+        // make every entity woken since the last pick runnable, in one batch
+        if (!wakeup_queue_empty(rq.wakeups)) { drain_wakeups(cpu); }
+
+        // an idle CPU looks for work every time, a busy one only now and then
+        rq.picks++;
+        if (__atomic_load_n(&rq.nr_running, __ATOMIC_RELAXED) == 0 || rq.picks % BALANCE_INTERVAL == 0)
         {
-            runqueue = &runqueues[i];
+            pull_entity(cpu);
+        }
+
+        UniqueRunqueueLock rl(rq.lock);
+        charge_current(rq);
+
+        // deadline entities with budget left run ahead of every level, earliest deadline first
+        uint64_t now = sched_clock();
+        DeadlineEntity *throttled = deadline_charge(rq.dl, now);
+        if (throttled) { trace(TRACE_THROTTLE, cpu, throttled->entity, 4); }
+        deadline_replenish(rq.dl, now);
+
+        DeadlineEntity *de = rq.dl.ready.first();
+        if (de)
+        {
+            set_current(rq, NULL);
+            account_deadline_pick(cpu, de, now);
+            return de->entity;
+        }
+        rq.dl.running = NULL;
+
+        RunqueueLink *previous = rq.current;
 
-            if (runqueue->empty())
+        if (mlfq_mode)
+        {
+            if (rq.busy_time >= rq.next_boost)
             {
-                if (i < 3) { continue; }
-                else { return NULL; }
+                boost(rq);
+                rq.next_boost = rq.busy_time + MLFQ_BOOST_INTERVAL;
             }
 
-            if (runqueue->count() == 1) { return runqueue->first(); }
+            if (previous)
+            {
+                // keep running until the slice is used up, unless something more important is
+                // waiting.  Being preempted does not give the entity a fresh slice, or entities
+                // that are often preempted would never sink.
+                bool slice_left = previous->level_runtime < mlfq_timeslices[previous->level] * MLFQ_QUANTUM;
+                if (slice_left && (unsigned int)__builtin_ctz(rq.nonempty_levels) >= previous->level)
+                {
+                    account_pick(cpu, previous, previous);
+                    return previous->entity;
+                }
+
+                if (!slice_left) { demote(rq, previous); }
+            }
+        }
 
-            SchedulingEntity *next = runqueue->pop();
-            runqueue->enqueue(next);
-            return next;
+        if (!rq.nonempty_levels)
+        {
+            set_current(rq, NULL);
+            account_pick(cpu, previous, NULL);
+            return NULL;
+        }
+
+        // the lowest set bit is the highest priority level with something to run
+        unsigned int level = __builtin_ctz(rq.nonempty_levels);
+
+        // run the head, and rotate it to the back of its queue
+        RunqueueLink *next = rq.levels[level];
+        rq.levels[level] = next->next;
+        set_current(rq, next);
+        rq.last_runtime = next->entity->cpu_runtime();
+        account_pick(cpu, previous, next);
+        return next->entity;
+    }
+
+    /**
+     * Puts an entity in the deadline class, where it is guaranteed runtime units of CPU time
+     * within deadline units of the start of every period, ahead of every priority level.  It
+     * is throttled once it has used its runtime for the period, so it cannot take more than
+     * its share.  The request is only admitted if a CPU has enough bandwidth left unreserved.
+     * Times are in the units of sched_clock().
+     * @param entity The entity.
+     * @param runtime The CPU time needed in each period.
+     * @param deadline The time from the start of each period by which the runtime is needed.
+     * @param period The time between the starts of periods.
+     * @return Returns true if the entity was admitted, or false if the parameters are invalid,
+     * no CPU has the bandwidth or room left for it, or memory ran out.
+     */
+    bool set_deadline(SchedulingEntity& entity, uint64_t runtime, uint64_t deadline, uint64_t period)
+    {
+        if (!runtime || runtime > deadline || deadline > period) { return false; }
+        uint64_t bandwidth = deadline_bandwidth(runtime, deadline);
+
+        UniqueIRQLock l;
+        LinkShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+
+        // a new record is made before admission, so running out of memory leaves nothing reserved
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        DeadlineEntity *created = NULL;
+        if (!de)
+        {
+            created = alloc_record<DeadlineEntity>();
+            if (!created) { return false; }
+
+            created->entity = &entity;
+            if (!shard.deadlines.insert(created))
+            {
+                free_record(created);
+                return false;
+            }
+        }
+
+        unsigned int cpu = admit_deadline(de, bandwidth);
+        if (cpu >= MAX_CPUS)
+        {
+            if (created)
+            {
+                shard.deadlines.remove(&entity);
+                free_record(created);
+            }
+            return false;
+        }
+
+        bool queued = dequeue_entity(entity);
+        if (created) { de = created; }
+
+        de->runtime = runtime;
+        de->deadline = deadline;
+        de->period = period;
+        de->bandwidth = bandwidth;
+        de->cpu = cpu;
+        de->abs_deadline = 0;
+        de->budget = 0;
+        de->throttled = false;
+
+        if (queued) { enqueue_entity(entity, read_cycle_counter()); }
+        return true;
+    }
+
+    /**
+     * Takes an entity out of the deadline class, back to its priority level, and gives back
+     * the bandwidth it reserved.
+     * @param entity The entity.
+     */
+    void clear_deadline(SchedulingEntity& entity)
+    {
+        UniqueIRQLock l;
+        LinkShard& shard = shard_of(entity);
+        UniqueRunqueueLock sl(shard.lock);
+
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (!de) { return; }
+
+        bool queued = dequeue_entity(entity);
+        release_deadline(de);
+        if (queued) { enqueue_entity(entity, read_cycle_counter()); }
+    }
+
+    /**
+     * Turns tracing of run queue events on or off.
+     * @param enabled TRUE to record events in the per-CPU trace ring buffers.
+     */
+    void set_tracing(bool enabled)
+    {
+        __atomic_store_n(&tracing, enabled, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Exports trace records from a CPU's trace ring buffer, oldest first, removing them from
+     * the ring.  This can be called from any CPU while tracing carries on.
+     * @param cpu The CPU whose ring to read.
+     * @param records The array to copy the records into.
+     * @param max The number of records the array has room for.
+     * @return Returns the number of records copied.
+     */
+    unsigned int read_trace(unsigned int cpu, SchedTraceRecord *records, unsigned int max)
+    {
+        if (cpu >= MAX_CPUS) { return 0; }
+
+        UniqueIRQLock l;
+        UniqueRunqueueLock tl(trace_read_lock);
+        return trace_ring_read(trace_rings[cpu], records, max);
+    }
+
+    /**
+     * Takes a snapshot of the scheduler's counters, summed over every CPU.  This can be called
+     * from any CPU at any time, and rates come from the difference between two snapshots.
+     * @param telemetry The snapshot to fill in.
+     */
+    void read_telemetry(SchedTelemetry& telemetry)
+    {
+        memset(&telemetry, 0, sizeof(telemetry));
+        telemetry.timestamp = read_cycle_counter();
+
+        for (unsigned int i = 0; i < MAX_CPUS; i++)
+        {
+            const SchedCpuStats& stats = cpus[i].stats;
+
+            telemetry.picks += __atomic_load_n(&stats.picks, __ATOMIC_RELAXED);
+            telemetry.context_switches += __atomic_load_n(&stats.context_switches, __ATOMIC_RELAXED);
+            for (unsigned int level = 0; level < 4; level++)
+            {
+                telemetry.queued[level] += __atomic_load_n(&cpus[i].nr_queued[level], __ATOMIC_RELAXED);
+                telemetry.queued_sum[level] += __atomic_load_n(&stats.queued_sum[level], __ATOMIC_RELAXED);
+            }
+            for (unsigned int bucket = 0; bucket < LATENCY_BUCKETS; bucket++)
+            {
+                telemetry.wakeup_latency[bucket] += __atomic_load_n(&stats.wakeup_latency[bucket], __ATOMIC_RELAXED);
+            }
+
+            telemetry.trace_lost += __atomic_load_n(&trace_rings[i].lost, __ATOMIC_RELAXED);
+        }
+    }
+
+    /**
+     * Writes the scheduler's counters to the system log.
+     */
+    void dump_state()
+    {
+        SchedTelemetry telemetry;
+        read_telemetry(telemetry);
+
+        syslog.messagef(LogLevel::DEBUG, "SCHED %s: %lu picks, %lu context switches, %lu trace records lost",
+            name(), telemetry.picks, telemetry.context_switches, telemetry.trace_lost);
+
+        for (unsigned int level = 0; level < 4; level++)
+        {
+            syslog.messagef(LogLevel::DEBUG, "level %u: %lu queued, %lu average",
+                level, telemetry.queued[level], telemetry.picks ? telemetry.queued_sum[level] / telemetry.picks : 0);
+        }
+
+        for (unsigned int i = 0; i < LATENCY_BUCKETS; i++)
+        {
+            if (!telemetry.wakeup_latency[i]) { continue; }
+            syslog.messagef(LogLevel::DEBUG, "wakeup <2^%u cycles: %lu", i + 1, telemetry.wakeup_latency[i]);
         }
-        return NULL;
     }
 
 private:
-    List<SchedulingEntity *> runqueues[4];
+    CpuLinkRunqueue cpus[MAX_CPUS];
+    LinkShard shards[ENTITY_SHARDS];
+    RunqueueLock admission_lock;        // guards dl_bandwidth and dl_entities
+    uint64_t dl_bandwidth[MAX_CPUS] = {};
+    unsigned int dl_entities[MAX_CPUS] = {};
+    WakeHints wake_hints;
+
+    bool tracing = false;
+    SchedTraceRing trace_rings[MAX_CPUS];
+    RunqueueLock trace_read_lock;
+
+    /**
+     * Records an event in this CPU's trace ring buffer, if tracing is enabled.  The run queue
+     * the event was on must be locked.
+     * @param event The event.
+     * @param cpu The CPU whose run queue the event was on.
+     * @param entity The entity the event is about, or NULL if there is none.
+     * @param level The level of the entity.
+     */
+    void trace(SchedTraceEvent event, unsigned int cpu, const SchedulingEntity *entity, unsigned int level)
+    {
+        if (__builtin_expect(!__atomic_load_n(&tracing, __ATOMIC_RELAXED), 1)) { return; }
+
+        SchedTraceRecord record;
+        record.timestamp = read_cycle_counter();
+        record.entity = (uint64_t)(uintptr_t)entity;
+        record.queued = level < 4 ? cpus[cpu].nr_queued[level] : 0;
+        record.event = event;
+        record.level = level;
+        record.cpu = cpu;
+        record.reserved = 0;
+
+        trace_ring_push(trace_rings[current_cpu()], record);
+    }
+
+    /**
+     * Updates a CPU's counters and trace for the entity it has picked.  Its run queue must be locked.
+     * @param cpu The CPU.
+     * @param previous The entity the CPU was running, or NULL.
+     * @param next The entity picked, or NULL if there is nothing to run.
+     */
+    void account_pick(unsigned int cpu, RunqueueLink *previous, RunqueueLink *next)
+    {
+        CpuLinkRunqueue& rq = cpus[cpu];
+        SchedCpuStats& stats = rq.stats;
+
+        stat_add(stats.picks, 1);
+        for (unsigned int level = 0; level < 4; level++) { stat_add(stats.queued_sum[level], rq.nr_queued[level]); }
+
+        if (!next)
+        {
+            trace(TRACE_IDLE, cpu, NULL, 4);
+            return;
+        }
+
+        if (next != previous) { stat_add(stats.context_switches, 1); }
+
+        if (next->wake_time)
+        {
+            record_latency(stats.wakeup_latency, read_cycle_counter() - next->wake_time);
+            next->wake_time = 0;
+        }
+
+        trace(TRACE_PICK, cpu, next->entity, next->level);
+    }
+
+    /**
+     * Returns the shard of the per-entity tables an entity belongs to.
+     */
+    LinkShard& shard_of(const SchedulingEntity& entity)
+    {
+        return shards[entity_shard(&entity)];
+    }
+
+    /**
+     * Makes runnable the entities waiting in a CPU's wakeup queue, in the order they woke up.
+     * It takes out at most a queue's worth, so CPUs that keep pushing cannot hold it here.
+     * Interrupts must be disabled.
+     * @param cpu The CPU whose queue to drain.
+     */
+    void drain_wakeups(unsigned int cpu)
+    {
+        WakeupQueue& queue = cpus[cpu].wakeups;
+        UniqueRunqueueLock wl(queue.lock);
+
+        SchedulingEntity *entity;
+        uint64_t wake_time;
+        for (unsigned int i = 0; i < WAKEUP_QUEUE_SIZE && wakeup_queue_pop(queue, entity, wake_time); i++)
+        {
+            LinkShard& shard = shard_of(*entity);
+            UniqueRunqueueLock sl(shard.lock);
+            enqueue_entity(*entity, wake_time);
+        }
+    }
+
+    /**
+     * Makes every wakeup pushed so far on any CPU take effect.  A CPU part way through draining
+     * its queue has already taken the wakeups out, so this waits for it to finish.  Interrupts
+     * must be disabled, and no shard may be locked.
+     */
+    void flush_wakeups()
+    {
+        for (unsigned int i = 0; i < nr_cpus_online(); i++)
+        {
+            WakeupQueue& queue = cpus[i].wakeups;
+            if (wakeup_queue_empty(queue) && !queue.lock.locked()) { continue; }
+
+            drain_wakeups(i);
+        }
+    }
+
+    /**
+     * Makes an entity runnable, in the deadline class if it has deadline parameters, or else at
+     * its priority level.  The entity's shard must be locked.
+     * @param entity The entity.
+     * @param wake_time The cycle counter when it woke up.
+     */
+    void enqueue_entity(SchedulingEntity& entity, uint64_t wake_time)
+    {
+        LinkShard& shard = shard_of(entity);
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de)
+        {
+            if (de->queued) { return; }
+
+            CpuLinkRunqueue& rq = cpus[de->cpu];
+            UniqueRunqueueLock rl(rq.lock);
+
+            de->wake_time = wake_time;
+            deadline_enqueue(rq.dl, de, sched_clock());
+            __atomic_store_n(&rq.nr_running, rq.nr_running + 1, __ATOMIC_RELAXED);
+            trace(TRACE_ENQUEUE, de->cpu, &entity, 4);
+            return;
+        }
+
+        unsigned int level = entity.priority();
+        if (level >= 4)
+        {
+            syslog.messagef(LogLevel::DEBUG, "Thread priority unknown ?");
+            return;
+        }
+
+        if (shard.links.find(&entity)) { return; }
+
+        RunqueueLink *link = alloc_link(shard);
+        if (!link)
+        {
+            syslog.messagef(LogLevel::ERROR, "Out of memory for run queue link");
+            return;
+        }
+
+        link->entity = &entity;
+        if (!shard.links.insert(link))
+        {
+            free_link(shard, link);
+            syslog.messagef(LogLevel::ERROR, "Out of memory for run queue link");
+            return;
+        }
+
+        unsigned int cpu = MAX_CPUS;
+        unsigned int last_level;
+        bool slice_used;
+        if (wake_hints.lookup(&entity, cpu, last_level, slice_used) && mlfq_mode && level != (unsigned int)SchedulingEntityPriority::REALTIME)
+        {
+            // a thread that slept before using up its slice goes up a level, but no higher than
+            // interactive, and one that used it all goes back to the level it was at
+            unsigned int interactive = SchedulingEntityPriority::INTERACTIVE;
+            if (slice_used) { level = last_level; }
+            else { level = last_level > interactive ? last_level - 1 : interactive; }
+        }
+
+        cpu = select_cpu(cpu);
+        CpuLinkRunqueue& rq = cpus[cpu];
+        UniqueRunqueueLock rl(rq.lock);
+
+        link->level = level;
+        link->cpu = cpu;
+        link->wake_time = wake_time;
+        link->level_runtime = 0;
+
+        enqueue(rq, link);
+        trace(TRACE_ENQUEUE, cpu, &entity, link->level);
+    }
+
+    /**
+     * Makes an entity no longer runnable, in whichever class it is in.  The entity's shard must
+     * be locked.
+     * @return Returns true if the entity was runnable.
+     */
+    bool dequeue_entity(SchedulingEntity& entity)
+    {
+        LinkShard& shard = shard_of(entity);
+        DeadlineEntity *de = shard.deadlines.find(&entity);
+        if (de && de->queued)
+        {
+            CpuLinkRunqueue& rq = cpus[de->cpu];
+            UniqueRunqueueLock rl(rq.lock);
+
+            // charge it for the time it ran before it stopped
+            if (rq.dl.running == de) { deadline_charge(rq.dl, sched_clock()); }
+
+            deadline_dequeue(rq.dl, de);
+            __atomic_store_n(&rq.nr_running, rq.nr_running - 1, __ATOMIC_RELAXED);
+            trace(TRACE_DEQUEUE, de->cpu, &entity, 4);
+            return true;
+        }
+
+        RunqueueLink *link = shard.links.find(&entity);
+        if (!link) { return false; }
+
+        // the link may be pulled to another CPU until its run queue is locked
+        CpuLinkRunqueue *rq;
+        while (true)
+        {
+            unsigned int cpu = __atomic_load_n(&link->cpu, __ATOMIC_RELAXED);
+            rq = &cpus[cpu];
+            rq->lock.lock();
+            if (link->cpu == cpu) { break; }
+            rq->lock.unlock();
+        }
+
+        // an entity into the last quantum of its slice has used it up
+        if (link == rq->current)
+        {
+            charge_current(*rq);
+            set_current(*rq, NULL);
+        }
+        bool slice_used = link->level_runtime + MLFQ_QUANTUM >= mlfq_timeslices[link->level] * MLFQ_QUANTUM;
+
+        dequeue(*rq, link);
+        trace(TRACE_DEQUEUE, link->cpu, &entity, link->level);
+        rq->lock.unlock();
+
+        wake_hints.record(&entity, link->cpu, link->level, slice_used);
+        shard.links.remove(&entity);
+        free_link(shard, link);
+        return true;
+    }
+
+    /**
+     * Finds a CPU with room to reserve a deadline entity's bandwidth, preferring the one it
+     * is already on, and moves its reservation there.  The entity's shard must be locked.
+     * @param de The entity, or NULL if it is not in the deadline class yet.
+     * @param bandwidth The bandwidth it needs.
+     * @return Returns the CPU, or MAX_CPUS if none has room, in which case nothing is reserved.
+     */
+    unsigned int admit_deadline(const DeadlineEntity *de, uint64_t bandwidth)
+    {
+        uint64_t limit = (DEADLINE_BANDWIDTH_PERCENT << BANDWIDTH_SHIFT) / 100;
+        UniqueRunqueueLock al(admission_lock);
+
+        unsigned int cpu = MAX_CPUS;
+        if (de && dl_bandwidth[de->cpu] - de->bandwidth + bandwidth <= limit) { cpu = de->cpu; }
+
+        // a CPU's deadline heaps only have room for so many entities
+        for (unsigned int i = 0; cpu == MAX_CPUS && i < nr_cpus_online(); i++)
+        {
+            if (de && i == de->cpu) { continue; }
+            if (dl_bandwidth[i] + bandwidth <= limit && dl_entities[i] < DEADLINE_MAX_ENTITIES) { cpu = i; }
+        }
+        if (cpu == MAX_CPUS) { return MAX_CPUS; }
+
+        if (de)
+        {
+            dl_bandwidth[de->cpu] -= de->bandwidth;
+            dl_entities[de->cpu]--;
+        }
+        dl_bandwidth[cpu] += bandwidth;
+        dl_entities[cpu]++;
+        return cpu;
+    }
+
+    /**
+     * Takes an entity that is not runnable out of the deadline class.  The entity's shard must
+     * be locked.
+     */
+    void release_deadline(DeadlineEntity *de)
+    {
+        admission_lock.lock();
+        dl_bandwidth[de->cpu] -= de->bandwidth;
+        dl_entities[de->cpu]--;
+        admission_lock.unlock();
+
+        shard_of(*de->entity).deadlines.remove(de->entity);
+        free_record(de);
+    }
+
+    /**
+     * Updates a CPU's counters and trace for the deadline entity it has picked, and starts
+     * charging it for its time.  Its run queue must be locked.
+     */
+    void account_deadline_pick(unsigned int cpu, DeadlineEntity *de, uint64_t now)
+    {
+        CpuLinkRunqueue& rq = cpus[cpu];
+        SchedCpuStats& stats = rq.stats;
+
+        stat_add(stats.picks, 1);
+        if (rq.dl.running != de)
+        {
+            stat_add(stats.context_switches, 1);
+            rq.dl.running = de;
+            rq.dl.running_since = now;
+        }
+
+        if (de->wake_time)
+        {
+            record_latency(stats.wakeup_latency, read_cycle_counter() - de->wake_time);
+            de->wake_time = 0;
+        }
+
+        trace(TRACE_PICK_DEADLINE, cpu, de->entity, 4);
+    }
+
+    /**
+     * Takes a link from a shard's free list, so that threads waking and sleeping reuse the
+     * links of earlier ones rather than allocating.  The list only grows from the slab caches
+     * when it is empty.  The shard must be locked.
+     * @return Returns the link, or NULL if memory ran out.
+     */
+    RunqueueLink *alloc_link(LinkShard& shard)
+    {
+        RunqueueLink *link = shard.free_links;
+        if (!link) { return alloc_record<RunqueueLink>(); }
+
+        shard.free_links = link->next;
+        return link;
+    }
+
+    void free_link(LinkShard& shard, RunqueueLink *link)
+    {
+        link->entity = NULL;
+        link->next = shard.free_links;
+        shard.free_links = link;
+    }
+
+    /**
+     * Chooses the CPU a waking entity should run on: the one it last ran on if that is known,
+     * or else the one with the least to do.
+     * @param last_cpu The CPU the entity last ran on, or MAX_CPUS if it is not known.
+     */
+    unsigned int select_cpu(unsigned int last_cpu)
+    {
+        if (last_cpu < nr_cpus_online()) { return last_cpu; }
+
+        unsigned int cpu = 0;
+        for (unsigned int i = 1; i < nr_cpus_online(); i++)
+        {
+            if (__atomic_load_n(&cpus[i].nr_running, __ATOMIC_RELAXED) < __atomic_load_n(&cpus[cpu].nr_running, __ATOMIC_RELAXED)) { cpu = i; }
+        }
+        return cpu;
+    }
+
+    /**
+     * Adds a link to the back of its level's queue on a CPU, which is just behind its head.
+     */
+    void enqueue(CpuLinkRunqueue& rq, RunqueueLink *link)
+    {
+        unsigned int level = link->level;
+        RunqueueLink *head = rq.levels[level];
+
+        if (!head)
+        {
+            link->prev = link->next = link;
+            rq.levels[level] = link;
+            rq.nonempty_levels |= 1u << level;
+        }
+        else
+        {
+            link->prev = head->prev;
+            link->next = head;
+            head->prev->next = link;
+            head->prev = link;
+        }
+
+        __atomic_store_n(&rq.nr_queued[level], rq.nr_queued[level] + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rq.nr_running, rq.nr_running + 1, __ATOMIC_RELAXED);
+    }
+
+    void dequeue(CpuLinkRunqueue& rq, RunqueueLink *link)
+    {
+        unsigned int level = link->level;
+
+        if (link->next == link)
+        {
+            rq.levels[level] = NULL;
+            rq.nonempty_levels &= ~(1u << level);
+        }
+        else
+        {
+            link->prev->next = link->next;
+            link->next->prev = link->prev;
+            if (rq.levels[level] == link) { rq.levels[level] = link->next; }
+        }
+
+        __atomic_store_n(&rq.nr_queued[level], rq.nr_queued[level] - 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&rq.nr_running, rq.nr_running - 1, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Moves a CPU's runtime clock on by the CPU time its current entity has run since it was
+     * last charged.  Its run queue must be locked.
+     */
+    void charge_current(CpuLinkRunqueue& rq)
+    {
+        if (!rq.current) { return; }
+
+        SchedulingEntity::EntityRuntime runtime = rq.current->entity->cpu_runtime();
+        rq.busy_time += runtime - rq.last_runtime;
+        rq.current->level_runtime += runtime - rq.last_runtime;
+        rq.last_runtime = runtime;
+    }
+
+    void set_current(CpuLinkRunqueue& rq, RunqueueLink *link)
+    {
+        rq.current = link;
+        __atomic_store_n(&rq.current_level, link ? link->level : 4, __ATOMIC_RELAXED);
+    }
+
+    /**
+     * Moves an entity that has used up its slice down a level, to the back of that level's
+     * queue, with a fresh slice.  Realtime entities and those already at the bottom stay where
+     * they are, which is already at the back of their queue.
+     */
+    void demote(CpuLinkRunqueue& rq, RunqueueLink *link)
+    {
+        link->level_runtime = 0;
+        if (link->level == SchedulingEntityPriority::REALTIME || link->level == SchedulingEntityPriority::DAEMON) { return; }
+
+        dequeue(rq, link);
+        link->level++;
+        enqueue(rq, link);
+
+        if (link == rq.current) { set_current(rq, link); }
+    }
+
+    /**
+     * Moves every entity below the interactive level up to it, so that CPU-bound threads that
+     * have sunk to the bottom are not starved, and threads whose behaviour has changed get
+     * another chance to show it.  The boosted entities go ahead of those already interactive,
+     * bottom level first, since they have waited longest, so a crowd of short threads at the
+     * interactive level cannot keep them waiting past the boost.
+     */
+    void boost(CpuLinkRunqueue& rq)
+    {
+        for (unsigned int level = SchedulingEntityPriority::NORMAL; level <= SchedulingEntityPriority::DAEMON; level++)
+        {
+            RunqueueLink *head = rq.levels[level];
+            if (!head) { continue; }
+
+            RunqueueLink *link = head;
+            do
+            {
+                link->level = SchedulingEntityPriority::INTERACTIVE;
+                link->level_runtime = 0;
+                link = link->next;
+            } while (link != head);
+
+            // splice the whole queue onto the front of the interactive one
+            RunqueueLink *target = rq.levels[SchedulingEntityPriority::INTERACTIVE];
+            if (target)
+            {
+                RunqueueLink *tail = head->prev;
+                target->prev->next = head;
+                head->prev = target->prev;
+                tail->next = target;
+                target->prev = tail;
+            }
+            rq.levels[SchedulingEntityPriority::INTERACTIVE] = head;
+
+            rq.levels[level] = NULL;
+            rq.nonempty_levels &= ~(1u << level);
+            rq.nonempty_levels |= 1u << SchedulingEntityPriority::INTERACTIVE;
+
+            __atomic_store_n(&rq.nr_queued[SchedulingEntityPriority::INTERACTIVE], rq.nr_queued[SchedulingEntityPriority::INTERACTIVE] + rq.nr_queued[level], __ATOMIC_RELAXED);
+            __atomic_store_n(&rq.nr_queued[level], 0u, __ATOMIC_RELAXED);
+        }
+
+        if (rq.current) { set_current(rq, rq.current); }
+    }
+
+    /**
+     * Returns the number of entities waiting to run at a level on a CPU, not counting the one
+     * it is running.  This is read without the CPU's lock, so it is only a hint.
+     */
+    unsigned int nr_waiting(const CpuLinkRunqueue& rq, unsigned int level) const
+    {
+        unsigned int queued = __atomic_load_n(&rq.nr_queued[level], __ATOMIC_RELAXED);
+
+        if (queued && __atomic_load_n(&rq.current_level, __ATOMIC_RELAXED) == level) { queued--; }
+        return queued;
+    }
+
+    /**
+     * Balances a CPU against the others, by pulling over one entity waiting at the highest
+     * priority level where the busiest CPU has more waiting than this CPU has queued.
+     * @param cpu The CPU to pull work to.
+     */
+    void pull_entity(unsigned int cpu)
+    {
+        CpuLinkRunqueue& dst = cpus[cpu];
+
+        for (unsigned int level = 0; level < 4; level++)
+        {
+            unsigned int queued = __atomic_load_n(&dst.nr_queued[level], __ATOMIC_RELAXED);
+            unsigned int busiest = MAX_CPUS;
+            unsigned int busiest_waiting = queued;
+
+            for (unsigned int i = 0; i < nr_cpus_online(); i++)
+            {
+                if (i == cpu) { continue; }
+
+                unsigned int waiting = nr_waiting(cpus[i], level);
+                if (waiting > busiest_waiting)
+                {
+                    busiest = i;
+                    busiest_waiting = waiting;
+                }
+            }
+
+            if (busiest < MAX_CPUS && migrate_entity(busiest, cpu, level)) { return; }
+        }
+    }
+
+    /**
+     * Moves the next entity to run at a level on one CPU, unless it is running there, to the
+     * back of the same level on another.
+     * @return Returns true if an entity was moved.
+     */
+    bool migrate_entity(unsigned int from, unsigned int to, unsigned int level)
+    {
+        CpuLinkRunqueue& src = cpus[from];
+        CpuLinkRunqueue& dst = cpus[to];
+
+        // always lock the lower-numbered CPU first
+        UniqueRunqueueLock l1(from < to ? src.lock : dst.lock);
+        UniqueRunqueueLock l2(from < to ? dst.lock : src.lock);
+
+        // check again under the locks, now that nothing can change
+        bool running_here = src.current && src.current->level == level;
+        if (src.nr_queued[level] - running_here <= dst.nr_queued[level]) { return false; }
+
+        RunqueueLink *link = src.levels[level];
+        if (link == src.current) { link = link->next; }
+
+        dequeue(src, link);
+        __atomic_store_n(&link->cpu, to, __ATOMIC_RELAXED);
+        enqueue(dst, link);
+        trace(TRACE_MIGRATE, to, link->entity, level);
+        return true;
+    }
 };
 
 /* --- DO NOT CHANGE ANYTHING BELOW THIS LINE --- */
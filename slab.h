@@ -0,0 +1,23 @@
+/*
+ * The general purpose slab caches, which are kept by the buddy allocator in buddy.cpp.  Other
+ * kernel code uses these to allocate its small objects without going to the page allocator for
+ * each one.
+ */
+#pragma once
+
+#include <infos/define.h>
+
+/**
+ * Allocates a small object from the general purpose slab caches.
+ * @param size The size of the object, in bytes, of at most 2KiB.
+ * @return Returns the object, or NULL if it is too large, memory ran out, or the buddy allocator
+ * is not running.
+ */
+void* slab_alloc(uint64_t size);
+
+/**
+ * Frees an object allocated by slab_alloc().
+ * @param object The object.
+ * @param size The size it was allocated with.
+ */
+void slab_free(void* object, uint64_t size);
\ No newline at end of file